@@ -6,23 +6,48 @@
 
 #define GRID_CELL_BORDER_COLOR (vec3(40.0, 117.0, 188.0)/255.0)
 
-uniform vec3 lightPos;
-uniform vec3 cameraPos;
-uniform bool hasTexture;
-
-uniform bool forceColor;
-uniform vec3 forcedColor;
-
-uniform bool gridEnabled;
-uniform vec3 cursorPos;
-
-uniform int shininess;
-
-uniform float farPlane;
-
-uniform bool hasNormalMap;
-
-uniform samplerCube shadowMap;
+// uniform blocks, keep in sync with FrameUniforms/PassUniforms/DrawUniforms
+struct Light {
+    vec3 pos;
+    bool paraboloid; // dual-paraboloid shadows, faces 0 and 1 are the -Y and +Y hemispheres
+    mat4 shadowFaceViewProj[6];
+    vec4 shadowTileRects[6]; // atlas offset in xy, size in z, half a texel of the tile in w
+};
+
+// MAX_LIGHTS lights
+layout (std140) uniform FrameData {
+    int numLights;
+    float farPlane;
+    Light lights[8];
+};
+
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos;
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
+
+struct Draw {
+    // dequantization of 16-bit packed positions, identity for float positions
+    vec3 posScale;
+    // packed vertices carry the bitangent's sign in vTangent.w instead of vBitangent
+    bool packedVertices;
+    vec3 posOffset;
+    bool hasTexture;
+    vec3 forcedColor;
+    bool hasNormalMap;
+    bool forceColor;
+    bool gridEnabled;
+};
+
+// DRAWS_PER_BLOCK draws, instances pick theirs with InstanceData::draw_index
+layout (std140) uniform DrawData {
+    Draw draws[256];
+};
+
+uniform sampler2D shadowMap; // shadow atlas
 uniform sampler2D ditherPattern;
 uniform sampler2D normalMap;
 uniform sampler2D textureA;
@@ -30,6 +55,7 @@ uniform sampler2D textureA;
 smooth in vec3 normal;
 smooth in vec3 fragPos;
 smooth in vec2 texCoords;
+flat in int drawIndex;
 
 in mat3 TBN;
 
@@ -55,18 +81,40 @@ float is_shadowed(vec4 pos_from_light) {
     return pos.z > occluder ? 1.0 : 0.0;
 }*/
 
-float is_shadowed(vec3 pos, vec3 normal) {
-    vec3 pos_from_light = pos - lightPos; // 0, -3.5, 0
+float is_shadowed(Light light, vec3 pos, vec3 normal) {
+    vec3 pos_from_light = pos - light.pos; // 0, -3.5, 0
+
+    // the cube face pos is seen through, faces are +X -X +Y -Y +Z -Z
+    vec3 dist = abs(pos_from_light);
+    int face;
+    if (light.paraboloid) face = pos_from_light.y < 0.0 ? 0 : 1;
+    else if (dist.x >= dist.y && dist.x >= dist.z) face = pos_from_light.x > 0.0 ? 0 : 1;
+    else if (dist.y >= dist.z) face = pos_from_light.y > 0.0 ? 2 : 3;
+    else face = pos_from_light.z > 0.0 ? 4 : 5;
+
+    vec4 tile = light.shadowTileRects[face];
+    if (tile.z == 0.0) return 0.0; // the face has no tile or wasn't drawn yet
+
+    vec2 uv;
+    if (light.paraboloid) {
+        // same projection as shadow_paraboloid_geom.glsl, the face's matrix is its view
+        vec3 dir = normalize(mat3(light.shadowFaceViewProj[face]) * pos_from_light);
+        uv = dir.xy / (1.0 - dir.z) * 0.5 + 0.5;
+    } else {
+        vec4 clip = light.shadowFaceViewProj[face] * vec4(pos, 1.0);
+        uv = clip.xy / clip.w * 0.5 + 0.5;
+    }
+    uv = clamp(uv, tile.w, 1.0 - tile.w);
 
     // get first occluder from light's POV
-    float occluder = texture(shadowMap, pos_from_light.xyz).r; // [0, 1], o mais escuro possivel
+    float occluder = texture(shadowMap, tile.xy + uv * tile.z).r; // [0, 1], o mais escuro possivel
 
     // transform occluder from [0,1] to [0,farPlane]
     occluder *= farPlane;
 
-    //float cos_theta = clamp(dot(normal, normalize(lightPos - pos)), 0.0, 1.0);
+    //float cos_theta = clamp(dot(normal, normalize(light.pos - pos)), 0.0, 1.0);
     //float bias = clamp(0.01*tan(acos(cos_theta)), 0.0, 0.05);
-    float bias = max(0.005 * (1.0 - dot(normal, normalize(lightPos - pos))), 0.0005);  
+    float bias = max(0.005 * (1.0 - dot(normal, normalize(light.pos - pos))), 0.0005);  
     
     return (length(pos_from_light) - bias > occluder) ? 1.0 : 0.0;
 }
@@ -77,19 +125,20 @@ vec3 dither(vec3 og_color)  {
 }
 
 void main() {
+    Draw draw = draws[drawIndex];
     vec3 objColor = vec3(1.0);
 
-    if (hasTexture)
+    if (draw.hasTexture)
         objColor = texture(textureA, texCoords).rgb;
 
-    if (forceColor)
-        objColor = forcedColor;
+    if (draw.forceColor)
+        objColor = draw.forcedColor;
 
     //vec3 lightColor = vec3(1.0, 1.0, 1.0);
     vec3 lightColor = vec3(1.0, 1.0, 1.0) * 3.0;
 
     vec3 norm;
-    if (hasNormalMap) {
+    if (draw.hasNormalMap) {
         norm = texture(normalMap, texCoords).rgb * 2.0 - 1.0;
         norm = normalize(TBN * normalize(norm));
 	} else {
@@ -103,33 +152,36 @@ void main() {
     //gl_FragColor = vec4(norm, 1.0);
 
     
-    vec3 lightDir = normalize(lightPos - fragPos);
-    float dist = length(lightPos - fragPos);
-
     // ambient
     vec3 ambientContrib = 0.005 * lightColor;
 
-    // diffuse
-    float diffuseTmp = max(dot(norm, lightDir), 0.0);
-    vec3 diffuseContrib = diffuseTmp * lightColor;
+    vec3 result = ambientContrib * objColor;
+    for (int i = 0; i < numLights; i++) {
+        vec3 lightDir = normalize(lights[i].pos - fragPos);
+        float dist = length(lights[i].pos - fragPos);
 
-    // specular (TODO: review this)
-    //float specularTmp = 0.5;
-    //vec3 cameraDir = normalize(cameraPos - fragPos);
-    //vec3 reflectDir = reflect(-lightDir, norm); 
-    //specularTmp = specularTmp * pow(max(dot(cameraDir, reflectDir), 0.0), shininess);
-    //vec3 specularContrib = specularTmp * lightColor;
+        // diffuse
+        float diffuseTmp = max(dot(norm, lightDir), 0.0);
+        vec3 diffuseContrib = diffuseTmp * lightColor;
 
-    // TODO: play with attenuation values
-    float attenuation = 10.0 / (dist * dist);
-    
-    vec3 result = ((diffuseContrib * (1.0 - is_shadowed(fragPos, norm)) * attenuation) + ambientContrib) * objColor;
+        // specular (TODO: review this)
+        //float specularTmp = 0.5;
+        //vec3 cameraDir = normalize(cameraPos - fragPos);
+        //vec3 reflectDir = reflect(-lightDir, norm); 
+        //specularTmp = specularTmp * pow(max(dot(cameraDir, reflectDir), 0.0), shininess);
+        //vec3 specularContrib = specularTmp * lightColor;
+
+        // TODO: play with attenuation values
+        float attenuation = 10.0 / (dist * dist);
+
+        result += diffuseContrib * (1.0 - is_shadowed(lights[i], fragPos, norm)) * attenuation * objColor;
+    }
     //vec3 result = ((diffuseContrib * (1.0 - 0.0) * attenuation) + ambientContrib) * objColor;
     //vec3 result = objColor;
     //gl_FragColor = vec4(is_shadowed(fragPos, norm), 0.0, 0.0, 1.0);
 
     // draw grid
-    //if (gridEnabled) {
+    //if (draw.gridEnabled) {
         //float dist = length(cursorPos - fragPos);
         //vec3 targetColor = mix(GRID_CELL_BORDER_COLOR, result, smoothstep(0.0, GRID_HIGHLIGHT_SIZE, float(dist)));
         //float x_offset = abs(fragPos.x - round(fragPos.x / GRID_CELL_SIZE) * GRID_CELL_SIZE);
@@ -1,10 +1,30 @@
 #version 330
 
-uniform vec3 lightPos;
-uniform float farPlane;
+// uniform blocks, keep in sync with FrameUniforms/PassUniforms
+struct Light {
+    vec3 pos;
+    bool paraboloid;
+    mat4 shadowFaceViewProj[6];
+    vec4 shadowTileRects[6]; // atlas offset in xy, size in z, half a texel of the tile in w
+};
+
+// MAX_LIGHTS lights
+layout (std140) uniform FrameData {
+    int numLights;
+    float farPlane;
+    Light lights[8];
+};
+
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos; // the light's
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
 
 in vec4 fragPos;
 
 void main() {
-	gl_FragDepth = length(fragPos.xyz - lightPos) / farPlane;
+	gl_FragDepth = length(fragPos.xyz - cameraPos) / farPlane;
 }
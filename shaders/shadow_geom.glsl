@@ -0,0 +1,35 @@
+#version 330
+#extension GL_ARB_viewport_array : require
+
+// Layered shadow cube pass: emits each triangle once per cube face its
+// instance overlaps, into the viewport of the face's atlas tile. The vertex
+// shader's gl_Position is the world position.
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 18) out;
+
+// uniform blocks, keep in sync with PassUniforms
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos;
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
+
+flat in int faceMask[];
+
+out vec4 fragPos;
+
+void main() {
+    for (int face = 0; face < 6; face++) {
+        if ((faceMask[0] & (1 << face)) == 0) continue;
+        for (int i = 0; i < 3; i++) {
+            fragPos = gl_in[i].gl_Position;
+            gl_Position = cubeViewProj[face] * fragPos;
+            gl_ViewportIndex = face;
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
@@ -0,0 +1,52 @@
+#version 330
+
+// Dual-paraboloid shadow pass for one hemisphere: cubeViewProj[face] is
+// the hemisphere's view matrix, triangles are projected onto the paraboloid
+// around its -Z axis and clipped against the plane between the
+// hemispheres. Like shadow_geom.glsl, gl_Position comes in world space.
+
+layout (triangles) in;
+layout (triangle_strip, max_vertices = 6) out;
+
+// uniform blocks, keep in sync with FrameUniforms/PassUniforms
+struct Light {
+    vec3 pos;
+    bool paraboloid;
+    mat4 shadowFaceViewProj[6];
+    vec4 shadowTileRects[6];
+};
+
+// MAX_LIGHTS lights
+layout (std140) uniform FrameData {
+    int numLights;
+    float farPlane;
+    Light lights[8];
+};
+
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos;
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
+
+flat in int faceMask[];
+
+out vec4 fragPos;
+
+void main() {
+    for (int face = 0; face < 2; face++) {
+        if ((faceMask[0] & (1 << face)) == 0) continue;
+        for (int i = 0; i < 3; i++) {
+            fragPos = gl_in[i].gl_Position;
+            vec3 view = (cubeViewProj[face] * fragPos).xyz;
+            float dist = length(view);
+            vec3 dir = view / dist;
+            gl_Position = vec4(dir.xy / max(1.0 - dir.z, 1e-4), dist / farPlane * 2.0 - 1.0, 1.0);
+            gl_ClipDistance[0] = -dir.z;
+            EmitVertex();
+        }
+        EndPrimitive();
+    }
+}
@@ -1,14 +1,48 @@
 #version 330
 
-// TODO: separate view_proj ???
-uniform mat4 model;
-uniform mat4 view_proj;
+// uniform blocks, keep in sync with PassUniforms/DrawUniforms
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos;
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
+
+struct Draw {
+    // dequantization of 16-bit packed positions, identity for float positions
+    vec3 posScale;
+    // packed vertices carry the bitangent's sign in vTangent.w instead of vBitangent
+    bool packedVertices;
+    vec3 posOffset;
+    bool hasTexture;
+    vec3 forcedColor;
+    bool hasNormalMap;
+    bool forceColor;
+    bool gridEnabled;
+};
+
+// DRAWS_PER_BLOCK draws, instances pick theirs with InstanceData::draw_index
+layout (std140) uniform DrawData {
+    Draw draws[256];
+};
 
 layout (location = 0) in vec3 vPos;
 
+// per-instance attributes, keep in sync with InstanceData
+layout (location = 5) in vec4 iModelRow0;
+layout (location = 6) in vec4 iModelRow1;
+layout (location = 7) in vec4 iModelRow2;
+layout (location = 8) in vec4 iParams; // shininess, scaleTexCoords, draw index, cube face mask
+
 out vec4 fragPos;
+flat out int faceMask; // for shadow_geom.glsl
 
 void main() {
-    fragPos = model * vec4(vPos, 1.0);
+    Draw draw = draws[int(iParams.z)];
+    mat4 model = transpose(mat4(iModelRow0, iModelRow1, iModelRow2, vec4(0.0, 0.0, 0.0, 1.0)));
+    fragPos = model * vec4(vPos * draw.posScale + draw.posOffset, 1.0);
+    // view_proj is the identity in layered passes, which project per face
     gl_Position = view_proj * fragPos;
+    faceMask = int(iParams.w);
 }
@@ -1,40 +1,73 @@
 #version 330
 
-// TODO: separate view_proj ???
-uniform mat4 model;
-uniform mat4 view_proj;
-uniform mat4 shadow_map_matrix; // for shadow mapping
+// uniform blocks, keep in sync with PassUniforms/DrawUniforms
+layout (std140) uniform PassData {
+    mat4 view_proj;
+    mat4 shadow_map_matrix; // for shadow mapping
+    vec3 cameraPos;
+    vec3 cursorPos;
+    mat4 cubeViewProj[6]; // faces of a layered shadow cube pass
+};
 
-uniform float scaleTexCoords;
+struct Draw {
+    // dequantization of 16-bit packed positions, identity for float positions
+    vec3 posScale;
+    // packed vertices carry the bitangent's sign in vTangent.w instead of vBitangent
+    bool packedVertices;
+    vec3 posOffset;
+    bool hasTexture;
+    vec3 forcedColor;
+    bool hasNormalMap;
+    bool forceColor;
+    bool gridEnabled;
+};
 
-uniform bool hasNormalMap;
+// DRAWS_PER_BLOCK draws, instances pick theirs with InstanceData::draw_index
+layout (std140) uniform DrawData {
+    Draw draws[256];
+};
 
 layout (location = 0) in vec3 vPos;
 layout (location = 1) in vec3 vNormal;
 layout (location = 2) in vec2 vTexCoords;
-layout (location = 3) in vec3 vTangent;
+layout (location = 3) in vec4 vTangent;
 layout (location = 4) in vec3 vBitangent;
 
+// per-instance attributes, keep in sync with InstanceData
+layout (location = 5) in vec4 iModelRow0;
+layout (location = 6) in vec4 iModelRow1;
+layout (location = 7) in vec4 iModelRow2;
+layout (location = 8) in vec4 iParams; // shininess, scaleTexCoords, draw index
+
 smooth out vec3 normal;
 smooth out vec3 fragPos;
 smooth out vec2 texCoords;
+flat out int drawIndex;
 //smooth out vec4 fragPosFromLight;
 
 out mat3 TBN;
 
 void main() {
-    gl_Position = view_proj * model * vec4(vPos, 1.0);
-    fragPos = vec3(model * vec4(vPos, 1.0));
-    if (hasNormalMap) {
-        vec3 T = normalize(vec3(model * vec4(vTangent, 0.0)));
-        vec3 B = normalize(vec3(model * vec4(vBitangent, 0.0)));
+    drawIndex = int(iParams.z);
+    Draw draw = draws[drawIndex];
+    mat4 model = transpose(mat4(iModelRow0, iModelRow1, iModelRow2, vec4(0.0, 0.0, 0.0, 1.0)));
+    vec3 pos = vPos * draw.posScale + draw.posOffset;
+    gl_Position = view_proj * model * vec4(pos, 1.0);
+    fragPos = vec3(model * vec4(pos, 1.0));
+    if (draw.hasNormalMap) {
+        vec3 T = normalize(vec3(model * vec4(vTangent.xyz, 0.0)));
         vec3 N = normalize(vec3(model * vec4(vNormal, 0.0)));
+        vec3 B;
+        if (draw.packedVertices)
+            B = cross(N, T) * vTangent.w;
+        else
+            B = normalize(vec3(model * vec4(vBitangent, 0.0)));
         if (dot(cross(N, T), B) < 0.0)
             T = T * -1.0;
         TBN = mat3(T, B, N);
 	} else {
         normal = mat3(transpose(inverse(model))) * vNormal; //TODO: do this on CPU
 	}
-    texCoords = vTexCoords * scaleTexCoords;
+    texCoords = vTexCoords * iParams.y;
     //fragPosFromLight = shadow_map_matrix * vec4(fragPos, 1.0);
 }
@@ -0,0 +1,235 @@
+// Baked binary meshes.
+//
+// loadModel writes the indexed vertex streams of every OBJ it parses to
+// "<obj>.mesh" and on the next run maps that file instead of parsing the OBJ
+// again. The streams in the mapping are used in place by the Model, so
+// create_object hands the mapped pages straight to glBufferData.
+//
+// Layout: MeshFileHeader followed by the streams, each starting at a
+// MESH_STREAM_ALIGNMENT aligned offset. Bump MESH_FILE_VERSION whenever the
+// layout or the meaning of a stream changes, old files are then re-baked.
+
+#include <stdint.h>
+
+#define MESH_FILE_MAGIC 0x48534d44 // "DMSH"
+#define MESH_FILE_VERSION 5
+#define MESH_STREAM_ALIGNMENT 64
+
+enum MeshStream {
+    MESH_STREAM_POSITIONS,
+    MESH_STREAM_NORMALS,
+    MESH_STREAM_TEXTURE_COORDS,
+    MESH_STREAM_TANGENTS,
+    MESH_STREAM_BITANGENTS,
+    MESH_STREAM_INDICES,
+    MESH_STREAM_COUNT
+};
+
+struct MeshFileHeader {
+    uint32_t magic;
+    uint32_t version;
+
+    // the OBJ this was baked from, to detect stale files
+    int64_t source_size;
+    int64_t source_mtime;
+
+    int32_t face_type;
+    int32_t has_tangents;
+    int32_t num_faces;
+    int32_t num_vertices;
+    int32_t index_size;
+    int32_t num_lods;
+    int32_t lod_num_indices[MODEL_MAX_LODS]; // LODs follow each other in the index stream
+
+    float bounds_min[3];
+    float bounds_max[3];
+
+    uint64_t stream_offsets[MESH_STREAM_COUNT];
+    uint64_t stream_sizes[MESH_STREAM_COUNT];
+};
+
+// Sphere around the center of the bounding box, usually tighter than the
+// box's half diagonal.
+void model_compute_bounding_sphere(Model* model, int num_vertices)
+{
+    glm_vec3_add(model->bounds_min, model->bounds_max, model->bounds_center);
+    glm_vec3_scale(model->bounds_center, 0.5f, model->bounds_center);
+
+    float radius2 = 0.0f;
+    for (int i = 0; i < num_vertices; i++) {
+        float d2 = glm_vec3_distance2(model->bounds_center, model->vertices[i]);
+        if (d2 > radius2) radius2 = d2;
+    }
+    model->bounds_radius = sqrtf(radius2);
+}
+
+void model_compute_bounds(Model* model, int num_vertices)
+{
+    if (num_vertices == 0) {
+        glm_vec3_zero(model->bounds_min);
+        glm_vec3_zero(model->bounds_max);
+        model_compute_bounding_sphere(model, 0);
+        return;
+    }
+
+    glm_vec3_copy(model->vertices[0], model->bounds_min);
+    glm_vec3_copy(model->vertices[0], model->bounds_max);
+    for (int i = 1; i < num_vertices; i++) {
+        glm_vec3_minv(model->bounds_min, model->vertices[i], model->bounds_min);
+        glm_vec3_maxv(model->bounds_max, model->vertices[i], model->bounds_max);
+    }
+    model_compute_bounding_sphere(model, num_vertices);
+}
+
+static void baked_mesh_streams(Model* model, const void* streams[MESH_STREAM_COUNT],
+                               uint64_t sizes[MESH_STREAM_COUNT])
+{
+    uint64_t num_vertices = (uint64_t) model->num_vertices;
+
+    streams[MESH_STREAM_POSITIONS] = model->vertices;
+    sizes[MESH_STREAM_POSITIONS] = num_vertices * sizeof(vec3);
+    streams[MESH_STREAM_NORMALS] = model->normals;
+    sizes[MESH_STREAM_NORMALS] = num_vertices * sizeof(vec3);
+    streams[MESH_STREAM_TEXTURE_COORDS] = model->texture_coords;
+    sizes[MESH_STREAM_TEXTURE_COORDS] = num_vertices * sizeof(vec2);
+    streams[MESH_STREAM_TANGENTS] = model->has_tangents ? model->tangents : NULL;
+    sizes[MESH_STREAM_TANGENTS] = model->has_tangents ? num_vertices * sizeof(vec3) : 0;
+    streams[MESH_STREAM_BITANGENTS] = model->has_tangents ? model->bitangents : NULL;
+    sizes[MESH_STREAM_BITANGENTS] = model->has_tangents ? num_vertices * sizeof(vec3) : 0;
+    streams[MESH_STREAM_INDICES] = model->indices;
+    sizes[MESH_STREAM_INDICES] = (uint64_t) model_num_indices(model) * model->index_size;
+}
+
+bool bake_model(Model* model, const char* baked_filename, const char* source_filename)
+{
+    MeshFileHeader header = {};
+    header.magic = MESH_FILE_MAGIC;
+    header.version = MESH_FILE_VERSION;
+
+    long long source_size, source_mtime;
+    if (!file_stat(source_filename, &source_size, &source_mtime)) return false;
+    header.source_size = source_size;
+    header.source_mtime = source_mtime;
+
+    header.face_type = model->face_type;
+    header.has_tangents = model->has_tangents;
+    header.num_faces = model->num_faces;
+    header.num_vertices = model->num_vertices;
+    header.index_size = model->index_size;
+    header.num_lods = model->num_lods;
+    for (int i = 0; i < model->num_lods; i++) header.lod_num_indices[i] = model->lod_num_indices[i];
+    glm_vec3_copy(model->bounds_min, header.bounds_min);
+    glm_vec3_copy(model->bounds_max, header.bounds_max);
+
+    const void* streams[MESH_STREAM_COUNT];
+    baked_mesh_streams(model, streams, header.stream_sizes);
+
+    uint64_t offset = sizeof(header);
+    for (int i = 0; i < MESH_STREAM_COUNT; i++) {
+        offset = (offset + MESH_STREAM_ALIGNMENT - 1) & ~(uint64_t) (MESH_STREAM_ALIGNMENT - 1);
+        header.stream_offsets[i] = offset;
+        offset += header.stream_sizes[i];
+    }
+
+    FILE* f = fopen(baked_filename, "wb");
+    if (!f) {
+        fprintf(stderr, "Warning: could not write baked mesh '%s'\n", baked_filename);
+        return false;
+    }
+
+    static const char padding[MESH_STREAM_ALIGNMENT] = { 0 };
+    bool ok = fwrite(&header, sizeof(header), 1, f) == 1;
+    uint64_t written = sizeof(header);
+    for (int i = 0; i < MESH_STREAM_COUNT && ok; i++) {
+        ok = fwrite(padding, 1, header.stream_offsets[i] - written, f) == header.stream_offsets[i] - written;
+        if (ok && header.stream_sizes[i]) {
+            ok = fwrite(streams[i], header.stream_sizes[i], 1, f) == 1;
+        }
+        written = header.stream_offsets[i] + header.stream_sizes[i];
+    }
+    fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Warning: could not write baked mesh '%s'\n", baked_filename);
+        remove(baked_filename);
+    }
+
+    return ok;
+}
+
+// Maps a baked mesh into model if it exists and is up to date with its
+// source file. The Model's vertex arrays then point into the mapping.
+bool load_baked_model(Model* model, const char* baked_filename, const char* source_filename,
+                      bool calculate_tangents)
+{
+    MappedFile mapped = map_file(baked_filename);
+    if (!mapped.data) return false;
+
+    const MeshFileHeader* header = (const MeshFileHeader*) mapped.data;
+
+    long long source_size, source_mtime;
+    bool valid = mapped.size >= sizeof(*header) &&
+                 header->magic == MESH_FILE_MAGIC &&
+                 header->version == MESH_FILE_VERSION &&
+                 file_stat(source_filename, &source_size, &source_mtime) &&
+                 header->source_size == source_size &&
+                 header->source_mtime == source_mtime &&
+                 (bool) header->has_tangents == calculate_tangents &&
+                 header->num_faces >= 0 && header->num_vertices >= 0 &&
+                 header->num_lods >= 1 && header->num_lods <= MODEL_MAX_LODS &&
+                 header->lod_num_indices[0] == header->num_faces * 3 &&
+                 (header->index_size == sizeof(unsigned short) ||
+                  header->index_size == sizeof(unsigned int));
+
+    uint64_t num_vertices = valid ? (uint64_t) header->num_vertices : 0;
+    uint64_t num_indices = 0;
+    for (int i = 0; valid && i < header->num_lods; i++) num_indices += header->lod_num_indices[i];
+    uint64_t tangents_size = valid && header->has_tangents ? num_vertices * sizeof(vec3) : 0;
+    valid = valid &&
+            header->stream_sizes[MESH_STREAM_POSITIONS] == num_vertices * sizeof(vec3) &&
+            header->stream_sizes[MESH_STREAM_NORMALS] == num_vertices * sizeof(vec3) &&
+            header->stream_sizes[MESH_STREAM_TEXTURE_COORDS] == num_vertices * sizeof(vec2) &&
+            header->stream_sizes[MESH_STREAM_TANGENTS] == tangents_size &&
+            header->stream_sizes[MESH_STREAM_BITANGENTS] == tangents_size &&
+            header->stream_sizes[MESH_STREAM_INDICES] == num_indices * header->index_size;
+
+    for (int i = 0; valid && i < MESH_STREAM_COUNT; i++) {
+        valid = header->stream_offsets[i] % MESH_STREAM_ALIGNMENT == 0 &&
+                header->stream_offsets[i] + header->stream_sizes[i] <= mapped.size;
+    }
+
+    if (!valid) {
+        unmap_file(&mapped);
+        return false;
+    }
+
+    const char* base = mapped.data;
+    model->face_type = (FaceType) header->face_type;
+    model->num_faces = header->num_faces;
+    model->num_vertices = header->num_vertices;
+    model->indices = (void*) (base + header->stream_offsets[MESH_STREAM_INDICES]);
+    model->index_size = header->index_size;
+    model->index_type = model->index_size == sizeof(unsigned short) ? GL_UNSIGNED_SHORT : GL_UNSIGNED_INT;
+    model->num_lods = header->num_lods;
+    for (int i = 0; i < model->num_lods; i++) {
+        model->lod_first_index[i] = i ? model->lod_first_index[i - 1] + model->lod_num_indices[i - 1] : 0;
+        model->lod_num_indices[i] = header->lod_num_indices[i];
+    }
+    model->vertices = (vec3*) (base + header->stream_offsets[MESH_STREAM_POSITIONS]);
+    model->normals = (vec3*) (base + header->stream_offsets[MESH_STREAM_NORMALS]);
+    model->texture_coords = (vec2*) (base + header->stream_offsets[MESH_STREAM_TEXTURE_COORDS]);
+    model->has_tangents = header->has_tangents;
+    if (model->has_tangents) {
+        model->tangents = (vec3*) (base + header->stream_offsets[MESH_STREAM_TANGENTS]);
+        model->bitangents = (vec3*) (base + header->stream_offsets[MESH_STREAM_BITANGENTS]);
+    }
+    glm_vec3_copy((float*) header->bounds_min, model->bounds_min);
+    glm_vec3_copy((float*) header->bounds_max, model->bounds_max);
+    model_compute_bounding_sphere(model, model->num_vertices);
+    model->baked = mapped;
+
+    printf("Loaded baked mesh '%s': %d faces, %d vertices\n", baked_filename,
+           model->num_faces, model->num_vertices);
+
+    return true;
+}
@@ -0,0 +1,155 @@
+// View frustum culling of objects against a pass's view_proj.
+//
+// Objects are culled by their world space bounding spheres, which
+// object_update_bounds refreshes once per frame. The spheres are gathered
+// into SoA streams and tested against the six frustum planes in batches (8
+// with AVX2, 4 with SSE, scalar otherwise). The scene tree only sends the
+// spheres of leaves it couldn't accept or reject by their boxes.
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+enum SphereStream {
+    SPHERE_X, SPHERE_Y, SPHERE_Z, SPHERE_RADIUS,
+    SPHERE_STREAM_COUNT
+};
+
+// Updates obj's world bounding sphere from its model, position, rotation
+// and scale.
+void object_update_bounds(Object* obj)
+{
+    Model* model = model_get(obj->model_id);
+
+    mat4 mat;
+    glm_mat4_identity(mat);
+    glm_translate(mat, obj->pos);
+    double rad = atan2(-obj->dir[1], obj->dir[0]);
+    vec3 axis = { 0, 1, 0 };
+    glm_rotate(mat, rad, axis);
+    glm_scale_uni(mat, obj->scale);
+
+    glm_mat4_mulv3(mat, model->bounds_center, 1.0f, obj->world_center);
+    obj->world_radius = model->bounds_radius * obj->scale;
+}
+
+// Planes of the frustum of view_proj as (normal, distance), normals point
+// inside. Rows of the matrix are read from cglm's column-major layout.
+void frustum_planes(mat4 view_proj, vec4 planes[6])
+{
+    for (int i = 0; i < 3; i++) {
+        for (int c = 0; c < 4; c++) {
+            planes[i * 2][c] = view_proj[c][3] + view_proj[c][i];
+            planes[i * 2 + 1][c] = view_proj[c][3] - view_proj[c][i];
+        }
+    }
+    for (int p = 0; p < 6; p++) {
+        float length = sqrtf(planes[p][0] * planes[p][0] + planes[p][1] * planes[p][1] +
+                             planes[p][2] * planes[p][2]);
+        for (int c = 0; c < 4; c++) planes[p][c] /= length;
+    }
+}
+
+static int cull_spheres_scalar(float** s, vec4 planes[6], int first, int count, int* visible, int num_visible)
+{
+    for (int i = first; i < first + count; i++) {
+        bool inside = true;
+        for (int p = 0; p < 6 && inside; p++) {
+            float d = planes[p][0] * s[SPHERE_X][i] + planes[p][1] * s[SPHERE_Y][i] +
+                      planes[p][2] * s[SPHERE_Z][i] + planes[p][3];
+            inside = d > -s[SPHERE_RADIUS][i];
+        }
+        if (inside) visible[num_visible++] = i;
+    }
+    return num_visible;
+}
+
+#if defined(__AVX2__)
+#define CULL_BATCH 8
+static int cull_spheres_batch(float** s, vec4 planes[6], int i, int* visible, int num_visible)
+{
+    __m256 x = _mm256_loadu_ps(s[SPHERE_X] + i), y = _mm256_loadu_ps(s[SPHERE_Y] + i);
+    __m256 z = _mm256_loadu_ps(s[SPHERE_Z] + i);
+    __m256 neg_radius = _mm256_sub_ps(_mm256_setzero_ps(), _mm256_loadu_ps(s[SPHERE_RADIUS] + i));
+    __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+        __m256 d = _mm256_add_ps(_mm256_mul_ps(_mm256_set1_ps(planes[p][0]), x), _mm256_set1_ps(planes[p][3]));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(planes[p][1]), y));
+        d = _mm256_add_ps(d, _mm256_mul_ps(_mm256_set1_ps(planes[p][2]), z));
+        inside = _mm256_and_ps(inside, _mm256_cmp_ps(d, neg_radius, _CMP_GT_OQ));
+    }
+    int mask = _mm256_movemask_ps(inside);
+    for (int j = 0; j < CULL_BATCH; j++) {
+        if (mask & (1 << j)) visible[num_visible++] = i + j;
+    }
+    return num_visible;
+}
+#elif defined(__SSE2__)
+#define CULL_BATCH 4
+static int cull_spheres_batch(float** s, vec4 planes[6], int i, int* visible, int num_visible)
+{
+    __m128 x = _mm_loadu_ps(s[SPHERE_X] + i), y = _mm_loadu_ps(s[SPHERE_Y] + i);
+    __m128 z = _mm_loadu_ps(s[SPHERE_Z] + i);
+    __m128 neg_radius = _mm_sub_ps(_mm_setzero_ps(), _mm_loadu_ps(s[SPHERE_RADIUS] + i));
+    __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+    for (int p = 0; p < 6; p++) {
+        __m128 d = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(planes[p][0]), x), _mm_set1_ps(planes[p][3]));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(planes[p][1]), y));
+        d = _mm_add_ps(d, _mm_mul_ps(_mm_set1_ps(planes[p][2]), z));
+        inside = _mm_and_ps(inside, _mm_cmpgt_ps(d, neg_radius));
+    }
+    int mask = _mm_movemask_ps(inside);
+    for (int j = 0; j < CULL_BATCH; j++) {
+        if (mask & (1 << j)) visible[num_visible++] = i + j;
+    }
+    return num_visible;
+}
+#else
+#define CULL_BATCH 1
+static int cull_spheres_batch(float** s, vec4 planes[6], int i, int* visible, int num_visible)
+{
+    return cull_spheres_scalar(s, planes, i, 1, visible, num_visible);
+}
+#endif
+
+// Writes the objects whose bounding spheres intersect the planes to
+// visible, in order, and returns their count.
+int cull_spheres(vec4 planes[6], Object** objects, int num_objects, Object** visible)
+{
+    static float* block = NULL;
+    static int* indices = NULL;
+    static int capacity = 0;
+    if (num_objects > capacity) {
+        capacity = num_objects;
+        block = (float*) realloc(block, (size_t) SPHERE_STREAM_COUNT * capacity * sizeof(float));
+        indices = (int*) realloc(indices, capacity * sizeof(int));
+    }
+    float* s[SPHERE_STREAM_COUNT];
+    for (int i = 0; i < SPHERE_STREAM_COUNT; i++) s[i] = block + (size_t) i * capacity;
+
+    for (int i = 0; i < num_objects; i++) {
+        s[SPHERE_X][i] = objects[i]->world_center[0];
+        s[SPHERE_Y][i] = objects[i]->world_center[1];
+        s[SPHERE_Z][i] = objects[i]->world_center[2];
+        s[SPHERE_RADIUS][i] = objects[i]->world_radius;
+    }
+
+    int num_visible = 0;
+    int batched = num_objects - num_objects % CULL_BATCH;
+    for (int i = 0; i < batched; i += CULL_BATCH) {
+        num_visible = cull_spheres_batch(s, planes, i, indices, num_visible);
+    }
+    num_visible = cull_spheres_scalar(s, planes, batched, num_objects - batched, indices, num_visible);
+
+    for (int i = 0; i < num_visible; i++) visible[i] = objects[indices[i]];
+    return num_visible;
+}
+
+// Tests every object against the frustum of view_proj, see
+// scene_tree_query_frustum for culling a whole scene.
+int frustum_cull(mat4 view_proj, Object** objects, int num_objects, Object** visible)
+{
+    vec4 planes[6];
+    frustum_planes(view_proj, planes);
+    return cull_spheres(planes, objects, num_objects, visible);
+}
@@ -3,8 +3,159 @@
 #define WINDOW_WIDTH 1200
 #define WINDOW_HEIGHT 800
 
-#define MAX_OBJ_SIZE 1000
+// 0 = one thread per core
+#define OBJ_PARSE_THREADS 0
+#define OBJ_PARSE_MIN_CHUNK_SIZE (4 * 1024 * 1024)
+// uncomment to check every parallel OBJ parse against the serial parser
+//#define OBJ_PARSE_CHECK_DETERMINISM
 
-#define SHADOW_MAP_RESOLUTION (1024 * 4)
+// post-transform cache size assumed when reporting ACMR/ATVR
+#define MESH_VCACHE_SIM_SIZE 16
+// sort triangle clusters to reduce overdraw after the vertex cache pass
+#define MESH_OPTIMIZE_OVERDRAW
+
+// coarser LODs built at load time, each with about half the triangles of
+// the previous one, as long as no vertex moves further than MAX_ERROR times
+// the model's size
+#define MODEL_MAX_LODS 4
+#define MESH_LOD_MAX_ERROR 0.02f
+#define MESH_LOD_MIN_REDUCTION 0.8f
+// projected radius (fraction of half the viewport height) below which LOD 1
+// is used, halved for every further LOD
+#define MESH_LOD_SCREEN_SIZE 0.1f
+// LODs coarser than the camera's used for shadow map passes
+#define MESH_LOD_SHADOW_BIAS 1
+
+// upload loaded models as one interleaved, quantized vertex stream
+#define PACKED_VERTEX_FORMAT
+// also quantize positions to 16 bits relative to the model's bounds
+#define PACKED_VERTEX_POSITIONS_16
+
+// uncomment to time spawning this many extra objects at startup
+//#define OBJECT_SPAWN_BENCHMARK 1000
+
+// skinned meshes through Assimp (model2.cpp), needs linking with -lassimp
+//#define SKINNED_MESHES
+#define SKINNED_MAX_INFLUENCES 4
+// uncomment to time loading assets/xbot.fbx and evaluating this many poses
+// of its first animation at startup, needs SKINNED_MESHES
+//#define SKINNED_MESH_BENCHMARK 10000
+
+// models nothing references are unloaded after this many frames
+#define MODEL_UNLOAD_DELAY_FRAMES 120
+
+// appended to the OBJ filename for its baked binary mesh
+#define BAKED_MESH_EXTENSION ".mesh"
+// appended to image filenames for their decoded, mipmapped cache
+#define TEXTURE_CACHE_EXTENSION ".tex"
+
+// load model textures on worker threads, showing a fallback color meanwhile
+#define TEXTURE_STREAMING
+// 0 = one thread per core, minus the GL thread
+#define TEXTURE_STREAM_THREADS 0
+// persistently mapped upload buffers, a texture with mips must fit in a slot
+#define TEXTURE_STREAM_SLOTS 4
+#define TEXTURE_STREAM_SLOT_SIZE (8 * 1024 * 1024)
+// texture bytes uploaded per frame
+#define TEXTURE_STREAM_BUDGET (2 * 1024 * 1024)
+// uncomment to load a batch of textures mid-game and print frame time
+// percentiles, blocking when TEXTURE_STREAMING is off
+//#define TEXTURE_STREAMING_BENCHMARK
+
+// ring buffer the per-pass and per-draw uniform blocks are written to,
+// one pass must fit
+#define UNIFORM_RING_SIZE (8 * 1024 * 1024)
+// stream the per-instance data of every pass goes through, one pass must fit
+#define INSTANCE_STREAM_SIZE (16 * 1024 * 1024)
+
+// skip GL binds that are already current, comment out to compare
+#define GL_STATE_CACHE
+
+// draws per DrawData uniform block, keep in sync with the shaders
+#define DRAWS_PER_BLOCK 256
+
+// draw the meshes in the shared arena with glMultiDrawElementsIndirect when
+// ARB_multi_draw_indirect and ARB_base_instance are there, M toggles it
+#define MULTI_DRAW_INDIRECT
+// capacity of the arena, packed models that don't fit keep their own buffers
+#define MESH_ARENA_VERTICES (256 * 1024)
+#define MESH_ARENA_INDICES (1024 * 1024)
+// stream the indirect commands of every pass go through, one pass must fit
+#define INDIRECT_STREAM_SIZE (1024 * 1024)
+
+// uncomment to add a crowd of this many men to the scene and print frame
+// time percentiles over its first frames
+//#define CROWD_BENCHMARK 10000
+#define CROWD_BENCHMARK_FRAMES 60
+// uncomment to draw every object of the crowd on its own, for
+// CROWD_BENCHMARK_FRAMES frames through multi-draw indirect and as many more
+// through one call per draw, and print the render CPU time of both. Needs
+// CROWD_BENCHMARK.
+//#define MULTI_DRAW_BENCHMARK
+
+// render the six faces of point light shadow cubes in one layered pass
+// instead of one pass per face, needs ARB_viewport_array. L toggles at
+// runtime.
+#define LAYERED_SHADOW_CUBE
+// uncomment to print shadow pass CPU times over CROWD_BENCHMARK_FRAMES
+// frames layered and as many face by face, use with CROWD_BENCHMARK
+//#define LAYERED_SHADOW_BENCHMARK
+
+// keep point lights' static casters in a second shadow atlas, only dynamic
+// casters are drawn each frame. C toggles at runtime.
+#define SHADOW_CACHE
+// the cache is kept while the light stays this close to where it was drawn
+// from. A light that moved further draws all its casters until it has
+// stood still for SHADOW_CACHE_SETTLE_FRAMES frames, then the cache is
+// rebuilt.
+#define SHADOW_CACHE_DRIFT 0.05f
+#define SHADOW_CACHE_SETTLE_FRAMES 10
+// uncomment to print shadow pass GPU times over CROWD_BENCHMARK_FRAMES
+// frames with the cache and as many without, with the light standing
+// still and then moving
+//#define SHADOW_CACHE_BENCHMARK
+
+// scene tree leaves are this much larger than their objects, so objects
+// can move a little without touching the tree
+#define SCENE_TREE_MARGIN 0.5f
+// the tree is rebuilt with SAH once refitting made it this much costlier
+#define SCENE_TREE_REBUILD_RATIO 1.5f
+// uncomment to time updating and querying a scene tree of this many moving
+// objects for SCENE_TREE_BENCHMARK_FRAMES frames at startup
+//#define SCENE_TREE_BENCHMARK 50000
+#define SCENE_TREE_BENCHMARK_FRAMES 60
+
+// lights draw their shadow maps into tiles of one shared depth atlas of
+// this size
+#define SHADOW_ATLAS_SIZE 8192
+// smallest tile the atlas hands out, lights get smaller tiles than they
+// asked for when it's full
+#define SHADOW_ATLAS_MIN_TILE 128
+// store shadow depth in 16 bits instead of 32-bit floats, halves the atlas
+#define SHADOW_DEPTH16
+// default size of each of a light's shadow map faces, R cycles it at runtime
+#define SHADOW_MAP_RESOLUTION 2048
+
+// lights the final pass shades, keep in sync with the shaders
+#define MAX_LIGHTS 8
+// uncomment to scatter this many more point lights over the scene, up to
+// MAX_LIGHTS - 1
+//#define EXTRA_LIGHTS 7
+// shadow cube faces re-rendered per frame over all lights, the others keep
+// what they last held. - and = adjust it at runtime.
+#define SHADOW_FACE_BUDGET 12
+// distance beyond which a light is too dim to weigh in shadow scheduling
+#define LIGHT_RADIUS 30.0f
+// uncomment to print shadow pass GPU times over CROWD_BENCHMARK_FRAMES
+// frames within SHADOW_FACE_BUDGET and as many refreshing every face that
+// needs it, use with EXTRA_LIGHTS
+//#define SHADOW_BUDGET_BENCHMARK
+// uncomment to give point lights dual-paraboloid shadow maps, two
+// hemispheres instead of six cube faces. P toggles it at runtime.
+//#define DUAL_PARABOLOID_SHADOWS
+// uncomment to print shadow pass GPU times over CROWD_BENCHMARK_FRAMES
+// frames with cube shadow maps and as many with dual-paraboloid ones, use
+// with EXTRA_LIGHTS
+//#define SHADOW_PARABOLOID_BENCHMARK
 
 #define FAR_PLANE 300.0f
\ No newline at end of file
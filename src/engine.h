@@ -12,10 +12,35 @@ struct Face {
     int texture_coords[3];
 };
 
+// Interleaved, quantized alternative to the float vertex streams of a Model,
+// 20 bytes per vertex instead of 56 (24 without PACKED_VERTEX_POSITIONS_16).
+struct PackedVertex {
+#ifdef PACKED_VERTEX_POSITIONS_16
+    short position[4]; // snorm16, dequantized with Model::position_scale/offset
+#else
+    float position[3];
+#endif
+    unsigned int normal; // GL_INT_2_10_10_10_REV
+    unsigned int tangent; // GL_INT_2_10_10_10_REV, bitangent sign in w
+    unsigned short texture_coords[2]; // half floats
+};
+
+struct MappedFile {
+    const char* data;
+    size_t size;
+};
+
+// A loaded_models[] slot index in the low MODEL_HANDLE_INDEX_BITS bits and
+// the slot's generation above them. Slots are reused once a model is
+// unloaded, model_get returns NULL for handles of the previous occupant.
+// 0 is never a valid handle.
+typedef unsigned int ModelHandle;
+
 struct Model {
     FaceType face_type;
 
     int num_faces;
+    int num_vertices;
     vec3* vertices;
     vec3* normals;
     vec2* texture_coords;
@@ -29,6 +54,52 @@ struct Model {
 
     bool has_normal_map;
     GLuint normal_map_id;
+
+    // num_faces * 3 indices into the vertex arrays above, 16-bit when
+    // num_vertices allows it, followed by the coarser LODs
+    void* indices;
+    GLenum index_type;
+    int index_size;
+
+    // LOD 0 is the full mesh, all LODs share the vertices
+    int num_lods;
+    int lod_first_index[MODEL_MAX_LODS];
+    int lod_num_indices[MODEL_MAX_LODS];
+
+    vec3 bounds_min;
+    vec3 bounds_max;
+    vec3 bounds_center;
+    float bounds_radius;
+
+    // NULL unless the model uses the packed vertex format
+    PackedVertex* packed_vertices;
+    vec3 position_scale;
+    vec3 position_offset;
+
+    // when loaded from a baked mesh the vertex arrays above point into this
+    // mapping instead of being malloc'ed
+    MappedFile baked;
+
+    // GPU copy of the mesh, uploaded by the first create_object and shared by
+    // all objects using this model. vertex_buffers[0] is the packed stream
+    // for packed models, otherwise one buffer per float stream.
+    GLuint vao;
+    GLuint vertex_buffers[5];
+    GLuint index_buffer;
+    size_t gpu_bytes;
+
+    // packed models can live in the shared mesh arena instead, then vao is
+    // the arena's and the indices are 32-bit, relative to arena_first_vertex
+    bool in_arena;
+    int arena_first_vertex;
+    int arena_first_index;
+
+    // registry bookkeeping, see model_get/model_acquire/model_release
+    bool in_use;
+    unsigned int generation;
+    int ref_count; // objects using the model
+    int unused_frames; // frames spent with ref_count == 0
+    char* source_key; // what loadModel dedups on, NULL for generated models
 };
 
 enum ObjectType {
@@ -39,8 +110,8 @@ enum ObjectType {
 typedef struct {
     ObjectType type;
 
-    int model_id; /* loaded_models[] */
-    GLuint vao; /* vertex attrib obj */
+    ModelHandle model_id; /* owns the vertex buffers, holds a reference */
+    int lod; /* picked by render_scene for the current pass */
     int shininess; /* 2-256 */
 
     float scale;
@@ -49,32 +120,275 @@ typedef struct {
     float speed; /* maybe separate this field in another struct */
 
     float scale_tex_coords;
+
+    // bounding sphere in world space, see object_update_bounds
+    vec3 world_center;
+    float world_radius;
+    int tree_leaf; /* node in the SceneTree, -1 when not in one */
+    bool is_static; /* never moves, its shadows can be cached */
 } Object;
 
+// Dynamic AABB tree over the objects of a scene (scene_tree.cpp)
+
+struct AABB {
+    vec3 min;
+    vec3 max;
+};
+
+struct SceneTreeNode {
+    AABB box; // enlarged by SCENE_TREE_MARGIN for leaves
+    int parent; // next free node when the node is free
+    int children[2]; // -1 for leaves
+    int height; // 0 for leaves, -1 when free
+    Object* object; // leaves only
+};
+
+struct SceneTree {
+    SceneTreeNode* nodes;
+    int capacity;
+    int root; // -1 when empty
+    int free_list;
+    int num_leaves;
+    // sum of the internal nodes' surface areas after the last rebuild
+    float rebuild_cost;
+};
+
+// Skinned meshes loaded through Assimp (model2.cpp)
+
+// Keys of one animated node, indices into SkeletalAnimation's key arrays.
+struct KeyRange {
+    int first;
+    int count; // 0 when the node has no keys of this kind
+};
+
+// Keyframes of all nodes in flat arrays, times in ticks. The key ranges are
+// indexed by node like SkinnedModel's node arrays.
+struct SkeletalAnimation {
+    float duration;
+    float ticks_per_second;
+
+    KeyRange* position_ranges;
+    KeyRange* rotation_ranges;
+    KeyRange* scaling_ranges;
+    bool* animated; // any keys for the node
+
+    float* position_times;
+    vec3* positions;
+    float* rotation_times;
+    versor* rotations;
+    float* scaling_times;
+    vec3* scalings;
+};
+
+struct SkinnedModel {
+    int num_vertices;
+    int num_indices;
+    vec3* positions;
+    vec3* normals;
+    vec2* texture_coords;
+    // 4 influences per vertex, weights are unorm8 summing to 255
+    unsigned char (*bone_ids)[SKINNED_MAX_INFLUENCES];
+    unsigned char (*bone_weights)[SKINNED_MAX_INFLUENCES];
+    unsigned int* indices;
+
+    // node hierarchy flattened so that parents come before their children,
+    // a pose is then evaluated in one pass over these arrays
+    int num_nodes;
+    int* node_parent; // -1 for the root
+    mat4* node_transforms; // bind pose, relative to the parent
+    mat4* node_globals; // scratch for skinned_model_pose
+
+    int num_bones;
+    int* bone_node;
+    mat4* bone_offsets; // mesh space to bone space
+    mat4 global_inverse;
+
+    int num_animations;
+    SkeletalAnimation* animations;
+};
+
 /* Util */
 
 struct File {
     vec3* vertices;
     int num_vertices;
+    int cap_vertices;
     Face* faces;
     int num_faces;
+    int cap_faces;
     vec3* normals;
     int num_normals;
+    int cap_normals;
     vec2* texture_coords;
     int num_texture_coords;
+    int cap_texture_coords;
+
+    // set when at least one face references them, used to infer the FaceType
+    bool faces_have_normals;
+    bool faces_have_texture_coords;
 };
 
+
 enum LightType {
     DIRECTIONAL,
     POINTLIGHT,
     SPOTLIGHT,
 };
 
+// How a POINTLIGHT's shadows are mapped: six cube faces, or two
+// paraboloids covering the hemispheres below and above the light
+enum ShadowMode {
+    SHADOW_CUBE,
+    SHADOW_DUAL_PARABOLOID,
+};
+
+// Square of the shadow atlas, in texels
+struct ShadowTile {
+    int x, y;
+    int size;
+};
+
+// State of a point light's static casters in the atlas' static texture,
+// copied into the faces of its shadow cube before their dynamic casters
+// are drawn
+struct ShadowCache {
+    bool valid; // false when the static casters changed
+    vec3 light_pos; // where the static casters were drawn from
+};
+
 struct Light {
     LightType type;
     vec3 pos;
     vec3 dir; // unused for POINTLIGHTs
     mat4 shadow_map_matrix; // unused for POINTLIGHTs
+    ShadowMode shadow_mode; // POINTLIGHTs only
+    int shadow_resolution; // requested size of each shadow map face
+    // one per face of the shadow_mode for POINTLIGHTs, one otherwise.
+    // Smaller than shadow_resolution when the atlas was full, none when it
+    // had no room.
+    ShadowTile shadow_tiles[6];
+    int num_shadow_tiles;
+    ShadowCache shadow_cache;
+
+    // Faces are refreshed by shadow_update_lights, a bit per face
+    int shadow_valid_faces; // drawn since the tiles were allocated
+    int shadow_dirty_faces; // out of date: static casters changed, or the light moved
+    int shadow_dynamic_faces; // last drawn with dynamic casters in them
+    vec3 shadow_pos; // where the light was when the faces got dirty
+    int shadow_still_frames; // frames the light hasn't moved for
+    int shadow_face_age[6]; // frames since each face was drawn
+    mat4 shadow_face_view_proj[6]; // what each face was drawn with
+};
+
+// Which objects a shadow pass draws
+enum ShadowCasters {
+    CASTERS_ALL,
+    CASTERS_STATIC,
+    CASTERS_DYNAMIC,
+};
+
+// The faces of a point light's shadow cube a layered pass draws
+struct ShadowCube {
+    mat4 face_view_proj[6]; // view matrices only for paraboloids
+    int faces; // bit per face, the others are left as they are
+    bool paraboloid; // faces 0 and 1 are the hemispheres below and above pos
+    vec3 pos;
+};
+
+// Uniforms outside of the uniform blocks. create_program looks their
+// locations up once, draws index Program::uniforms instead of calling
+// glGetUniformLocation.
+enum Uniform {
+    UNIFORM_SHADOW_MAP,
+    UNIFORM_DITHER_PATTERN,
+    UNIFORM_TEXTURE_A,
+    UNIFORM_NORMAL_MAP,
+    UNIFORM_TEX,
+    UNIFORM_COUNT
+};
+
+struct Program {
+    GLuint id;
+    GLint uniforms[UNIFORM_COUNT]; // -1 for uniforms the program doesn't use
+};
+
+// Programs of shadow map passes
+struct ShadowPrograms {
+    Program faces; // one face per pass
+    Program layered; // all faces of a shadow cube in one pass
+    Program paraboloid; // one dual-paraboloid hemisphere per pass
+};
+
+// Uniform blocks shared by all scene programs, the enum value is the
+// binding point. The structs below mirror their std140 layouts in the
+// shaders, keep them in sync.
+enum UniformBlock {
+    UNIFORM_BLOCK_FRAME,
+    UNIFORM_BLOCK_PASS,
+    UNIFORM_BLOCK_DRAW,
+    UNIFORM_BLOCK_COUNT
+};
+
+struct LightUniforms {
+    vec3 pos;
+    int paraboloid; // bool in GLSL
+    mat4 shadow_face_view_proj[6]; // POINTLIGHTs only
+    vec4 shadow_tile_rects[6]; // see shadow_atlas_tile_rects
+};
+
+struct FrameUniforms {
+    int num_lights;
+    float far_plane;
+    float pad0[2];
+    LightUniforms lights[MAX_LIGHTS];
+};
+
+struct PassUniforms {
+    mat4 view_proj;
+    mat4 shadow_map_matrix;
+    vec3 camera_pos;
+    float pad0;
+    vec3 cursor_pos;
+    float pad1;
+    mat4 cube_view_proj[6]; // faces of a layered shadow cube pass
+};
+
+// One per draw, all instances of a draw share the model and its material.
+// The DrawData block holds DRAWS_PER_BLOCK of them, instances pick theirs
+// with InstanceData::draw_index. GLSL bools are 4 bytes in std140, array
+// elements are padded to 16 bytes.
+struct DrawUniforms {
+    vec3 pos_scale;
+    int packed_vertices;
+    vec3 pos_offset;
+    int has_texture;
+    vec3 forced_color;
+    int has_normal_map;
+    int force_color;
+    int grid_enabled;
+    int pad[2];
+};
+
+// Per-instance vertex attributes, streamed for every pass. The model
+// matrix is affine, only its first three rows are stored.
+#define INSTANCE_ATTRIB_MODEL_ROWS 5 // 5, 6, 7
+#define INSTANCE_ATTRIB_PARAMS 8
+
+struct InstanceData {
+    vec4 model_rows[3];
+    float shininess;
+    float scale_tex_coords;
+    float draw_index; // into the bound DrawData block
+    float face_mask; // cube faces a layered shadow pass emits the instance to
+};
+
+// glMultiDrawElementsIndirect command
+struct DrawIndirectCommand {
+    GLuint count;
+    GLuint instance_count;
+    GLuint first_index;
+    GLint base_vertex;
+    GLuint base_instance;
 };
 
 enum RenderPass {
@@ -1,4 +1,47 @@
-Model loaded_models[20];
+// Growable, so it moves when a model is loaded. Keep ModelHandles, not
+// Model pointers, across loads.
+Model* loaded_models;
 int loaded_models_n;
+int loaded_models_cap;
 
-bool grid_enabled;
\ No newline at end of file
+// vertex and index buffer memory of all uploaded models
+size_t mesh_gpu_bytes;
+
+bool grid_enabled;
+// draw mesh arena models with glMultiDrawElementsIndirect
+bool multi_draw_enabled;
+// render point light shadow cubes in one layered pass
+bool layered_shadows_enabled;
+// draw static shadow casters once into a ShadowCache
+bool shadow_cache_enabled;
+// shadow map resolution and mode of the first light, R cycles the
+// resolution and P the mode
+int light_shadow_resolution = SHADOW_MAP_RESOLUTION;
+#ifdef DUAL_PARABOLOID_SHADOWS
+ShadowMode light_shadow_mode = SHADOW_DUAL_PARABOLOID;
+#else
+ShadowMode light_shadow_mode = SHADOW_CUBE;
+#endif
+// shadow cube faces shadow_update_lights refreshes per frame
+int shadow_face_budget = SHADOW_FACE_BUDGET;
+
+// triangles drawn per RenderPass since the last FPS report
+long long pass_triangles[2];
+// instanced draw calls per RenderPass since the last FPS report
+long long pass_draw_calls[2];
+// objects drawn and frustum culled per RenderPass since the last FPS report
+long long pass_visible[2];
+long long pass_culled[2];
+// binds issued and skipped by the GL state cache since the last FPS report
+long long state_changes;
+long long state_changes_skipped;
+// CPU time spent issuing the shadow and final passes since the last FPS report
+double render_cpu_seconds;
+// the part of it spent in the shadow pass
+double shadow_cpu_seconds;
+// shadow cube faces refreshed, the part of them drawn rather than copied
+// from a static cache, and static caster caches redrawn since the last FPS
+// report
+long long shadow_faces_refreshed;
+long long shadow_faces_drawn;
+long long shadow_cache_rebuilds;
@@ -20,8 +20,25 @@
 #include "engine.h"
 
 #include "globals.cpp"
+#include "platform.cpp"
+#include "obj_parser.cpp"
+#include "mesh_optimize.cpp"
+#include "mesh_simplify.cpp"
+#include "tangents.cpp"
+#include "vertex_packing.cpp"
+#include "baked_mesh.cpp"
+#include "texture.cpp"
+#include "texture_streaming.cpp"
+#include "shadow_atlas.cpp"
+#include "render_queue.cpp"
+#include "uniform_buffers.cpp"
+#include "mesh_arena.cpp"
 #include "model.cpp"
-//#include "model2.cpp"
+#include "culling.cpp"
+#include "scene_tree.cpp"
+#ifdef SKINNED_MESHES
+#include "model2.cpp"
+#endif
 
 #define MIN2(a,b) ((a < b) ? (a) : (b))
 #define MAX2(a,b) ((a > b) ? (a) : (b))
@@ -48,6 +65,37 @@ static void key_callback(GLFWwindow* window, int key, int scancode, int action,
     if (key == GLFW_KEY_B && action == GLFW_PRESS) {
         grid_enabled = !grid_enabled;
     }
+
+    if (key == GLFW_KEY_M && action == GLFW_PRESS && mesh_arena.enabled) {
+        multi_draw_enabled = !multi_draw_enabled;
+        printf("Multi-draw indirect %s\n", multi_draw_enabled ? "on" : "off");
+    }
+
+    if (key == GLFW_KEY_C && action == GLFW_PRESS) {
+        shadow_cache_enabled = !shadow_cache_enabled;
+        printf("Static shadow cache %s\n", shadow_cache_enabled ? "on" : "off");
+    }
+
+    if (key == GLFW_KEY_L && action == GLFW_PRESS && GLEW_ARB_viewport_array) {
+        layered_shadows_enabled = !layered_shadows_enabled;
+        printf("Layered shadow cube %s\n", layered_shadows_enabled ? "on" : "off");
+    }
+
+    if (key == GLFW_KEY_R && action == GLFW_PRESS) {
+        light_shadow_resolution = light_shadow_resolution >= 4096 ? 256 : light_shadow_resolution * 2;
+        printf("Shadow map resolution %d\n", light_shadow_resolution);
+    }
+
+    if (key == GLFW_KEY_P && action == GLFW_PRESS) {
+        light_shadow_mode = light_shadow_mode == SHADOW_CUBE ? SHADOW_DUAL_PARABOLOID : SHADOW_CUBE;
+        printf("Shadow mode %s\n", light_shadow_mode == SHADOW_CUBE ? "cube" : "dual-paraboloid");
+    }
+
+    if ((key == GLFW_KEY_MINUS || key == GLFW_KEY_EQUAL) && action == GLFW_PRESS) {
+        shadow_face_budget += key == GLFW_KEY_EQUAL ? 1 : -1;
+        if (shadow_face_budget < 1) shadow_face_budget = 1;
+        printf("Shadow face budget %d\n", shadow_face_budget);
+    }
 }
 
 // TODO: caller must free buffer
@@ -94,9 +142,19 @@ GLuint compile_shader(GLuint stage, char *filename) {
     return shader;
 }
 
-GLuint create_program(GLuint vert, GLuint frag) {
+static const char* uniform_names[UNIFORM_COUNT] = {
+    "shadowMap",
+    "ditherPattern",
+    "textureA",
+    "normalMap",
+    "tex",
+};
+
+// geom may be 0 for programs without a geometry shader
+Program create_program(GLuint vert, GLuint frag, GLuint geom = 0) {
     GLuint program = glCreateProgram();
     glAttachShader(program, vert);
+    if (geom) glAttachShader(program, geom);
     glAttachShader(program, frag);
     glLinkProgram(program);
 
@@ -106,19 +164,41 @@ GLuint create_program(GLuint vert, GLuint frag) {
     glGetProgramInfoLog(program, 200, &shader_info_len, shader_info_buffer);
     if (shader_info_len) printf("Shader linking error: %s\n", shader_info_buffer);
 
-    return program;
+    Program result;
+    result.id = program;
+    for (int i = 0; i < UNIFORM_COUNT; i++) {
+        result.uniforms[i] = glGetUniformLocation(program, uniform_names[i]);
+    }
+    uniform_buffers_bind_blocks(program);
+    return result;
 }
 
-GLuint create_shadow_map_program() {
+Program create_shadow_map_program() {
     GLuint vert = compile_shader(GL_VERTEX_SHADER, "shaders/shadow_vert.glsl");
     GLuint frag = compile_shader(GL_FRAGMENT_SHADER, "shaders/shadow_frag.glsl");
     return create_program(vert, frag);
 }
 
+// renders all faces of a shadow cube in one pass, see render_scene
+Program create_layered_shadow_map_program() {
+    GLuint vert = compile_shader(GL_VERTEX_SHADER, "shaders/shadow_vert.glsl");
+    GLuint geom = compile_shader(GL_GEOMETRY_SHADER, "shaders/shadow_geom.glsl");
+    GLuint frag = compile_shader(GL_FRAGMENT_SHADER, "shaders/shadow_frag.glsl");
+    return create_program(vert, frag, geom);
+}
+
+// renders one hemisphere of a dual-paraboloid shadow map per pass
+Program create_paraboloid_shadow_map_program() {
+    GLuint vert = compile_shader(GL_VERTEX_SHADER, "shaders/shadow_vert.glsl");
+    GLuint geom = compile_shader(GL_GEOMETRY_SHADER, "shaders/shadow_paraboloid_geom.glsl");
+    GLuint frag = compile_shader(GL_FRAGMENT_SHADER, "shaders/shadow_frag.glsl");
+    return create_program(vert, frag, geom);
+}
+
 // TODO: refactor
 void blit_texture(GLuint width, GLuint height, GLuint texture) {
     static bool initialized = false;
-    static GLuint program;
+    static Program program;
     static GLuint VAO;
     static GLuint tex;
 
@@ -154,12 +234,12 @@ void blit_texture(GLuint width, GLuint height, GLuint texture) {
 
     // TODO: fix this blit texture thing, something is very broken
     //       maybe this comment is outdated
-    glUseProgram(program);
+    glUseProgram(program.id);
     POLL_GL_ERROR;
     glActiveTexture(GL_TEXTURE0);
     glBindTexture(GL_TEXTURE_2D, texture);
     POLL_GL_ERROR;
-    glUniform1i(glGetUniformLocation(program, "tex"), 0);
+    glUniform1i(program.uniforms[UNIFORM_TEX], 0);
     POLL_GL_ERROR;
     glDisable(GL_CULL_FACE);
     glClearColor(1.0, 0.0, 0.0, 1);
@@ -219,22 +299,74 @@ void ray_plane_intersection(vec3 ray_origin, vec3 ray_dir,
     glm_vec3_add(ray_origin, ray_dir, out_point);
 }
 
+// Picks the coarsest LOD whose projected bounding sphere is still large
+// enough, passes that draw shadows go MESH_LOD_SHADOW_BIAS LODs coarser.
+int select_lod(Object* obj, vec3 camera_pos, mat4 proj_mat, RenderPass pass)
+{
+    Model* model = model_get(obj->model_id);
+    if (model->num_lods == 1) return 0;
+
+    vec3 center;
+    glm_vec3_add(model->bounds_min, model->bounds_max, center);
+    glm_vec3_scale(center, 0.5f * obj->scale, center);
+    glm_vec3_add(center, obj->pos, center);
+    float radius = 0.5f * glm_vec3_distance(model->bounds_min, model->bounds_max) * obj->scale;
+    float distance = glm_vec3_distance(center, camera_pos);
+
+    // fraction of half the viewport height
+    float projected_size = distance > radius ? radius / distance * proj_mat[1][1] : 1.0f;
+
+    int lod = 0;
+    float size = MESH_LOD_SCREEN_SIZE;
+    while (lod + 1 < model->num_lods && projected_size < size) {
+        lod++;
+        size *= 0.5f;
+    }
+    if (pass == PASS_SHADOW_MAP) lod += MESH_LOD_SHADOW_BIAS;
+    return lod < model->num_lods ? lod : model->num_lods - 1;
+}
+
+static int count_faces(int faces)
+{
+    int n = 0;
+    for (; faces; faces &= faces - 1) n++;
+    return n;
+}
+
+// Objects in the faces of cube and a mask of the faces each overlaps.
+// Objects are in a paraboloid's hemisphere when their bounding spheres
+// reach past the plane between the two.
+static int shadow_cube_query(SceneTree *scene, ShadowCube *cube, Object **visible, int *face_masks)
+{
+    if (!cube->paraboloid) return scene_tree_query_cube(scene, cube->face_view_proj, visible, face_masks);
+
+    int num_visible = scene_tree_query_sphere(scene, cube->pos, FAR_PLANE, ~0u, visible, scene->num_leaves);
+    for (int i = 0; i < num_visible; i++) {
+        float height = visible[i]->world_center[1] - cube->pos[1];
+        float radius = visible[i]->world_radius;
+        face_masks[i] = (height < radius ? 1 : 0) | (height > -radius ? 2 : 0);
+    }
+    return num_visible;
+}
+
+// A non-NULL cube makes this a layered pass over the faces of a shadow
+// cube: objects are culled per face, and the program's geometry shader
+// sends each one only to the faces it overlaps. Only the given casters are
+// drawn. The caller sets the viewport and clears the target.
 // TODO: put all this state in a struct
-void render_scene(float width, float height, float mouse_x, float mouse_y,
+void render_scene(float mouse_x, float mouse_y,
                   vec3 camera_pos, Light *light, mat4 proj_mat, mat4 view_mat,
-                  Object **scene_geometry, int num_scene_geom,
-                  GLuint program, RenderPass pass)
+                  ShadowCube *cube, ShadowCasters casters, SceneTree *scene,
+                  Program *program, RenderPass pass)
 {
-    glUseProgram(program);
+    gl_state_use_program(program->id);
 
     switch (pass) {
     case PASS_FINAL:
-        glEnable(GL_CULL_FACE);
-        glCullFace(GL_BACK);
+        gl_state_cull_face(GL_BACK);
         break;
     case PASS_SHADOW_MAP:
-        glEnable(GL_CULL_FACE);
-        glCullFace(GL_FRONT);
+        gl_state_cull_face(GL_FRONT);
         break;
     default:
         assert(false && "UNKNOWN RENDER PASS!");
@@ -247,22 +379,37 @@ void render_scene(float width, float height, float mouse_x, float mouse_y,
 
     glEnable(GL_DEPTH_TEST);
 
-    glViewport(0, 0, width, height);
-    glClearColor(0.0, 0.0, 0.0, 1);
-    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    PassUniforms pass_data = {};
+    if (cube) {
+        // vertices stay in world space until the geometry shader
+        glm_mat4_identity(pass_data.view_proj);
+        memcpy(pass_data.cube_view_proj, cube->face_view_proj, sizeof(pass_data.cube_view_proj));
+    } else {
+        glm_mat4_copy(view_proj, pass_data.view_proj);
+    }
 
     switch (pass) {
-    case PASS_FINAL:
+    case PASS_FINAL: {
         // TODO: refactor this to make it maintainable with many textures
-        glUniform1i(glGetUniformLocation(program, "shadowMap"), 0);
-        glUniform1i(glGetUniformLocation(program, "ditherPattern"), 1);
-        glUniform1i(glGetUniformLocation(program, "textureA"), 2);
-        glUniform1i(glGetUniformLocation(program, "normalMap"), 3);
-        glUniformMatrix4fv(glGetUniformLocation(program, "shadow_map_matrix"), 1, GL_FALSE, (const GLfloat*)light->shadow_map_matrix);
-		glUniform3fv(glGetUniformLocation(program, "cameraPos"), 1, camera_pos);
+        glUniform1i(program->uniforms[UNIFORM_SHADOW_MAP], 0);
+        glUniform1i(program->uniforms[UNIFORM_DITHER_PATTERN], 1);
+        glUniform1i(program->uniforms[UNIFORM_TEXTURE_A], 2);
+        glUniform1i(program->uniforms[UNIFORM_NORMAL_MAP], 3);
+        glm_mat4_copy(light->shadow_map_matrix, pass_data.shadow_map_matrix);
+        glm_vec3_copy(camera_pos, pass_data.camera_pos);
+
+        // TODO: move this out, perhaps use a "RenderState" struct to pass
+        //       PASS-specific arguments
+        vec3 ray_origin, ray_dir;
+        screen_to_world_space_ray(camera_pos, mouse_x, mouse_y,
+                                  proj_mat, view_mat,
+                                  ray_origin, ray_dir);
+        vec3 plane_normal = { 0.0, 1.0, 0.0 };
+        ray_plane_intersection(ray_origin, ray_dir, plane_normal, 0.0f, pass_data.cursor_pos);
         break;
+    }
     case PASS_SHADOW_MAP:
-		glUniform3fv(glGetUniformLocation(program, "cameraPos"), 1, light->pos);
+        glm_vec3_copy(light->pos, pass_data.camera_pos);
         glm_mat4_copy(view_proj, light->shadow_map_matrix);
         break;
     default:
@@ -270,150 +417,435 @@ void render_scene(float width, float height, float mouse_x, float mouse_y,
         break;
     }
 
-    glUniform3fv(glGetUniformLocation(program, "lightPos"), 1, light->pos);
-    glUniform1f(glGetUniformLocation(program, "farPlane"), FAR_PLANE);
-    glUniformMatrix4fv(glGetUniformLocation(program, "view_proj"), 1, GL_FALSE, (const GLfloat*)view_proj);
-
-    for (int i = 0; i < num_scene_geom; i++) {
-        Object *obj = scene_geometry[i];
-        if (obj->type == OBJ_GROUND) {
-			if (pass == PASS_FINAL) { // we don't care about the grid when doing shadow mapping
-				glUniform1i(glGetUniformLocation(program, "gridEnabled"), grid_enabled);
-                // TODO: move this out, perhaps use a "RenderState" struct to pass 
-                //       PASS-specific arguments
-                vec3 ray_origin, ray_dir;
-                screen_to_world_space_ray(camera_pos, mouse_x, mouse_y,
-                                          proj_mat, view_mat,
-                                          ray_origin, ray_dir);
-                vec3 plane_normal = { 0.0, 1.0, 0.0 };
-                vec3 target_pos;
-                ray_plane_intersection(ray_origin, ray_dir, plane_normal, 0.0f, target_pos);
-				glUniform3fv(glGetUniformLocation(program, "cursorPos"), 1, target_pos);
-			}
-            //draw_model_force_rgb(program, *obj, 0.7, 0.4, 0.08);
-            draw_model(program, *obj, pass);
-			glUniform1i(glGetUniformLocation(program, "gridEnabled"), 0);
+    // objects whose keys only differ in depth are drawn as one instanced
+    // draw, sorting brings them next to each other
+    static DrawItem* items = NULL;
+    static DrawItem* items_tmp = NULL;
+    static DrawGroup* groups = NULL;
+    static Object** visible = NULL;
+    static int* face_masks = NULL;
+    static int items_capacity = 0;
+    if (scene->num_leaves > items_capacity) {
+        items_capacity = scene->num_leaves;
+        items = (DrawItem*) realloc(items, items_capacity * sizeof(DrawItem));
+        items_tmp = (DrawItem*) realloc(items_tmp, items_capacity * sizeof(DrawItem));
+        groups = (DrawGroup*) realloc(groups, items_capacity * sizeof(DrawGroup));
+        visible = (Object**) realloc(visible, items_capacity * sizeof(Object*));
+        face_masks = (int*) realloc(face_masks, items_capacity * sizeof(int));
+    }
+
+    int num_visible;
+    if (cube) {
+        num_visible = shadow_cube_query(scene, cube, visible, face_masks);
+    } else {
+        num_visible = scene_tree_query_frustum(scene, view_proj, visible);
+    }
+
+    // keep the casters and faces this pass draws. Counted per face in
+    // layered passes, like separate passes would.
+    int num_faces = cube ? count_faces(cube->faces) : 1;
+    pass_culled[pass] += num_faces * scene->num_leaves;
+    int num_kept = 0;
+    for (int i = 0; i < num_visible; i++) {
+        int faces = 1;
+        if (cube) {
+            face_masks[i] &= cube->faces;
+            faces = count_faces(face_masks[i]);
+        }
+        pass_culled[pass] -= faces;
+        if (faces == 0) continue;
+        if (casters != CASTERS_ALL && visible[i]->is_static != (casters == CASTERS_STATIC)) continue;
+
+        pass_visible[pass] += faces;
+        visible[num_kept] = visible[i];
+        face_masks[num_kept] = face_masks[i];
+        num_kept++;
+    }
+    num_visible = num_kept;
+
+    for (int i = 0; i < num_visible; i++) {
+        Object *obj = visible[i];
+        Model *model = model_get(obj->model_id);
+        obj->lod = select_lod(obj, camera_pos, proj_mat, pass);
+        int faces = cube ? count_faces(face_masks[i]) : 1;
+        pass_triangles[pass] += faces * model->lod_num_indices[obj->lod] / 3;
+
+        GLuint material = pass == PASS_FINAL && model->has_texture ? model->texture_id : 0;
+        items[i].key = draw_sort_key(pass, program->id, material, obj->model_id, obj->lod, obj->type,
+                                     glm_vec3_distance(camera_pos, obj->pos));
+        items[i].object = i;
+    }
+    radix_sort_draw_items(items, items_tmp, num_visible);
+
+    int num_draws = 0;
+    int num_commands = 0;
+    for (int i = 0; i < num_visible; i++) {
+        if (i > 0 && draw_items_merge(&items[i - 1], &items[i], visible)) {
+            groups[num_draws - 1].count++;
+            continue;
+        }
+        groups[num_draws].first = i;
+        groups[num_draws].count = 1;
+        num_draws++;
+        if (multi_draw_enabled && model_get(visible[items[i].object]->model_id)->in_arena) num_commands++;
+    }
+
+    // the pass block, then the draws in DrawData blocks of DRAWS_PER_BLOCK
+    GLsizeiptr pass_block_size = uniform_ring_block_size(sizeof(PassUniforms));
+    GLsizeiptr draw_block_size = uniform_ring_block_size(DRAWS_PER_BLOCK * sizeof(DrawUniforms));
+    int num_draw_blocks = (num_draws + DRAWS_PER_BLOCK - 1) / DRAWS_PER_BLOCK;
+    GLintptr pass_offset, first_instance, first_command;
+    char* blocks = uniform_ring_map(pass_block_size + num_draw_blocks * draw_block_size, &pass_offset);
+    InstanceData* instances = instance_stream_map(num_visible, &first_instance);
+    DrawIndirectCommand* commands = indirect_stream_map(num_commands, &first_command);
+    memcpy(blocks, &pass_data, sizeof(pass_data));
+
+    int command = 0;
+    for (int draw = 0; draw < num_draws; draw++) {
+        DrawGroup *group = &groups[draw];
+        Object *obj = visible[items[group->first].object];
+        Model *model = model_get(obj->model_id);
+
+        DrawUniforms draw_data;
+        model_draw_uniforms(model, pass, &draw_data);
+        // we don't care about the grid when doing shadow mapping
+        draw_data.grid_enabled = obj->type == OBJ_GROUND && pass == PASS_FINAL && grid_enabled;
+        char *draw_block = blocks + pass_block_size + (draw / DRAWS_PER_BLOCK) * draw_block_size;
+        memcpy(draw_block + (draw % DRAWS_PER_BLOCK) * sizeof(DrawUniforms), &draw_data, sizeof(draw_data));
+
+        for (int i = group->first; i < group->first + group->count; i++) {
+            InstanceData instance;
+            object_instance_data(visible[items[i].object], &instance);
+            instance.draw_index = (float) (draw % DRAWS_PER_BLOCK);
+            if (cube) instance.face_mask = (float) face_masks[items[i].object];
+            memcpy(&instances[i], &instance, sizeof(instance));
+        }
+
+        if (multi_draw_enabled && model->in_arena) {
+            mesh_arena_command(model, obj->lod, group->first, group->count, &commands[command++]);
+        }
+    }
+
+    uniform_ring_unmap();
+    instance_stream_unmap();
+    indirect_stream_unmap();
+    uniform_ring_bind(UNIFORM_BLOCK_PASS, pass_offset, sizeof(PassUniforms));
+
+    // runs of arena draws with the same textures go out as one multi-draw,
+    // other draws one by one
+    command = 0;
+    for (int draw = 0; draw < num_draws; ) {
+        if (draw % DRAWS_PER_BLOCK == 0) {
+            uniform_ring_bind(UNIFORM_BLOCK_DRAW, pass_offset + pass_block_size + (draw / DRAWS_PER_BLOCK) * draw_block_size,
+                              DRAWS_PER_BLOCK * sizeof(DrawUniforms));
+        }
+
+        DrawGroup *group = &groups[draw];
+        Object *obj = visible[items[group->first].object];
+        Model *model = model_get(obj->model_id);
+
+        if (multi_draw_enabled && model->in_arena) {
+            int last = draw + 1;
+            while (last < num_draws && last % DRAWS_PER_BLOCK != 0) {
+                Model *next = model_get(visible[items[groups[last].first].object]->model_id);
+                if (!next->in_arena || !model_same_textures(model, next)) break;
+                last++;
+            }
+
+            model_bind_textures(model, pass);
+            mesh_arena_draw_indirect(first_command + command * sizeof(DrawIndirectCommand), last - draw, first_instance);
+            command += last - draw;
+            draw = last;
         } else {
-            // draw_model_force_rgb(program, *obj, 0.8, 0.6, 0.4);
-            draw_model(program, *obj, pass);
+            draw_model_instanced(model, obj->lod, first_instance + group->first * sizeof(InstanceData),
+                                 group->count, pass);
+            draw++;
         }
+        pass_draw_calls[pass]++;
     }
+
+    // leave no VAO bound for code outside the state cache
+    gl_state_bind_vertex_array(0);
 }
 
-void initialize_shadow_map_fbo(GLuint *fbo, GLuint *tex, Light light)
+// Draws casters into light's tiles of tex for the faces of cube, in one
+// layered pass or face by face. Dynamic casters are drawn over the depth
+// the tiles already hold, the others into cleared tiles.
+void draw_shadow_cube(GLuint tex, ShadowCube *cube, ShadowCasters casters, mat4 proj_mat,
+                      mat4 view_mats[6], SceneTree *scene, ShadowPrograms *programs, Light *light)
 {
-    // TODO: remember to free resources
-    glGenFramebuffers(1, fbo);
-    glGenTextures(1, tex);
-
-    GLuint tex_type = light.type == POINTLIGHT ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
-
-    glBindTexture(tex_type, *tex);
-        if (light.type == POINTLIGHT) {
-            for (int i = 0; i < 6; i++) {
-                glTexImage2D(GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, 0, GL_DEPTH_COMPONENT,
-                             SHADOW_MAP_RESOLUTION, SHADOW_MAP_RESOLUTION, 0,
-                             GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-            }
-            glTexParameteri(tex_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
-            glTexParameteri(tex_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
-            glTexParameteri(tex_type, GL_TEXTURE_WRAP_R, GL_CLAMP_TO_EDGE);
-        } else {
-            glTexImage2D(tex_type, 0, GL_DEPTH_COMPONENT16, SHADOW_MAP_RESOLUTION,
-                         SHADOW_MAP_RESOLUTION, 0, GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
-            glTexParameteri(tex_type, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_BORDER);
-            glTexParameteri(tex_type, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_BORDER);
-            // This border color is needed to remove artifacts at the edge of the light's
-            // view frustrum.
-            vec4 border_color = { 1.0f, 1.0f, 1.0f, 1.0f };
-            glTexParameterfv(tex_type, GL_TEXTURE_BORDER_COLOR, border_color);
+    glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex, 0);
+    if (casters != CASTERS_DYNAMIC) {
+        for (int i = 0; i < 6; i++) {
+            if (!(cube->faces & (1 << i))) continue;
+            shadow_atlas_target_tile(&light->shadow_tiles[i]);
+            glClear(GL_DEPTH_BUFFER_BIT);
         }
-        
-        glTexParameteri(tex_type, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
-        glTexParameteri(tex_type, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
-    glBindTexture(tex_type, 0);
-
-    glBindFramebuffer(GL_FRAMEBUFFER, *fbo);
-    // we only need the depth buffer
-    glDrawBuffer(GL_NONE);
-    glReadBuffer(GL_NONE);
-    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+    }
+
+    if (cube->paraboloid) {
+        // one pass per hemisphere, the geometry shader clips away the other
+        glEnable(GL_CLIP_DISTANCE0);
+        int faces = cube->faces;
+        for (int i = 0; i < 2; i++) {
+            if (!(faces & (1 << i))) continue;
+            cube->faces = 1 << i;
+            shadow_atlas_target_tile(&light->shadow_tiles[i]);
+            render_scene(0, 0, light->pos, light, proj_mat, view_mats[i],
+                         cube, casters, scene, &programs->paraboloid, PASS_SHADOW_MAP);
+        }
+        cube->faces = faces;
+        glDisable(GL_CLIP_DISTANCE0);
+        return;
+    }
+
+    if (layered_shadows_enabled) {
+        // the geometry shader sends each face to the viewport of its tile
+        for (int i = 0; i < 6; i++) {
+            ShadowTile *tile = &light->shadow_tiles[i];
+            glViewportIndexedf(i, tile->x, tile->y, tile->size, tile->size);
+            glScissorIndexed(i, tile->x, tile->y, tile->size, tile->size);
+        }
+        render_scene(0, 0, light->pos, light, proj_mat, view_mats[5],
+                     cube, casters, scene, &programs->layered, PASS_SHADOW_MAP);
+        return;
+    }
+
+    for (int i = 0; i < 6; i++) {
+        if (!(cube->faces & (1 << i))) continue;
+        shadow_atlas_target_tile(&light->shadow_tiles[i]);
+        render_scene(0, 0, light->pos, light, proj_mat, view_mats[i],
+                     NULL, casters, scene, &programs->faces, PASS_SHADOW_MAP);
+    }
 }
 
-void shadow_mapping_pass(int width, int height, GLuint fbo, GLuint tex,
-                         Object **scene_geometry, int obj_count,
-                         GLuint program, Light *light)
+// Faces of cube that dynamic casters overlap.
+int dynamic_caster_faces(SceneTree *scene, ShadowCube *cube)
 {
-    mat4 proj_mat, view_mat;
-    glm_perspective(GLM_PI_2f, 1, 0.01f, FAR_PLANE, proj_mat);
+    static Object** visible = NULL;
+    static int* face_masks = NULL;
+    static int capacity = 0;
+    if (scene->num_leaves > capacity) {
+        capacity = scene->num_leaves;
+        visible = (Object**) realloc(visible, capacity * sizeof(Object*));
+        face_masks = (int*) realloc(face_masks, capacity * sizeof(int));
+    }
+
+    int faces = 0;
+    int num_visible = shadow_cube_query(scene, cube, visible, face_masks);
+    for (int i = 0; i < num_visible; i++) {
+        if (!visible[i]->is_static) faces |= face_masks[i];
+    }
+    return faces & cube->faces;
+}
+
+// The faces of a point light's shadow map in its shadow_mode, all in
+// cube->faces. view_mats are the faces' views, proj_mat the cube's
+// projection, which paraboloid passes only use to pick LODs.
+void light_shadow_cube(Light *light, mat4 proj_mat, mat4 view_mats[6], ShadowCube *cube)
+{
+    cube->paraboloid = light->shadow_mode == SHADOW_DUAL_PARABOLOID;
+    cube->faces = cube->paraboloid ? 0x3 : 0x3f;
+    glm_vec3_copy(light->pos, cube->pos);
+    shadow_cube_matrices(light->pos, proj_mat, view_mats);
+    if (cube->paraboloid) {
+        shadow_paraboloid_matrices(light->pos, view_mats);
+        for (int i = 0; i < 2; i++) glm_mat4_copy(view_mats[i], cube->face_view_proj[i]);
+        return;
+    }
+    for (int i = 0; i < 6; i++) glm_mat4_mul(proj_mat, view_mats[i], cube->face_view_proj[i]);
+}
 
-    glBindFramebuffer(GL_FRAMEBUFFER, fbo);
+// Redraws the given faces of light's shadow cube in its atlas tiles,
+// dynamic_faces are those of them that dynamic casters overlap. Other
+// lights have a single face. With the shadow cache, a point light's static
+// casters are only drawn when they or the light change: the faces get the
+// cached depth copied in and their dynamic casters drawn on top.
+void shadow_mapping_pass(SceneTree *scene, ShadowPrograms *programs, Light *light,
+                         int faces, int dynamic_faces)
+{
+    mat4 proj_mat, view_mat;
+    GLuint tex = shadow_atlas.tex;
+    ShadowCache *cache = &light->shadow_cache;
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow_atlas.fbo);
     switch (light->type) {
     case SPOTLIGHT:
     case DIRECTIONAL: {
+        glm_perspective(GLM_PI_2f, 1, 0.01f, FAR_PLANE, proj_mat);
 		vec3 up = { 0, 1, 0 };
 		vec3 target = { 5, 0, 5 };
 		glm_lookat(light->pos, target, up, view_mat);
         glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT, GL_TEXTURE_2D, tex, 0);
-        render_scene(SHADOW_MAP_RESOLUTION, SHADOW_MAP_RESOLUTION,
-                     0, 0, light->pos, light, proj_mat, view_mat, scene_geometry,
-                     obj_count, program, PASS_SHADOW_MAP);
+        shadow_atlas_target_tile(&light->shadow_tiles[0]);
+        glClear(GL_DEPTH_BUFFER_BIT);
+        render_scene(0, 0, light->pos, light, proj_mat, view_mat, NULL, CASTERS_ALL,
+                     scene, &programs->faces, PASS_SHADOW_MAP);
         break;
     }
     case POINTLIGHT: {
-        vec3 directions[6] = {
-            {1.0f, 0.0f, 0.0f},
-            {-1.0f, 0.0f, 0.0f},
-            {0.0f, 1.0f, 0.0f},
-            {0.0f, -1.0f, 0.0f},
-            {0.0f, 0.0f, 1.0f},
-            {0.0f, 0.0f, -1.0f},
-        };
-        vec3 up[6] = {
-            {0.0f, -1.0f, 0.0f},
-            {0.0f, -1.0f, 0.0f},
-            {0.0f, 0.0f, 1.0f},
-            {0.0f, 0.0f, -1.0f},
-            {0.0f, -1.0f, 0.0f},
-            {0.0f, -1.0f, 0.0f},
-        };
+        ShadowCube cube;
+        mat4 view_mats[6];
+        light_shadow_cube(light, proj_mat, view_mats, &cube);
+        int all_faces = cube.faces;
+        for (int i = 0; i < 6; i++) {
+            if (faces & (1 << i)) glm_mat4_copy(cube.face_view_proj[i], light->shadow_face_view_proj[i]);
+        }
+
+        // a moving light would rebuild the cache every frame, it waits for
+        // the light to settle
+        bool stale = !cache->valid || glm_vec3_distance(cache->light_pos, light->pos) > SHADOW_CACHE_DRIFT;
+        if (!shadow_atlas.static_tex || !shadow_cache_enabled ||
+            (stale && light->shadow_still_frames < SHADOW_CACHE_SETTLE_FRAMES)) {
+            cube.faces = faces;
+            draw_shadow_cube(tex, &cube, CASTERS_ALL, proj_mat, view_mats, scene, programs, light);
+            shadow_faces_drawn += count_faces(faces);
+            break;
+        }
+
+        if (stale) {
+            cube.faces = all_faces;
+            draw_shadow_cube(shadow_atlas.static_tex, &cube, CASTERS_STATIC, proj_mat, view_mats, scene,
+                             programs, light);
+            cache->valid = true;
+            glm_vec3_copy(light->pos, cache->light_pos);
+            shadow_cache_rebuilds++;
+        }
 
         for (int i = 0; i < 6; i++) {
-            vec3 camera_target;
-            glm_vec3_add(light->pos, directions[i], camera_target);
-            glm_lookat(light->pos, camera_target, up[i], view_mat);
-            glFramebufferTexture2D(GL_FRAMEBUFFER, GL_DEPTH_ATTACHMENT,
-                                   GL_TEXTURE_CUBE_MAP_POSITIVE_X + i, tex, 0);
-            render_scene(SHADOW_MAP_RESOLUTION, SHADOW_MAP_RESOLUTION,
-                         0, 0, light->pos, light, proj_mat, view_mat,
-                         scene_geometry, obj_count, program, PASS_SHADOW_MAP);
+            if (faces & (1 << i)) shadow_atlas_copy_tile(shadow_atlas.static_tex, tex, &light->shadow_tiles[i]);
+        }
+        if (dynamic_faces) {
+            cube.faces = dynamic_faces;
+            draw_shadow_cube(tex, &cube, CASTERS_DYNAMIC, proj_mat, view_mats, scene, programs, light);
         }
+        shadow_faces_drawn += count_faces(dynamic_faces);
         break;
     }
     default:
         assert(false && "UNKNOWN LIGHT TYPE!");
         break;
     }
+    glDisable(GL_SCISSOR_TEST);
     glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    for (int i = 0; i < 6; i++) {
+        if (faces & (1 << i)) light->shadow_face_age[i] = 0;
+    }
+    light->shadow_valid_faces |= faces;
+    light->shadow_dirty_faces &= ~faces;
+    light->shadow_dynamic_faces = (light->shadow_dynamic_faces & ~faces) | dynamic_faces;
+    shadow_faces_refreshed += count_faces(faces);
 }
 
-void final_render(float width, float height, float mouse_x, float mouse_y,
-                  Camera camera, Light *light, Object **scene_geometry,
-                  int obj_count, GLuint program, GLuint shadow_map_tex,
-                  GLuint dither_tex)
+// Fraction of the screen light reaches, roughly: the projected size of its
+// LIGHT_RADIUS sphere, which falls with the square of the light's distance
+// to the camera. 0 when the sphere is outside the view.
+float light_screen_coverage(Light *light, Camera *camera)
 {
-    GLuint tex_type = light->type == POINTLIGHT ? GL_TEXTURE_CUBE_MAP : GL_TEXTURE_2D;
+    mat4 view_proj;
+    glm_mat4_mul(camera->proj_mat, camera->view_mat, view_proj);
+    vec4 planes[6];
+    frustum_planes(view_proj, planes);
+    for (int p = 0; p < 6; p++) {
+        if (glm_vec3_dot(planes[p], light->pos) + planes[p][3] < -LIGHT_RADIUS) return 0.0f;
+    }
 
-    glActiveTexture(GL_TEXTURE0);
-    glBindTexture(tex_type, shadow_map_tex);
-    glActiveTexture(GL_TEXTURE1);
-    glBindTexture(GL_TEXTURE_2D, dither_tex);
+    float dist = glm_vec3_distance(camera->pos, light->pos);
+    if (dist <= LIGHT_RADIUS) return 1.0f;
+    // tangent of the sphere's angular radius over that of half the field of view
+    float size = LIGHT_RADIUS / sqrtf(dist * dist - LIGHT_RADIUS * LIGHT_RADIUS) * camera->proj_mat[1][1];
+    return size * size < 1.0f ? size * size : 1.0f;
+}
 
-    render_scene(width, height, mouse_x, mouse_y, camera.pos,
-                 light, camera.proj_mat, camera.view_mat,
-                 scene_geometry, obj_count, program, PASS_FINAL);
+struct ShadowFaceRequest {
+    float priority;
+    int light;
+    int face;
+};
 
-    glBindTexture(GL_TEXTURE_2D, 0);
+static int compare_face_requests(const void* a, const void* b)
+{
+    float pa = ((ShadowFaceRequest*) a)->priority;
+    float pb = ((ShadowFaceRequest*) b)->priority;
+    return pa < pb ? 1 : pa > pb ? -1 : 0;
+}
+
+// Refreshes the shadow faces that need it most, at most shadow_face_budget
+// of them. A face needs it when it was never drawn or is dirty, or when
+// dynamic casters are or were in it; the faces of lights that only see
+// static casters are reused as they are. Faces rank by their light's
+// screen coverage times the frames since they were drawn, so the lights
+// that matter most refresh first and distant ones still catch up. Lights
+// off screen wait. Rebuilding a light's static cache doesn't count
+// against the budget.
+void shadow_update_lights(Light *lights, int num_lights, Camera *camera, SceneTree *scene,
+                          ShadowPrograms *programs)
+{
+    ShadowFaceRequest requests[MAX_LIGHTS * 6];
+    int dynamic_faces[MAX_LIGHTS];
+    int num_requests = 0;
+    for (int l = 0; l < num_lights; l++) {
+        Light *light = &lights[l];
+        for (int i = 0; i < 6; i++) light->shadow_face_age[i]++;
+        dynamic_faces[l] = 0;
+        if (!light->num_shadow_tiles) continue;
+
+        if (!glm_vec3_eqv(light->shadow_pos, light->pos)) {
+            glm_vec3_copy(light->pos, light->shadow_pos);
+            light->shadow_dirty_faces = 0x3f;
+            light->shadow_still_frames = 0;
+        } else {
+            light->shadow_still_frames++;
+        }
+        float coverage = light_screen_coverage(light, camera);
+        if (coverage == 0.0f) continue;
+
+        // other lights are redrawn every frame
+        int faces = 1;
+        if (light->type == POINTLIGHT) {
+            ShadowCube cube;
+            mat4 proj_mat, view_mats[6];
+            light_shadow_cube(light, proj_mat, view_mats, &cube);
+            dynamic_faces[l] = dynamic_caster_faces(scene, &cube);
+            faces = (~light->shadow_valid_faces | light->shadow_dirty_faces | dynamic_faces[l] |
+                     light->shadow_dynamic_faces) & cube.faces;
+        }
+
+        for (int i = 0; i < 6; i++) {
+            if (!(faces & (1 << i))) continue;
+            // undrawn faces leave the light unshadowed there, they go first
+            bool drawn = light->shadow_valid_faces & (1 << i);
+            ShadowFaceRequest *request = &requests[num_requests++];
+            request->priority = coverage * (drawn ? light->shadow_face_age[i] : 1 << 16);
+            request->light = l;
+            request->face = i;
+        }
+    }
+    qsort(requests, num_requests, sizeof(ShadowFaceRequest), compare_face_requests);
+
+    int faces[MAX_LIGHTS] = {};
+    for (int i = 0; i < num_requests && i < shadow_face_budget; i++) {
+        faces[requests[i].light] |= 1 << requests[i].face;
+    }
+    for (int l = 0; l < num_lights; l++) {
+        if (!faces[l]) continue;
+        shadow_mapping_pass(scene, programs, &lights[l], faces[l], dynamic_faces[l] & faces[l]);
+    }
+}
+
+void final_render(float width, float height, float mouse_x, float mouse_y,
+                  Camera camera, Light *light, SceneTree *scene,
+                  Program *program, GLuint shadow_map_tex, GLuint dither_tex)
+{
+    gl_state_bind_texture(0, GL_TEXTURE_2D, shadow_map_tex);
+    gl_state_bind_texture(1, GL_TEXTURE_2D, dither_tex);
+
+    glViewport(0, 0, width, height);
+    glClearColor(0.0, 0.0, 0.0, 1);
+    glClear(GL_COLOR_BUFFER_BIT | GL_DEPTH_BUFFER_BIT);
+    render_scene(mouse_x, mouse_y, camera.pos,
+                 light, camera.proj_mat, camera.view_mat,
+                 NULL, CASTERS_ALL, scene, program, PASS_FINAL);
 }
 
 Light create_light(LightType type, float x, float y, float z,
@@ -424,6 +856,11 @@ Light create_light(LightType type, float x, float y, float z,
         {x, y, z},
         {dir_x, dir_y, dir_z}
     };
+    light.shadow_resolution = SHADOW_MAP_RESOLUTION;
+#ifdef DUAL_PARABOLOID_SHADOWS
+    light.shadow_mode = SHADOW_DUAL_PARABOLOID;
+#endif
+    shadow_atlas_alloc_light(&light);
     return light;
 }
 
@@ -445,10 +882,27 @@ void update_camera_matrices(int width, int height, Camera* camera)
     glm_perspective(GLM_PI_4f, (float)width / height, 0.01f, FAR_PLANE, camera->proj_mat);
 }
 
+static int compare_floats(const void* a, const void* b)
+{
+    float x = *(const float*) a, y = *(const float*) b;
+    return (x > y) - (x < y);
+}
+
+// sorts times
+void print_frame_time_percentiles(const char* label, float* times, int n)
+{
+    if (n == 0) return;
+    qsort(times, n, sizeof(*times), compare_floats);
+    printf("%s: %d frames, p50 %.2f ms, p90 %.2f ms, p99 %.2f ms, max %.2f ms\n", label, n,
+           times[n / 2] * 1000.0f, times[n * 9 / 10] * 1000.0f, times[n * 99 / 100] * 1000.0f,
+           times[n - 1] * 1000.0f);
+}
+
 int main(int argc, char** argv)
 {
     GLFWwindow* window;
-    GLuint vertex_shader, fragment_shader, program;
+    GLuint vertex_shader, fragment_shader;
+    Program program;
     GLint mvp_location, model_mat_location;
     glfwSetErrorCallback(error_callback);
 
@@ -483,6 +937,23 @@ int main(int argc, char** argv)
 
     glfwSwapInterval(0); // TODO: check
 
+#ifdef TEXTURE_STREAMING
+    texture_streaming_init(TEXTURE_STREAM_THREADS);
+#endif
+
+    uniform_buffers_init();
+#ifdef MULTI_DRAW_INDIRECT
+    multi_draw_enabled = mesh_arena_init();
+#endif
+    shadow_atlas_init();
+#ifdef LAYERED_SHADOW_CUBE
+    // faces go to their atlas tiles through gl_ViewportIndex
+    layered_shadows_enabled = GLEW_ARB_viewport_array;
+#endif
+#ifdef SHADOW_CACHE
+    shadow_cache_enabled = shadow_atlas.static_tex != 0;
+#endif
+
     // TODO: fix the size
     GLchar shader_info_buffer[200];
     GLint shader_info_len;
@@ -495,31 +966,199 @@ int main(int argc, char** argv)
     }
 
     // load models
-    int monkey_id = loadModel("assets/monkey.obj", NULL, VERTEX_TEXTURE, false);
-    int man_id = loadModel("assets/man.obj", NULL, VERTEX_TEXTURE, false);
-    //int man_id = loadModel("assets/xbot.fbx", NULL, VERTEX_TEXTURE, false);
+    ModelHandle monkey_id = loadModel("assets/monkey.obj", NULL, false);
+    ModelHandle man_id = loadModel("assets/man.obj", NULL, false);
+    //ModelHandle man_id = loadModel("assets/xbot.fbx", NULL, false);
 #if 0
 #if 0
-    int plane_id = loadModel("assets/plane.obj", "assets/ground2.jpg", VERTEX_TEXTURE, true);
-    model_add_normal_map(&loaded_models[plane_id], "assets/ground2_normal_map3.jpg");
+    ModelHandle plane_id = loadModel("assets/plane.obj", "assets/ground2.jpg", true);
+    model_add_normal_map(model_get(plane_id), "assets/ground2_normal_map3.jpg");
 #else
-    int plane_id = loadModel("assets/plane.obj", "assets/brickwall_test.jpg", VERTEX_TEXTURE, true);
-    model_add_normal_map(&loaded_models[plane_id], "assets/brickwall_normal.jpg");
+    ModelHandle plane_id = loadModel("assets/plane.obj", "assets/brickwall_test.jpg", true);
+    model_add_normal_map(model_get(plane_id), "assets/brickwall_normal.jpg");
 #endif
 #else
     int num_tiles = 50;
     float tile_size = 1.0f;
-    int plane_id = create_tiled_plane(num_tiles, tile_size, 1/50.0f, "assets/brickwall_test.jpg");
-    //model_add_normal_map(&loaded_models[plane_id], "assets/brickwall_normal.jpg");
+    ModelHandle plane_id = create_tiled_plane(num_tiles, tile_size, 1/50.0f, "assets/brickwall_test.jpg");
+    //model_add_normal_map(model_get(plane_id), "assets/brickwall_normal.jpg");
 #endif
 
     // initialize scene geometry
+    double create_start = glfwGetTime();
 	Object man = create_object(OBJ_CHARACTER, man_id, 0, 0, 0, 5, 3.0, 2);
 	Object man2 = create_object(OBJ_CHARACTER, man_id, 5, 0, 3, 5, 3.0, 2);
 	Object plane = create_object(OBJ_GROUND, plane_id, 0, 0, 0, 0, 1, 256);
+    printf("Created 3 objects in %.3f ms, mesh VRAM: %.1f KB\n",
+           (glfwGetTime() - create_start) * 1000.0, mesh_gpu_bytes / 1024.0);
+
+#ifdef OBJECT_SPAWN_BENCHMARK
+    {
+        static Object wave[OBJECT_SPAWN_BENCHMARK];
+        size_t gpu_bytes_before = mesh_gpu_bytes;
+        double start = glfwGetTime();
+        for (int i = 0; i < OBJECT_SPAWN_BENCHMARK; i++) {
+            wave[i] = create_object(OBJ_CHARACTER, man_id, i % 50, 0, i / 50, 5, 3.0, 2);
+        }
+        printf("Spawned %d objects in %.3f ms, mesh VRAM grew by %zu bytes\n", OBJECT_SPAWN_BENCHMARK,
+               (glfwGetTime() - start) * 1000.0, mesh_gpu_bytes - gpu_bytes_before);
+        for (int i = 0; i < OBJECT_SPAWN_BENCHMARK; i++) {
+            destroy_object(&wave[i]);
+        }
+    }
+#endif
+
+#ifdef SKINNED_MESH_BENCHMARK
+    {
+        SkinnedModel xbot;
+        if (load_skinned_model(&xbot, "assets/xbot.fbx")) {
+            mat4* bone_matrices = (mat4*) malloc(xbot.num_bones * sizeof(mat4));
+            double start = glfwGetTime();
+            for (int i = 0; i < SKINNED_MESH_BENCHMARK; i++) {
+                skinned_model_pose(&xbot, 0, i / 60.0f, bone_matrices);
+            }
+            double elapsed = glfwGetTime() - start;
+            printf("Evaluated %d poses in %.2f ms (%.2f us/pose, %d nodes, %d bones)\n", SKINNED_MESH_BENCHMARK,
+                   elapsed * 1000.0, elapsed * 1e6 / SKINNED_MESH_BENCHMARK, xbot.num_nodes, xbot.num_bones);
+            free(bone_matrices);
+            skinned_model_free(&xbot);
+        }
+    }
+#endif
+#ifdef SCENE_TREE_BENCHMARK
+    {
+        // objects wandering over a 1000x1000 area: each frame all of them
+        // move and the tree is updated, then queried like the renderer and
+        // gameplay code do
+        const float area = 1000.0f;
+        const float dt = 1.0f / 60.0f;
+        const int num_queries = 100;
+        Object* movers = (Object*) malloc(SCENE_TREE_BENCHMARK * sizeof(Object));
+        vec2* velocities = (vec2*) malloc(SCENE_TREE_BENCHMARK * sizeof(vec2));
+        Object** mover_list = (Object**) malloc(SCENE_TREE_BENCHMARK * sizeof(Object*));
+        Object** visible = (Object**) malloc(SCENE_TREE_BENCHMARK * sizeof(Object*));
+        Object* nearby[256];
+        srand(1);
+        for (int i = 0; i < SCENE_TREE_BENCHMARK; i++) {
+            float x = area * rand() / RAND_MAX, z = area * rand() / RAND_MAX;
+            movers[i] = create_object(OBJ_CHARACTER, man_id, x, 0, z, 5, 3.0, 2);
+            velocities[i][0] = 4.0f * rand() / RAND_MAX - 2.0f;
+            velocities[i][1] = 4.0f * rand() / RAND_MAX - 2.0f;
+            object_update_bounds(&movers[i]);
+            mover_list[i] = &movers[i];
+        }
+
+        SceneTree tree;
+        double start = glfwGetTime();
+        scene_tree_init(&tree, 2 * SCENE_TREE_BENCHMARK);
+        for (int i = 0; i < SCENE_TREE_BENCHMARK; i++) scene_tree_insert(&tree, &movers[i]);
+        double inserted = glfwGetTime();
+        scene_tree_rebuild(&tree);
+        printf("Scene tree: %d objects inserted in %.2f ms, SAH rebuild in %.2f ms\n", SCENE_TREE_BENCHMARK,
+               (inserted - start) * 1000.0, (glfwGetTime() - inserted) * 1000.0);
+
+        mat4 proj, view, view_proj;
+        vec3 eye = { area / 2, 30.0f, -20.0f }, target = { area / 2, 0.0f, area / 2 }, up = { 0, 1, 0 };
+        glm_perspective(GLM_PI_4f, 16.0f / 9.0f, 0.01f, FAR_PLANE, proj);
+        glm_lookat(eye, target, up, view);
+        glm_mat4_mul(proj, view, view_proj);
+
+        static float times[6][SCENE_TREE_BENCHMARK_FRAMES];
+        long long num_visible = 0, num_nearby = 0, num_hits = 0;
+        int num_rebuilds = 0;
+        for (int frame = 0; frame < SCENE_TREE_BENCHMARK_FRAMES; frame++) {
+            double t0 = glfwGetTime();
+            for (int i = 0; i < SCENE_TREE_BENCHMARK; i++) {
+                Object* obj = &movers[i];
+                for (int c = 0; c < 2; c++) {
+                    float* coord = &obj->pos[c * 2];
+                    *coord += velocities[i][c] * dt;
+                    // bounce off the edges of the area
+                    if (*coord < 0.0f || *coord > area) velocities[i][c] = -velocities[i][c];
+                }
+                object_update_bounds(obj);
+            }
+            double t1 = glfwGetTime();
+            for (int i = 0; i < SCENE_TREE_BENCHMARK; i++) scene_tree_update(&tree, &movers[i]);
+            double t2 = glfwGetTime();
+            num_rebuilds += scene_tree_maintain(&tree);
+            double t3 = glfwGetTime();
+            int n = scene_tree_query_frustum(&tree, view_proj, visible);
+            double t4 = glfwGetTime();
+            int n_linear = frustum_cull(view_proj, mover_list, SCENE_TREE_BENCHMARK, visible);
+            assert(n == n_linear);
+            double t5 = glfwGetTime();
+            for (int q = 0; q < num_queries; q++) {
+                vec3 center = { area * rand() / RAND_MAX, 0.0f, area * rand() / RAND_MAX };
+                num_nearby += scene_tree_query_sphere(&tree, center, 5.0f, ~0u, nearby, 256);
+
+                vec3 dir = { area * rand() / RAND_MAX - eye[0], -eye[1], area * rand() / RAND_MAX - eye[2] };
+                glm_vec3_normalize(dir);
+                float t;
+                num_hits += scene_tree_raycast(&tree, eye, dir, FAR_PLANE, ~0u, &t) != NULL;
+            }
+            double t6 = glfwGetTime();
+
+            num_visible += n;
+            times[0][frame] = t1 - t0;
+            times[1][frame] = t2 - t1;
+            times[2][frame] = t3 - t2;
+            times[3][frame] = t4 - t3;
+            times[4][frame] = t5 - t4;
+            times[5][frame] = t6 - t5;
+        }
+
+        printf("Scene tree: %d frames, %d rebuilds, %lld visible, %.1f objects per radius query, %.0f%% rays hit\n",
+               SCENE_TREE_BENCHMARK_FRAMES, num_rebuilds, num_visible / SCENE_TREE_BENCHMARK_FRAMES,
+               (double) num_nearby / (num_queries * SCENE_TREE_BENCHMARK_FRAMES),
+               100.0 * num_hits / (num_queries * SCENE_TREE_BENCHMARK_FRAMES));
+        print_frame_time_percentiles("Object bounds update", times[0], SCENE_TREE_BENCHMARK_FRAMES);
+        print_frame_time_percentiles("Scene tree update", times[1], SCENE_TREE_BENCHMARK_FRAMES);
+        print_frame_time_percentiles("Scene tree maintain", times[2], SCENE_TREE_BENCHMARK_FRAMES);
+        print_frame_time_percentiles("Scene tree frustum query", times[3], SCENE_TREE_BENCHMARK_FRAMES);
+        print_frame_time_percentiles("Linear frustum cull", times[4], SCENE_TREE_BENCHMARK_FRAMES);
+        print_frame_time_percentiles("Scene tree 100 radius queries + 100 raycasts", times[5], SCENE_TREE_BENCHMARK_FRAMES);
+
+        scene_tree_free(&tree);
+        for (int i = 0; i < SCENE_TREE_BENCHMARK; i++) destroy_object(&movers[i]);
+        free(movers);
+        free(velocities);
+        free(mover_list);
+        free(visible);
+    }
+#endif
     //plane.scale_tex_coords = 88.0;
+#ifdef CROWD_BENCHMARK
+    // a grid of enemies covering the plane, all drawn by a few instanced draws
+    int crowd_side = (int) ceilf(sqrtf(CROWD_BENCHMARK));
+    float crowd_spacing = (num_tiles * tile_size - 2.0f) / crowd_side;
+    Object* crowd = (Object*) malloc(CROWD_BENCHMARK * sizeof(Object));
+    for (int i = 0; i < CROWD_BENCHMARK; i++) {
+        float x = 1.0f + (i % crowd_side + 0.5f) * crowd_spacing;
+        float z = 1.0f + (i / crowd_side + 0.5f) * crowd_spacing;
+        crowd[i] = create_object(OBJ_CHARACTER, man_id, x, 0, z, 5, 3.0, 2);
+    }
+    int obj_count = 3 + CROWD_BENCHMARK;
+    Object **scene_geometry = (Object**) malloc(obj_count * sizeof(Object*));
+    scene_geometry[0] = &man;
+    scene_geometry[1] = &man2;
+    scene_geometry[2] = &plane;
+    for (int i = 0; i < CROWD_BENCHMARK; i++) scene_geometry[3 + i] = &crowd[i];
+    static float crowd_frame_times[CROWD_BENCHMARK_FRAMES];
+    int crowd_frame = 0;
+#else
     Object *scene_geometry[] = { &man, &man2, &plane };
     int obj_count = sizeof(scene_geometry) / sizeof(*scene_geometry);
+#endif
+
+    // culling and picking go through the scene tree
+    SceneTree scene;
+    scene_tree_init(&scene, 2 * obj_count);
+    for (int i = 0; i < obj_count; i++) {
+        object_update_bounds(scene_geometry[i]);
+        scene_tree_insert(&scene, scene_geometry[i]);
+    }
+    scene_tree_rebuild(&scene);
 
     // initialize camera data
     Camera camera;
@@ -528,17 +1167,28 @@ int main(int argc, char** argv)
         camera = create_targeted_camera(camera_pos, &man.pos);
     }
 
-    // initialize light data
-    Light light = create_light(POINTLIGHT,   0, 8.0, 8.0,   0, 0, 0);
+    // initialize light data, the first light follows the cursor
+    Light lights[MAX_LIGHTS];
+    int num_lights = 0;
+    lights[num_lights++] = create_light(POINTLIGHT,   0, 8.0, 8.0,   0, 0, 0);
+#ifdef EXTRA_LIGHTS
+    for (int i = 0; i < EXTRA_LIGHTS; i++) {
+        // on a spiral around the origin
+        float angle = i * 2.4f, radius = 6.0f + 3.0f * i;
+        lights[num_lights++] = create_light(POINTLIGHT, radius * cosf(angle), 6.0, radius * sinf(angle), 0, 0, 0);
+    }
+#endif
+    Light *light = &lights[0];
 
     float delta_time = glfwGetTime();
     float last_time = glfwGetTime();
 
     POLL_GL_ERROR;
 
-    GLuint shadow_map_fbo, shadow_map_tex;
-    initialize_shadow_map_fbo(&shadow_map_fbo, &shadow_map_tex, light);
-    GLuint shadow_map_program = create_shadow_map_program();
+    ShadowPrograms shadow_programs;
+    shadow_programs.faces = create_shadow_map_program();
+    shadow_programs.layered = create_layered_shadow_map_program();
+    shadow_programs.paraboloid = create_paraboloid_shadow_map_program();
 
     const GLchar dither_pattern[] = {
         0, 32,  8, 40,  2, 34, 10, 42,
@@ -563,17 +1213,93 @@ int main(int argc, char** argv)
 
     float last_fps_update = glfwGetTime();
     int num_frames = 0;
+    bool first_frame = true;
+
+#ifdef TEXTURE_STREAMING_BENCHMARK
+    const char* benchmark_textures[] = {
+        "assets/ground.jpg", "assets/ground2.jpg", "assets/ground_normal_map.jpg",
+        "assets/ground_normal_map2.jpg", "assets/ground2_normal_map.jpg",
+        "assets/ground2_normal_map2.jpg", "assets/ground2_normal_map3.jpg", "assets/brickwall.jpg",
+    };
+    const int num_benchmark_textures = sizeof(benchmark_textures) / sizeof(*benchmark_textures);
+    GLuint benchmark_texture_ids[num_benchmark_textures];
+    static float benchmark_frame_times[4096];
+    int benchmark_frame = 0;
+#endif
 
     POLL_GL_ERROR;
     while (!glfwWindowShouldClose(window)) {
         delta_time = glfwGetTime() - last_time;
         last_time += delta_time;
 
+#ifdef TEXTURE_STREAMING
+        texture_streaming_update(TEXTURE_STREAM_BUDGET);
+#endif
+
+#ifdef TEXTURE_STREAMING_BENCHMARK
+        // warm up, then load the batch and record frame times until every
+        // texture has arrived plus one more second
+        if (benchmark_frame == 60) {
+            for (int i = 0; i < num_benchmark_textures; i++) {
+#ifdef TEXTURE_STREAMING
+                benchmark_texture_ids[i] = loadTextureAsync(benchmark_textures[i], texture_fallback_color);
+#else
+                benchmark_texture_ids[i] = loadTexture(benchmark_textures[i]);
+#endif
+            }
+        }
+        if (benchmark_frame > 60) {
+            static int frames_after_done = 0;
+            static int n = 0;
+            if (n < 4096) benchmark_frame_times[n++] = delta_time;
+#ifdef TEXTURE_STREAMING
+            bool done = texture_streaming_pending() == 0;
+#else
+            bool done = true;
+#endif
+            if (done && ++frames_after_done == 60) {
+                print_frame_time_percentiles("Texture streaming benchmark", benchmark_frame_times, n);
+                for (int i = 0; i < num_benchmark_textures; i++) {
+                    texture_release(benchmark_texture_ids[i]);
+                }
+            }
+        }
+        benchmark_frame++;
+#endif
+
+#ifdef CROWD_BENCHMARK
+        // skip the first frames while the driver warms up
+        if (crowd_frame >= 10 && crowd_frame < 10 + CROWD_BENCHMARK_FRAMES) {
+            crowd_frame_times[crowd_frame - 10] = delta_time;
+        }
+        if (++crowd_frame == 10 + CROWD_BENCHMARK_FRAMES) {
+            printf("Crowd benchmark: %d objects\n", obj_count);
+            print_frame_time_percentiles("Crowd benchmark", crowd_frame_times, CROWD_BENCHMARK_FRAMES);
+        }
+#endif
+
         // Measure FPS
         double currentTime = glfwGetTime();
         num_frames++;
         if (currentTime - last_fps_update >= 1.0) {
-            printf("%f ms/frame (%f FPS)\n", 1000.0 / double(num_frames), double(num_frames));
+            printf("%f ms/frame (%f FPS), render CPU %.3f ms/frame (shadow %.3f), triangles/frame: %lld shadow, %lld final, draws/frame: %lld shadow, %lld final, state changes/frame: %lld (%lld redundant skipped), visible/culled per frame: %lld/%lld shadow, %lld/%lld final, shadow faces refreshed/drawn per frame: %lld/%lld (budget %d), shadow cache rebuilds: %lld\n",
+                   1000.0 / double(num_frames), double(num_frames), render_cpu_seconds * 1000.0 / num_frames,
+                   shadow_cpu_seconds * 1000.0 / num_frames,
+                   pass_triangles[PASS_SHADOW_MAP] / num_frames, pass_triangles[PASS_FINAL] / num_frames,
+                   pass_draw_calls[PASS_SHADOW_MAP] / num_frames, pass_draw_calls[PASS_FINAL] / num_frames,
+                   state_changes / num_frames, state_changes_skipped / num_frames,
+                   pass_visible[PASS_SHADOW_MAP] / num_frames, pass_culled[PASS_SHADOW_MAP] / num_frames,
+                   pass_visible[PASS_FINAL] / num_frames, pass_culled[PASS_FINAL] / num_frames,
+                   shadow_faces_refreshed / num_frames, shadow_faces_drawn / num_frames, shadow_face_budget,
+                   shadow_cache_rebuilds);
+            shadow_atlas_print_stats(lights, num_lights);
+            pass_triangles[PASS_SHADOW_MAP] = pass_triangles[PASS_FINAL] = 0;
+            pass_draw_calls[PASS_SHADOW_MAP] = pass_draw_calls[PASS_FINAL] = 0;
+            state_changes = state_changes_skipped = 0;
+            pass_visible[PASS_SHADOW_MAP] = pass_visible[PASS_FINAL] = 0;
+            pass_culled[PASS_SHADOW_MAP] = pass_culled[PASS_FINAL] = 0;
+            render_cpu_seconds = shadow_cpu_seconds = 0.0;
+            shadow_faces_refreshed = shadow_faces_drawn = shadow_cache_rebuilds = 0;
             num_frames = 0;
             last_fps_update += 1.0;
         }
@@ -625,9 +1351,24 @@ int main(int argc, char** argv)
         vec3 plane_normal = { 0.0, 1.0, 0.0 };
         vec3 target_pos;
         ray_plane_intersection(ray_origin, ray_dir, plane_normal, 0.0f, target_pos);
-        float light_y = light.pos[1];
-        glm_vec3_copy(target_pos, light.pos);
-        light.pos[1] = light_y;
+        float light_y = light->pos[1];
+        glm_vec3_copy(target_pos, light->pos);
+        light->pos[1] = light_y;
+
+        // right click picks the character under the cursor
+        static bool was_picking = false;
+        bool picking = glfwGetMouseButton(window, 1);
+        if (picking && !was_picking) {
+            float t;
+            Object *picked = scene_tree_raycast(&scene, ray_origin, ray_dir, FAR_PLANE, 1u << OBJ_CHARACTER, &t);
+            if (picked) {
+                Object *nearby[64];
+                int num_nearby = scene_tree_query_sphere(&scene, picked->pos, 5.0f, 1u << OBJ_CHARACTER, nearby, 64);
+                printf("Picked character at (%.2f, %.2f, %.2f), %.2f from the camera, %d characters within 5 units\n",
+                       picked->pos[0], picked->pos[1], picked->pos[2], t, num_nearby - 1);
+            }
+        }
+        was_picking = picking;
 
         // mouse picking for raising/lowering terrain
         // TODO: continue from here, debug normals
@@ -640,7 +1381,7 @@ int main(int argc, char** argv)
             vec3 target_pos;
             ray_plane_intersection(ray_origin, ray_dir, plane_normal, 0.0f, target_pos);
 
-            Model *plane_model = &loaded_models[plane_id];
+            Model *plane_model = model_get(plane_id);
             int width = num_tiles * 6;
             float area = 3.1f;
             float steepness = 0.6f;
@@ -753,23 +1494,18 @@ int main(int argc, char** argv)
                 }
             }
 
-            // upload new data
-            // TODO: cleanup
-            static GLuint vbo = -1, vbo2 = -1;
-            if (vbo == -1) {
-                // TODO: free
-                glGenBuffers(1, &vbo);
-                glGenBuffers(1, &vbo2);
+            // upload new data into the plane model's own buffers
+            glBindBuffer(GL_ARRAY_BUFFER, plane_model->vertex_buffers[0]);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, plane_model->num_vertices * sizeof(vec3), plane_model->vertices);
+            glBindBuffer(GL_ARRAY_BUFFER, plane_model->vertex_buffers[1]);
+            glBufferSubData(GL_ARRAY_BUFFER, 0, plane_model->num_vertices * sizeof(vec3), plane_model->normals);
+            glBindBuffer(GL_ARRAY_BUFFER, 0);
+            model_compute_bounds(plane_model, plane_model->num_vertices);
+            // the terrain is a static caster
+            for (int i = 0; i < num_lights; i++) {
+                lights[i].shadow_cache.valid = false;
+                lights[i].shadow_dirty_faces = 0x3f;
             }
-            // TODO: use buffersubdata
-            glBindVertexArray(plane.vao);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo);
-            glBufferData(GL_ARRAY_BUFFER, plane_model->num_faces * 3 * sizeof(vec3), plane_model->vertices, GL_STREAM_DRAW);
-            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-            glBufferData(GL_ARRAY_BUFFER, plane_model->num_faces * 3 * sizeof(vec3), plane_model->normals, GL_STREAM_DRAW);
-            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-            glBindVertexArray(0);
         }
 
         // update player direction
@@ -777,28 +1513,218 @@ int main(int argc, char** argv)
         man.dir[1] = ypos;
         glm_vec2_normalize(man.dir);
 
+        double render_start = glfwGetTime();
+        for (int i = 0; i < obj_count; i++) {
+            object_update_bounds(scene_geometry[i]);
+            scene_tree_update(&scene, scene_geometry[i]);
+        }
+        scene_tree_maintain(&scene);
+        // texture uploads and the editor bind GL state behind the cache's back
+        gl_state_invalidate();
+        if (light->shadow_resolution != light_shadow_resolution || light->shadow_mode != light_shadow_mode) {
+            light->shadow_resolution = light_shadow_resolution;
+            light->shadow_mode = light_shadow_mode;
+            shadow_atlas_alloc_light(light);
+        }
+
         // shadow mapping
-        shadow_mapping_pass(width, height, shadow_map_fbo, shadow_map_tex,
-                            scene_geometry, obj_count, shadow_map_program, &light);
+#ifdef SHADOW_CACHE_BENCHMARK
+        // the last two runs wiggle the light every frame, like moving the
+        // mouse does
+        static int cache_benchmark_frame = 0;
+        if ((cache_benchmark_frame - 10) / CROWD_BENCHMARK_FRAMES >= 2) {
+            light->pos[0] += 0.5f * sinf(cache_benchmark_frame * 0.3f);
+        }
+#endif
+#if defined(SHADOW_CACHE_BENCHMARK) || defined(SHADOW_BUDGET_BENCHMARK) || defined(SHADOW_PARABOLOID_BENCHMARK)
+        static GLuint shadow_query = 0;
+        if (!shadow_query) glGenQueries(1, &shadow_query);
+        glBeginQuery(GL_TIME_ELAPSED, shadow_query);
+#endif
+        double shadow_start = glfwGetTime();
+#if defined(SHADOW_BUDGET_BENCHMARK) || defined(SHADOW_PARABOLOID_BENCHMARK)
+        long long faces_before = shadow_faces_refreshed;
+#endif
+        shadow_update_lights(lights, num_lights, &camera, &scene, &shadow_programs);
+        double shadow_seconds = glfwGetTime() - shadow_start;
+#if defined(SHADOW_BUDGET_BENCHMARK) || defined(SHADOW_PARABOLOID_BENCHMARK)
+        int shadow_faces = (int) (shadow_faces_refreshed - faces_before);
+#endif
+        shadow_cpu_seconds += shadow_seconds;
+#if defined(SHADOW_CACHE_BENCHMARK) || defined(SHADOW_BUDGET_BENCHMARK) || defined(SHADOW_PARABOLOID_BENCHMARK)
+        glEndQuery(GL_TIME_ELAPSED);
+#endif
+        // the lights and the shadow faces as they were drawn
+        update_frame_uniforms(lights, num_lights);
 
 #if 1
         // render actual scene
         final_render(width, height, nds_x, nds_y, camera,
-                     &light, scene_geometry, obj_count, program,
-                     shadow_map_tex, dither_tex);
+                     light, &scene, &program,
+                     shadow_atlas.tex, dither_tex);
 #else
         POLL_GL_ERROR;
         // blit shadow map to screen quad
-        //blit_texture(width, height, shadow_map_tex);
-        blit_texture(width, height, loaded_models[plane_id].normal_map_id);
+        //blit_texture(width, height, shadow_atlas.tex);
+        blit_texture(width, height, model_get(plane_id)->normal_map_id);
+#endif
+        render_cpu_seconds += glfwGetTime() - render_start;
+
+#ifdef SHADOW_CACHE_BENCHMARK
+        // after the warm-up, CROWD_BENCHMARK_FRAMES frames with the static
+        // shadow cache and as many without, then both again with the light
+        // moving. Waits for the GPU every frame.
+        {
+            static float shadow_times[4][CROWD_BENCHMARK_FRAMES];
+            int frame = cache_benchmark_frame;
+            int run = (frame - 10) / CROWD_BENCHMARK_FRAMES;
+            if (frame >= 10 && run < 4) {
+                GLuint64 elapsed;
+                glGetQueryObjectui64v(shadow_query, GL_QUERY_RESULT, &elapsed);
+                shadow_times[run][(frame - 10) % CROWD_BENCHMARK_FRAMES] = elapsed * 1e-9f;
+            }
+            frame = ++cache_benchmark_frame;
+            if (frame == 10 + CROWD_BENCHMARK_FRAMES || frame == 10 + 3 * CROWD_BENCHMARK_FRAMES) {
+                shadow_cache_enabled = false;
+            } else if (frame == 10 + 2 * CROWD_BENCHMARK_FRAMES) {
+                shadow_cache_enabled = true;
+            } else if (frame == 10 + 4 * CROWD_BENCHMARK_FRAMES) {
+                print_frame_time_percentiles("Shadow pass GPU, static cache", shadow_times[0], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, no cache", shadow_times[1], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, static cache, moving light", shadow_times[2],
+                                             CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, no cache, moving light", shadow_times[3],
+                                             CROWD_BENCHMARK_FRAMES);
+            }
+        }
+#endif
+
+#ifdef SHADOW_BUDGET_BENCHMARK
+        // after the warm-up, CROWD_BENCHMARK_FRAMES frames within the shadow
+        // face budget and as many refreshing every face that needs it.
+        // Waits for the GPU every frame.
+        {
+            static float shadow_times[2][CROWD_BENCHMARK_FRAMES];
+            static long long faces_refreshed[2];
+            static int frame = 0;
+            int run = (frame - 10) / CROWD_BENCHMARK_FRAMES;
+            if (frame == 10) shadow_face_budget = SHADOW_FACE_BUDGET;
+            if (frame >= 10 && run < 2) {
+                GLuint64 elapsed;
+                glGetQueryObjectui64v(shadow_query, GL_QUERY_RESULT, &elapsed);
+                shadow_times[run][(frame - 10) % CROWD_BENCHMARK_FRAMES] = elapsed * 1e-9f;
+                faces_refreshed[run] += shadow_faces;
+            }
+            if (++frame == 10 + CROWD_BENCHMARK_FRAMES) {
+                shadow_face_budget = MAX_LIGHTS * 6;
+            } else if (frame == 10 + 2 * CROWD_BENCHMARK_FRAMES) {
+                printf("Shadow budget benchmark: %d lights, faces refreshed/frame: %.1f within the budget, %.1f without\n",
+                       num_lights, (double) faces_refreshed[0] / CROWD_BENCHMARK_FRAMES,
+                       (double) faces_refreshed[1] / CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, face budget", shadow_times[0], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, no budget", shadow_times[1], CROWD_BENCHMARK_FRAMES);
+            }
+        }
+#endif
+
+#ifdef SHADOW_PARABOLOID_BENCHMARK
+        // after the warm-up, CROWD_BENCHMARK_FRAMES frames with every point
+        // light in cube mode and as many in dual-paraboloid mode, each run
+        // starting from freshly allocated maps. Waits for the GPU every frame.
+        {
+            static float shadow_times[2][CROWD_BENCHMARK_FRAMES];
+            static long long faces_refreshed[2];
+            static long long atlas_bytes[2];
+            static int frame = 0;
+            int run = (frame - 10) / CROWD_BENCHMARK_FRAMES;
+            if (frame >= 10 && run < 2) {
+                GLuint64 elapsed;
+                glGetQueryObjectui64v(shadow_query, GL_QUERY_RESULT, &elapsed);
+                shadow_times[run][(frame - 10) % CROWD_BENCHMARK_FRAMES] = elapsed * 1e-9f;
+                faces_refreshed[run] += shadow_faces;
+            }
+            if (frame == 9 || frame == 9 + CROWD_BENCHMARK_FRAMES) {
+                light_shadow_mode = frame == 9 ? SHADOW_CUBE : SHADOW_DUAL_PARABOLOID;
+                shadow_face_budget = MAX_LIGHTS * 6;
+                atlas_bytes[frame != 9] = 0;
+                for (int i = 0; i < num_lights; i++) {
+                    lights[i].shadow_mode = light_shadow_mode;
+                    shadow_atlas_alloc_light(&lights[i]);
+                    atlas_bytes[frame != 9] += shadow_light_bytes(&lights[i]);
+                }
+            }
+            if (++frame == 10 + 2 * CROWD_BENCHMARK_FRAMES) {
+                printf("Shadow paraboloid benchmark: %d lights, faces refreshed/frame: %.1f cube, %.1f paraboloid, "
+                       "atlas: %.1f MB cube, %.1f MB paraboloid\n", num_lights,
+                       (double) faces_refreshed[0] / CROWD_BENCHMARK_FRAMES,
+                       (double) faces_refreshed[1] / CROWD_BENCHMARK_FRAMES,
+                       atlas_bytes[0] / (1024.0 * 1024.0), atlas_bytes[1] / (1024.0 * 1024.0));
+                print_frame_time_percentiles("Shadow pass GPU, cube", shadow_times[0], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass GPU, dual-paraboloid", shadow_times[1], CROWD_BENCHMARK_FRAMES);
+            }
+        }
+#endif
+
+#ifdef LAYERED_SHADOW_BENCHMARK
+        // after the warm-up, CROWD_BENCHMARK_FRAMES frames with the layered
+        // shadow cube and as many face by face
+        {
+            static float shadow_times[2][CROWD_BENCHMARK_FRAMES];
+            static int frame = 0;
+            int run = (frame - 10) / CROWD_BENCHMARK_FRAMES;
+            if (frame == 10) layered_shadows_enabled = true;
+            if (frame >= 10 && run < 2) {
+                shadow_times[run][(frame - 10) % CROWD_BENCHMARK_FRAMES] = shadow_seconds;
+            }
+            if (++frame == 10 + CROWD_BENCHMARK_FRAMES) {
+                layered_shadows_enabled = false;
+            } else if (frame == 10 + 2 * CROWD_BENCHMARK_FRAMES) {
+                print_frame_time_percentiles("Shadow pass CPU, layered cube", shadow_times[0], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Shadow pass CPU, face by face", shadow_times[1], CROWD_BENCHMARK_FRAMES);
+            }
+        }
+#endif
+
+#ifdef MULTI_DRAW_BENCHMARK
+        // after the warm-up, CROWD_BENCHMARK_FRAMES frames with multi-draw
+        // indirect and as many with one call per draw
+        {
+            static float render_times[2][CROWD_BENCHMARK_FRAMES];
+            static int frame = 0;
+            int run = (frame - 10) / CROWD_BENCHMARK_FRAMES;
+            if (frame >= 10 && run < 2) {
+                render_times[run][(frame - 10) % CROWD_BENCHMARK_FRAMES] = glfwGetTime() - render_start;
+            }
+            if (++frame == 10 + CROWD_BENCHMARK_FRAMES) {
+                multi_draw_enabled = false;
+            } else if (frame == 10 + 2 * CROWD_BENCHMARK_FRAMES) {
+                print_frame_time_percentiles(mesh_arena.enabled ? "Render CPU, multi-draw indirect" : "Render CPU, no mesh arena",
+                                             render_times[0], CROWD_BENCHMARK_FRAMES);
+                print_frame_time_percentiles("Render CPU, one call per draw", render_times[1], CROWD_BENCHMARK_FRAMES);
+            }
+        }
 #endif
 
         // present
         glfwSwapBuffers(window);
         POLL_GL_ERROR;
+
+        if (first_frame) {
+            // glfw's timer starts at glfwInit
+            glFinish();
+            printf("First frame after %.2f ms\n", glfwGetTime() * 1000.0);
+            first_frame = false;
+        }
+
+        model_collect_unused();
+
         glfwPollEvents();
     }
 
+#ifdef TEXTURE_STREAMING
+    texture_streaming_shutdown();
+#endif
+
     glfwDestroyWindow(window);
     glfwPollEvents();
 
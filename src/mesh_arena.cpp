@@ -0,0 +1,196 @@
+// Shared vertex and index buffers for packed models.
+//
+// Models uploaded into the arena all use one VAO, so any number of their
+// draws can be submitted with one glMultiDrawElementsIndirect: each
+// command selects the model's index range and base vertex, and its base
+// instance selects the draw's first InstanceData in the instance stream.
+// Indices are stored as 32-bit, relative to the model's first vertex.
+//
+// Vertex and index ranges are first-fit allocated from free lists, so an
+// unloaded model's space is reused by the next ones.
+
+struct ArenaRange {
+    int first;
+    int count;
+};
+
+struct ArenaAllocator {
+    ArenaRange* free_ranges; // sorted by first, never adjacent
+    int num_free;
+    int cap_free;
+};
+
+struct MeshArena {
+    bool enabled;
+    GLuint vao;
+    GLuint vertex_buffer;
+    GLuint index_buffer;
+    ArenaAllocator vertices;
+    ArenaAllocator indices;
+};
+
+static MeshArena mesh_arena;
+
+static void arena_allocator_init(ArenaAllocator* allocator, int capacity)
+{
+    allocator->cap_free = 16;
+    allocator->free_ranges = (ArenaRange*) malloc(allocator->cap_free * sizeof(ArenaRange));
+    allocator->free_ranges[0].first = 0;
+    allocator->free_ranges[0].count = capacity;
+    allocator->num_free = 1;
+}
+
+// Returns the first element of count free ones, -1 when there's no range
+// large enough.
+static int arena_alloc(ArenaAllocator* allocator, int count)
+{
+    for (int i = 0; i < allocator->num_free; i++) {
+        ArenaRange* range = &allocator->free_ranges[i];
+        if (range->count < count) continue;
+
+        int first = range->first;
+        range->first += count;
+        range->count -= count;
+        if (range->count == 0) {
+            memmove(range, range + 1, (allocator->num_free - i - 1) * sizeof(ArenaRange));
+            allocator->num_free--;
+        }
+        return first;
+    }
+    return -1;
+}
+
+static void arena_free(ArenaAllocator* allocator, int first, int count)
+{
+    int i = 0;
+    while (i < allocator->num_free && allocator->free_ranges[i].first < first) i++;
+
+    ArenaRange* ranges = allocator->free_ranges;
+    bool merge_prev = i > 0 && ranges[i - 1].first + ranges[i - 1].count == first;
+    bool merge_next = i < allocator->num_free && first + count == ranges[i].first;
+
+    if (merge_prev && merge_next) {
+        ranges[i - 1].count += count + ranges[i].count;
+        memmove(&ranges[i], &ranges[i + 1], (allocator->num_free - i - 1) * sizeof(ArenaRange));
+        allocator->num_free--;
+    } else if (merge_prev) {
+        ranges[i - 1].count += count;
+    } else if (merge_next) {
+        ranges[i].first = first;
+        ranges[i].count += count;
+    } else {
+        if (allocator->num_free == allocator->cap_free) {
+            allocator->cap_free *= 2;
+            allocator->free_ranges = (ArenaRange*) realloc(allocator->free_ranges,
+                                                           allocator->cap_free * sizeof(ArenaRange));
+            ranges = allocator->free_ranges;
+        }
+        memmove(&ranges[i + 1], &ranges[i], (allocator->num_free - i) * sizeof(ArenaRange));
+        ranges[i].first = first;
+        ranges[i].count = count;
+        allocator->num_free++;
+    }
+}
+
+// Returns false, leaving models on their own buffers, when multi-draw
+// indirect isn't supported.
+bool mesh_arena_init()
+{
+    if (!GLEW_ARB_multi_draw_indirect || !GLEW_ARB_base_instance) {
+        printf("Mesh arena: no ARB_multi_draw_indirect/ARB_base_instance, drawing models one by one\n");
+        return false;
+    }
+
+    arena_allocator_init(&mesh_arena.vertices, MESH_ARENA_VERTICES);
+    arena_allocator_init(&mesh_arena.indices, MESH_ARENA_INDICES);
+
+    glGenVertexArrays(1, &mesh_arena.vao);
+    gl_state_bind_vertex_array(mesh_arena.vao);
+        glGenBuffers(1, &mesh_arena.index_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, mesh_arena.index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, MESH_ARENA_INDICES * sizeof(unsigned int), NULL, GL_STATIC_DRAW);
+
+        glGenBuffers(1, &mesh_arena.vertex_buffer);
+        glBindBuffer(GL_ARRAY_BUFFER, mesh_arena.vertex_buffer);
+        glBufferData(GL_ARRAY_BUFFER, MESH_ARENA_VERTICES * sizeof(PackedVertex), NULL, GL_STATIC_DRAW);
+        packed_vertex_attrib_pointers();
+
+        for (int i = 0; i < 4; i++) {
+            glEnableVertexAttribArray(INSTANCE_ATTRIB_MODEL_ROWS + i);
+            glVertexAttribDivisor(INSTANCE_ATTRIB_MODEL_ROWS + i, 1);
+        }
+    gl_state_bind_vertex_array(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    mesh_arena.enabled = true;
+    printf("Mesh arena: %d vertices, %d indices\n", MESH_ARENA_VERTICES, MESH_ARENA_INDICES);
+    return true;
+}
+
+// Uploads a packed model into the arena, false if it doesn't fit.
+bool mesh_arena_add(Model* model)
+{
+    if (!mesh_arena.enabled || !model->packed_vertices) return false;
+
+    int num_indices = model_num_indices(model);
+    int first_vertex = arena_alloc(&mesh_arena.vertices, model->num_vertices);
+    if (first_vertex < 0) return false;
+    int first_index = arena_alloc(&mesh_arena.indices, num_indices);
+    if (first_index < 0) {
+        arena_free(&mesh_arena.vertices, first_vertex, model->num_vertices);
+        return false;
+    }
+
+    unsigned int* indices = (unsigned int*) malloc(num_indices * sizeof(unsigned int));
+    for (int i = 0; i < num_indices; i++) indices[i] = model_get_index(model, i);
+
+    glBindBuffer(GL_ARRAY_BUFFER, mesh_arena.vertex_buffer);
+    glBufferSubData(GL_ARRAY_BUFFER, first_vertex * sizeof(PackedVertex),
+                    model->num_vertices * sizeof(PackedVertex), model->packed_vertices);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    // GL_ELEMENT_ARRAY_BUFFER is VAO state, upload through another target
+    glBindBuffer(GL_COPY_WRITE_BUFFER, mesh_arena.index_buffer);
+    glBufferSubData(GL_COPY_WRITE_BUFFER, first_index * sizeof(unsigned int),
+                    num_indices * sizeof(unsigned int), indices);
+    glBindBuffer(GL_COPY_WRITE_BUFFER, 0);
+    free(indices);
+
+    model->in_arena = true;
+    model->arena_first_vertex = first_vertex;
+    model->arena_first_index = first_index;
+    model->vao = mesh_arena.vao;
+    model->gpu_bytes = model->num_vertices * sizeof(PackedVertex) + num_indices * sizeof(unsigned int);
+    return true;
+}
+
+void mesh_arena_remove(Model* model)
+{
+    arena_free(&mesh_arena.vertices, model->arena_first_vertex, model->num_vertices);
+    arena_free(&mesh_arena.indices, model->arena_first_index, model_num_indices(model));
+    model->in_arena = false;
+    model->vao = 0;
+}
+
+// Fills the indirect command drawing num_instances instances of one LOD of
+// an arena model, their InstanceData starting at first_instance.
+void mesh_arena_command(Model* model, int lod, int first_instance, int num_instances, DrawIndirectCommand* out)
+{
+    DrawIndirectCommand command;
+    command.count = model->lod_num_indices[lod];
+    command.instance_count = num_instances;
+    command.first_index = model->arena_first_index + model->lod_first_index[lod];
+    command.base_vertex = model->arena_first_vertex;
+    command.base_instance = first_instance;
+    // out points into a write-combined mapping
+    memcpy(out, &command, sizeof(command));
+}
+
+// Submits num_commands commands from the indirect stream at command_offset,
+// base instances are relative to instance_offset in the instance stream.
+void mesh_arena_draw_indirect(GLintptr command_offset, int num_commands, GLintptr instance_offset)
+{
+    gl_state_bind_vertex_array(mesh_arena.vao);
+    instance_stream_attrib_pointers(instance_offset);
+    indirect_stream_bind();
+    glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*) command_offset, num_commands, 0);
+}
@@ -0,0 +1,494 @@
+// Mesh post-processing run at load/bake time.
+//
+// Meshes come out of the OBJ loader de-indexed (3 unique vertices per face).
+// model_weld_vertices merges identical vertices and builds an index buffer so
+// shared vertices are only transformed once and the post-transform cache
+// gets a chance to work. model_optimize then reorders the triangles for
+// that cache (Forsyth's linear-speed algorithm), optionally sorts clusters
+// of them to reduce overdraw, and reorders the vertices in the order they
+// are first fetched.
+
+void model_alloc_indices(Model* model, int num_indices)
+{
+    // 16-bit indices whenever every vertex is addressable with them
+    if (model->num_vertices <= 0xFFFF + 1) {
+        model->index_type = GL_UNSIGNED_SHORT;
+        model->index_size = sizeof(unsigned short);
+    } else {
+        model->index_type = GL_UNSIGNED_INT;
+        model->index_size = sizeof(unsigned int);
+    }
+    model->indices = malloc((size_t) num_indices * model->index_size);
+
+    model->num_lods = 1;
+    model->lod_first_index[0] = 0;
+    model->lod_num_indices[0] = num_indices;
+}
+
+// all LODs
+int model_num_indices(Model* model)
+{
+    int last = model->num_lods - 1;
+    return model->lod_first_index[last] + model->lod_num_indices[last];
+}
+
+unsigned int model_get_index(Model* model, int i)
+{
+    if (model->index_size == sizeof(unsigned short)) {
+        return ((unsigned short*) model->indices)[i];
+    }
+    return ((unsigned int*) model->indices)[i];
+}
+
+void model_set_index(Model* model, int i, unsigned int value)
+{
+    if (model->index_size == sizeof(unsigned short)) {
+        ((unsigned short*) model->indices)[i] = (unsigned short) value;
+    } else {
+        ((unsigned int*) model->indices)[i] = value;
+    }
+}
+
+// Indexes a de-indexed model without merging anything, for meshes whose
+// vertex layout is relied upon elsewhere (the editable terrain).
+void model_index_identity(Model* model)
+{
+    model->num_vertices = model->num_faces * 3;
+    model_alloc_indices(model, model->num_vertices);
+    for (int i = 0; i < model->num_vertices; i++) {
+        model_set_index(model, i, i);
+    }
+}
+
+static inline unsigned int hash_bytes(unsigned int h, const void* data, size_t size)
+{
+    // FNV-1a
+    const unsigned char* bytes = (const unsigned char*) data;
+    for (size_t i = 0; i < size; i++) {
+        h = (h ^ bytes[i]) * 16777619u;
+    }
+    return h;
+}
+
+static inline unsigned int vertex_hash(Model* model, int i)
+{
+    unsigned int h = 2166136261u;
+    h = hash_bytes(h, model->vertices[i], sizeof(vec3));
+    h = hash_bytes(h, model->normals[i], sizeof(vec3));
+    h = hash_bytes(h, model->texture_coords[i], sizeof(vec2));
+    if (model->has_tangents) {
+        h = hash_bytes(h, model->tangents[i], sizeof(vec3));
+        h = hash_bytes(h, model->bitangents[i], sizeof(vec3));
+    }
+    return h;
+}
+
+// Compares vertex a of src with vertex b of dst.
+static inline bool vertex_equal(Model* src, int a, Model* dst, int b)
+{
+    return !memcmp(src->vertices[a], dst->vertices[b], sizeof(vec3)) &&
+           !memcmp(src->normals[a], dst->normals[b], sizeof(vec3)) &&
+           !memcmp(src->texture_coords[a], dst->texture_coords[b], sizeof(vec2)) &&
+           (!src->has_tangents ||
+            (!memcmp(src->tangents[a], dst->tangents[b], sizeof(vec3)) &&
+             !memcmp(src->bitangents[a], dst->bitangents[b], sizeof(vec3))));
+}
+
+// Turns a de-indexed model (num_faces * 3 malloc'ed vertices) into an
+// indexed one, merging vertices whose position, normal, texture coordinate
+// and tangent frame are bitwise identical.
+void model_weld_vertices(Model* model)
+{
+    int n = model->num_faces * 3;
+
+    int table_size = 1;
+    while (table_size < n * 2) table_size *= 2;
+    int* table = (int*) malloc(table_size * sizeof(int));
+    memset(table, -1, table_size * sizeof(int));
+
+    unsigned int* remap = (unsigned int*) malloc(n * sizeof(unsigned int));
+
+    // welded vertices are written to the front of new arrays
+    Model welded = *model;
+    welded.vertices = (vec3*) malloc(n * sizeof(vec3));
+    welded.normals = (vec3*) malloc(n * sizeof(vec3));
+    welded.texture_coords = (vec2*) malloc(n * sizeof(vec2));
+    if (model->has_tangents) {
+        welded.tangents = (vec3*) malloc(n * sizeof(vec3));
+        welded.bitangents = (vec3*) malloc(n * sizeof(vec3));
+    }
+
+    int num_unique = 0;
+    for (int i = 0; i < n; i++) {
+        unsigned int slot = vertex_hash(model, i) & (table_size - 1);
+        while (table[slot] != -1 && !vertex_equal(model, i, &welded, table[slot])) {
+            slot = (slot + 1) & (table_size - 1);
+        }
+
+        if (table[slot] == -1) {
+            table[slot] = num_unique;
+            glm_vec3_copy(model->vertices[i], welded.vertices[num_unique]);
+            glm_vec3_copy(model->normals[i], welded.normals[num_unique]);
+            welded.texture_coords[num_unique][0] = model->texture_coords[i][0];
+            welded.texture_coords[num_unique][1] = model->texture_coords[i][1];
+            if (model->has_tangents) {
+                glm_vec3_copy(model->tangents[i], welded.tangents[num_unique]);
+                glm_vec3_copy(model->bitangents[i], welded.bitangents[num_unique]);
+            }
+            num_unique++;
+        }
+        remap[i] = table[slot];
+    }
+
+    free(model->vertices);
+    free(model->normals);
+    free(model->texture_coords);
+    free(model->tangents);
+    free(model->bitangents);
+
+    model->num_vertices = num_unique;
+    model->vertices = (vec3*) realloc(welded.vertices, num_unique * sizeof(vec3));
+    model->normals = (vec3*) realloc(welded.normals, num_unique * sizeof(vec3));
+    model->texture_coords = (vec2*) realloc(welded.texture_coords, num_unique * sizeof(vec2));
+    if (model->has_tangents) {
+        model->tangents = (vec3*) realloc(welded.tangents, num_unique * sizeof(vec3));
+        model->bitangents = (vec3*) realloc(welded.bitangents, num_unique * sizeof(vec3));
+    }
+
+    model_alloc_indices(model, n);
+    for (int i = 0; i < n; i++) {
+        model_set_index(model, i, remap[i]);
+    }
+
+    printf("Welded %d -> %d vertices (%d-bit indices)\n",
+           n, num_unique, model->index_size * 8);
+
+    free(remap);
+    free(table);
+}
+
+// Average cache miss ratio (misses per triangle) and average transform to
+// vertex ratio (misses per vertex) of the current index order, simulating a
+// FIFO post-transform cache of cache_size entries.
+void model_vertex_cache_stats(Model* model, int cache_size, float* acmr, float* atvr)
+{
+    int num_indices = model->num_faces * 3;
+    int* cache_time = (int*) malloc(model->num_vertices * sizeof(int));
+    for (int i = 0; i < model->num_vertices; i++) cache_time[i] = -cache_size - 1;
+
+    // a vertex is in the FIFO if it was one of the last cache_size misses
+    int misses = 0;
+    for (int i = 0; i < num_indices; i++) {
+        unsigned int v = model_get_index(model, i);
+        if (misses - cache_time[v] > cache_size) {
+            cache_time[v] = misses;
+            misses++;
+        }
+    }
+
+    *acmr = model->num_faces ? (float) misses / model->num_faces : 0.0f;
+    *atvr = model->num_vertices ? (float) misses / model->num_vertices : 0.0f;
+
+    free(cache_time);
+}
+
+#define FORSYTH_CACHE_SIZE 32
+#define FORSYTH_MAX_VALENCE 64
+
+// Tom Forsyth, "Linear-Speed Vertex Cache Optimisation". Greedily emits the
+// triangle with the best score, where vertices score higher the more
+// recently they were used and the fewer triangles they have left.
+void model_optimize_vertex_cache(Model* model)
+{
+    int num_faces = model->num_faces;
+    int num_vertices = model->num_vertices;
+    if (num_faces == 0) return;
+
+    static float cache_scores[FORSYTH_CACHE_SIZE];
+    static float valence_scores[FORSYTH_MAX_VALENCE];
+    static bool tables_initialized = false;
+    if (!tables_initialized) {
+        for (int i = 0; i < FORSYTH_CACHE_SIZE; i++) {
+            // the last triangle's vertices get a fixed score so we don't
+            // just keep walking a strip
+            cache_scores[i] = i < 3 ? 0.75f
+                : powf(1.0f - (i - 3) * (1.0f / (FORSYTH_CACHE_SIZE - 3)), 1.5f);
+        }
+        valence_scores[0] = 0.0f;
+        for (int i = 1; i < FORSYTH_MAX_VALENCE; i++) {
+            valence_scores[i] = 2.0f * powf((float) i, -0.5f);
+        }
+        tables_initialized = true;
+    }
+
+#define VERTEX_SCORE(v) (live[v] == 0 ? -1.0f : \
+    (cache_pos[v] >= 0 ? cache_scores[cache_pos[v]] : 0.0f) + \
+    valence_scores[live[v] < FORSYTH_MAX_VALENCE ? live[v] : FORSYTH_MAX_VALENCE - 1])
+
+    unsigned int* tris = (unsigned int*) malloc(num_faces * 3 * sizeof(unsigned int));
+    for (int i = 0; i < num_faces * 3; i++) tris[i] = model_get_index(model, i);
+
+    // triangles using each vertex, the live ones are kept at the front of
+    // each list: adjacency[offsets[v] .. offsets[v] + live[v]]
+    int* live = (int*) calloc(num_vertices, sizeof(int));
+    int* offsets = (int*) malloc((num_vertices + 1) * sizeof(int));
+    int* adjacency = (int*) malloc(num_faces * 3 * sizeof(int));
+    for (int i = 0; i < num_faces * 3; i++) live[tris[i]]++;
+    offsets[0] = 0;
+    for (int v = 0; v < num_vertices; v++) offsets[v + 1] = offsets[v] + live[v];
+    memset(live, 0, num_vertices * sizeof(int));
+    for (int i = 0; i < num_faces * 3; i++) {
+        unsigned int v = tris[i];
+        adjacency[offsets[v] + live[v]++] = i / 3;
+    }
+
+    int* cache_pos = (int*) malloc(num_vertices * sizeof(int));
+    float* vertex_scores = (float*) malloc(num_vertices * sizeof(float));
+    for (int v = 0; v < num_vertices; v++) {
+        cache_pos[v] = -1;
+        vertex_scores[v] = VERTEX_SCORE(v);
+    }
+
+    float* tri_scores = (float*) malloc(num_faces * sizeof(float));
+    bool* emitted = (bool*) calloc(num_faces, sizeof(bool));
+    int best = 0;
+    for (int t = 0; t < num_faces; t++) {
+        tri_scores[t] = vertex_scores[tris[3 * t]] + vertex_scores[tris[3 * t + 1]] +
+                        vertex_scores[tris[3 * t + 2]];
+        if (tri_scores[t] > tri_scores[best]) best = t;
+    }
+
+    int cache[FORSYTH_CACHE_SIZE + 3];
+    int cache_count = 0;
+    int next_unemitted = 0;
+
+    for (int out = 0; out < num_faces; out++) {
+        if (best < 0) {
+            // nothing in the cache has triangles left, continue elsewhere
+            while (emitted[next_unemitted]) next_unemitted++;
+            best = next_unemitted;
+        }
+
+        unsigned int* tri = &tris[3 * best];
+        model_set_index(model, 3 * out + 0, tri[0]);
+        model_set_index(model, 3 * out + 1, tri[1]);
+        model_set_index(model, 3 * out + 2, tri[2]);
+        emitted[best] = true;
+
+        for (int i = 0; i < 3; i++) {
+            unsigned int v = tri[i];
+            int* list = &adjacency[offsets[v]];
+            for (int j = 0; j < live[v]; j++) {
+                if (list[j] == best) {
+                    list[j] = list[live[v] - 1];
+                    break;
+                }
+            }
+            live[v]--;
+        }
+
+        // the new triangle goes to the front of the LRU cache
+        int new_cache[FORSYTH_CACHE_SIZE + 3];
+        int new_count = 0;
+        for (int i = 0; i < 3; i++) new_cache[new_count++] = tri[i];
+        for (int i = 0; i < cache_count; i++) {
+            int v = cache[i];
+            if (v != (int) tri[0] && v != (int) tri[1] && v != (int) tri[2]) {
+                new_cache[new_count++] = v;
+            }
+        }
+
+        for (int i = 0; i < new_count; i++) {
+            int v = new_cache[i];
+            cache_pos[v] = i < FORSYTH_CACHE_SIZE ? i : -1;
+            vertex_scores[v] = VERTEX_SCORE(v);
+        }
+
+        // only triangles touching the cache changed score
+        best = -1;
+        float best_score = -1.0f;
+        for (int i = 0; i < new_count; i++) {
+            int v = new_cache[i];
+            for (int j = 0; j < live[v]; j++) {
+                int t = adjacency[offsets[v] + j];
+                tri_scores[t] = vertex_scores[tris[3 * t]] + vertex_scores[tris[3 * t + 1]] +
+                                vertex_scores[tris[3 * t + 2]];
+                if (tri_scores[t] > best_score) {
+                    best_score = tri_scores[t];
+                    best = t;
+                }
+            }
+        }
+
+        cache_count = new_count < FORSYTH_CACHE_SIZE ? new_count : FORSYTH_CACHE_SIZE;
+        memcpy(cache, new_cache, cache_count * sizeof(int));
+    }
+
+#undef VERTEX_SCORE
+
+    free(emitted);
+    free(tri_scores);
+    free(vertex_scores);
+    free(cache_pos);
+    free(adjacency);
+    free(offsets);
+    free(live);
+    free(tris);
+}
+
+struct TriangleCluster {
+    int first_face;
+    int num_faces;
+    float sort_key;
+};
+
+static int compare_clusters(const void* a, const void* b)
+{
+    float ka = ((const TriangleCluster*) a)->sort_key;
+    float kb = ((const TriangleCluster*) b)->sort_key;
+    if (ka != kb) return ka > kb ? -1 : 1;
+    // keep the sort stable
+    return ((const TriangleCluster*) a)->first_face - ((const TriangleCluster*) b)->first_face;
+}
+
+// Splits the (cache optimized) triangle order into clusters wherever the
+// cache starts cold and draws the clusters facing away from the mesh center
+// first, since they are the likeliest to occlude the rest
+// (Sander et al., "Fast Triangle Reordering for Vertex Locality and
+// Reduced Overdraw"). Cluster contents are kept intact, so the cache
+// efficiency barely changes.
+void model_optimize_overdraw(Model* model, int cache_size)
+{
+    int num_faces = model->num_faces;
+    if (num_faces == 0) return;
+
+    TriangleCluster* clusters = (TriangleCluster*) malloc(num_faces * sizeof(TriangleCluster));
+    int num_clusters = 0;
+
+    int* cache_time = (int*) malloc(model->num_vertices * sizeof(int));
+    for (int i = 0; i < model->num_vertices; i++) cache_time[i] = -cache_size - 1;
+    int misses = 0;
+    for (int t = 0; t < num_faces; t++) {
+        int tri_misses = 0;
+        for (int i = 0; i < 3; i++) {
+            unsigned int v = model_get_index(model, 3 * t + i);
+            if (misses - cache_time[v] > cache_size) {
+                cache_time[v] = misses;
+                misses++;
+                tri_misses++;
+            }
+        }
+
+        if (tri_misses == 3 || num_clusters == 0) {
+            clusters[num_clusters].first_face = t;
+            clusters[num_clusters].num_faces = 0;
+            num_clusters++;
+        }
+        clusters[num_clusters - 1].num_faces++;
+    }
+    free(cache_time);
+
+    vec3 mesh_center;
+    glm_vec3_add(model->bounds_min, model->bounds_max, mesh_center);
+    glm_vec3_scale(mesh_center, 0.5f, mesh_center);
+
+    for (int c = 0; c < num_clusters; c++) {
+        vec3 centroid = GLM_VEC3_ZERO_INIT;
+        vec3 normal = GLM_VEC3_ZERO_INIT;
+        float total_area = 0.0f;
+
+        for (int t = clusters[c].first_face; t < clusters[c].first_face + clusters[c].num_faces; t++) {
+            float* a = model->vertices[model_get_index(model, 3 * t + 0)];
+            float* b = model->vertices[model_get_index(model, 3 * t + 1)];
+            float* d = model->vertices[model_get_index(model, 3 * t + 2)];
+
+            vec3 ab, ad, n;
+            glm_vec3_sub(b, a, ab);
+            glm_vec3_sub(d, a, ad);
+            glm_vec3_cross(ab, ad, n);
+            float area = glm_vec3_norm(n);
+
+            // area weighted
+            for (int i = 0; i < 3; i++) {
+                centroid[i] += (a[i] + b[i] + d[i]) * (area / 3.0f);
+            }
+            glm_vec3_add(normal, n, normal);
+            total_area += area;
+        }
+
+        if (total_area > 0.0f) glm_vec3_scale(centroid, 1.0f / total_area, centroid);
+        glm_vec3_normalize(normal);
+
+        vec3 offset;
+        glm_vec3_sub(centroid, mesh_center, offset);
+        clusters[c].sort_key = glm_vec3_dot(offset, normal);
+    }
+
+    qsort(clusters, num_clusters, sizeof(TriangleCluster), compare_clusters);
+
+    void* sorted = malloc((size_t) num_faces * 3 * model->index_size);
+    size_t offset = 0;
+    for (int c = 0; c < num_clusters; c++) {
+        size_t size = (size_t) clusters[c].num_faces * 3 * model->index_size;
+        memcpy((char*) sorted + offset, (char*) model->indices + (size_t) clusters[c].first_face * 3 * model->index_size, size);
+        offset += size;
+    }
+    free(model->indices);
+    model->indices = sorted;
+
+    free(clusters);
+}
+
+// Reorders the vertex arrays in the order the indices first reference them
+// so vertex fetches walk memory linearly. Unreferenced vertices are dropped.
+void model_optimize_vertex_fetch(Model* model)
+{
+    int num_vertices = model->num_vertices;
+    int* remap = (int*) malloc(num_vertices * sizeof(int));
+    for (int i = 0; i < num_vertices; i++) remap[i] = -1;
+
+    int next = 0;
+    for (int i = 0; i < model->num_faces * 3; i++) {
+        unsigned int v = model_get_index(model, i);
+        if (remap[v] < 0) remap[v] = next++;
+        model_set_index(model, i, remap[v]);
+    }
+
+#define REORDER(arr, type) do { \
+        type* reordered = (type*) malloc(next * sizeof(type)); \
+        for (int v = 0; v < num_vertices; v++) { \
+            if (remap[v] >= 0) memcpy(reordered[remap[v]], (arr)[v], sizeof(type)); \
+        } \
+        free(arr); \
+        (arr) = reordered; \
+    } while (0)
+
+    REORDER(model->vertices, vec3);
+    REORDER(model->normals, vec3);
+    REORDER(model->texture_coords, vec2);
+    if (model->has_tangents) {
+        REORDER(model->tangents, vec3);
+        REORDER(model->bitangents, vec3);
+    }
+
+#undef REORDER
+
+    model->num_vertices = next;
+    free(remap);
+}
+
+void model_optimize(Model* model, const char* name)
+{
+    float acmr_before, atvr_before, acmr_after, atvr_after;
+    model_vertex_cache_stats(model, MESH_VCACHE_SIM_SIZE, &acmr_before, &atvr_before);
+
+    model_optimize_vertex_cache(model);
+#ifdef MESH_OPTIMIZE_OVERDRAW
+    model_optimize_overdraw(model, MESH_VCACHE_SIM_SIZE);
+#endif
+    model_optimize_vertex_fetch(model);
+
+    model_vertex_cache_stats(model, MESH_VCACHE_SIM_SIZE, &acmr_after, &atvr_after);
+    printf("Optimized '%s': ACMR %.3f -> %.3f, ATVR %.3f -> %.3f (FIFO cache of %d)\n",
+           name, acmr_before, acmr_after, atvr_before, atvr_after, MESH_VCACHE_SIM_SIZE);
+}
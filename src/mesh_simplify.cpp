@@ -0,0 +1,363 @@
+// Quadric error mesh simplification (Garland and Heckbert, "Surface
+// Simplification Using Quadric Error Metrics"), used to build the LOD chain
+// of a model at load/bake time.
+//
+// Edges are only ever collapsed onto one of their endpoints, so every LOD is
+// just another index range into the vertices of the full mesh. Vertices with
+// the same position (normal/UV seams) are collapsed together, vertices on
+// open borders are never moved.
+
+#include <float.h>
+
+struct Quadric {
+    // symmetric 4x4 matrix: xx xy xz xw yy yz yw zz zw ww
+    double m[10];
+    double weight;
+};
+
+static void quadric_add_plane(Quadric* q, double a, double b, double c, double d, double w)
+{
+    q->m[0] += w * a * a; q->m[1] += w * a * b; q->m[2] += w * a * c; q->m[3] += w * a * d;
+    q->m[4] += w * b * b; q->m[5] += w * b * c; q->m[6] += w * b * d;
+    q->m[7] += w * c * c; q->m[8] += w * c * d;
+    q->m[9] += w * d * d;
+    q->weight += w;
+}
+
+static void quadric_add(Quadric* q, const Quadric* other)
+{
+    for (int i = 0; i < 10; i++) q->m[i] += other->m[i];
+    q->weight += other->weight;
+}
+
+// mean squared distance of p to the planes in q
+static double quadric_error(const Quadric* q, const float* p)
+{
+    double x = p[0], y = p[1], z = p[2];
+    const double* m = q->m;
+    double e = m[0] * x * x + 2 * m[1] * x * y + 2 * m[2] * x * z + 2 * m[3] * x +
+               m[4] * y * y + 2 * m[5] * y * z + 2 * m[6] * y +
+               m[7] * z * z + 2 * m[8] * z +
+               m[9];
+    return q->weight > 0 ? fabs(e) / q->weight : 0.0;
+}
+
+struct EdgeCollapse {
+    unsigned int from, to; // position ids
+    float error;
+};
+
+static int compare_collapses(const void* a, const void* b)
+{
+    float ea = ((const EdgeCollapse*) a)->error, eb = ((const EdgeCollapse*) b)->error;
+    return (ea > eb) - (ea < eb);
+}
+
+static bool collapse_flips_triangle(const vec3* positions, const unsigned int* indices,
+                                    const unsigned int* position_id, const unsigned int* id_remap,
+                                    const int* adjacency, int adjacency_count,
+                                    unsigned int from, unsigned int to, const unsigned int* id_vertex)
+{
+    for (int i = 0; i < adjacency_count; i++) {
+        const unsigned int* tri = &indices[3 * adjacency[i]];
+        unsigned int ids[3];
+        for (int k = 0; k < 3; k++) ids[k] = id_remap[position_id[tri[k]]];
+        if (ids[0] == to || ids[1] == to || ids[2] == to) continue; // collapses away
+
+        vec3 before[3], after[3];
+        for (int k = 0; k < 3; k++) {
+            glm_vec3_copy((float*) positions[id_vertex[ids[k]]], before[k]);
+            glm_vec3_copy((float*) positions[id_vertex[ids[k] == from ? to : ids[k]]], after[k]);
+        }
+
+        vec3 e1, e2, n_before, n_after;
+        glm_vec3_sub(before[1], before[0], e1);
+        glm_vec3_sub(before[2], before[0], e2);
+        glm_vec3_cross(e1, e2, n_before);
+        glm_vec3_sub(after[1], after[0], e1);
+        glm_vec3_sub(after[2], after[0], e2);
+        glm_vec3_cross(e1, e2, n_after);
+        if (glm_vec3_dot(n_before, n_after) <= 0.0f) return true;
+    }
+    return false;
+}
+
+// Simplifies the triangle list in indices (vertex ids, modified in place)
+// towards target_num_indices without moving any vertex by more than
+// max_error (relative to the mesh's bounding box diagonal). Returns the new
+// number of indices.
+int simplify_indices(unsigned int* indices, int num_indices, const vec3* positions,
+                     const vec3* normals, int num_vertices, int target_num_indices, float max_error)
+{
+    // position ids: vertices sharing a position are collapsed together
+    unsigned int* position_id = (unsigned int*) malloc(num_vertices * sizeof(unsigned int));
+    unsigned int* id_vertex = (unsigned int*) malloc(num_vertices * sizeof(unsigned int));
+    int* next_wedge = (int*) malloc(num_vertices * sizeof(int)); // cyclic per position
+    int num_ids = 0;
+    {
+        int table_size = 1;
+        while (table_size < 2 * num_vertices) table_size <<= 1;
+        int* table = (int*) malloc(table_size * sizeof(int));
+        for (int i = 0; i < table_size; i++) table[i] = -1;
+
+        for (int v = 0; v < num_vertices; v++) {
+            unsigned int slot = hash_bytes(2166136261u, positions[v], sizeof(vec3)) & (table_size - 1);
+            while (table[slot] >= 0 && memcmp(positions[table[slot]], positions[v], sizeof(vec3)) != 0) {
+                slot = (slot + 1) & (table_size - 1);
+            }
+            if (table[slot] < 0) {
+                table[slot] = v;
+                id_vertex[num_ids] = v;
+                position_id[v] = num_ids++;
+                next_wedge[v] = v;
+            } else {
+                int first = table[slot];
+                position_id[v] = position_id[first];
+                next_wedge[v] = next_wedge[first];
+                next_wedge[first] = v;
+            }
+        }
+        free(table);
+    }
+
+    Quadric* quadrics = (Quadric*) calloc(num_ids, sizeof(Quadric));
+    bool* locked = (bool*) calloc(num_ids, sizeof(bool));
+    bool* seam = (bool*) calloc(num_ids, sizeof(bool));
+    unsigned int* id_remap = (unsigned int*) malloc(num_ids * sizeof(unsigned int));
+    unsigned int* vertex_remap = (unsigned int*) malloc(num_vertices * sizeof(unsigned int));
+    bool* touched = (bool*) malloc(num_ids * sizeof(bool));
+    int* offsets = (int*) malloc((num_ids + 1) * sizeof(int));
+    int* counts = (int*) malloc(num_ids * sizeof(int));
+    int* adjacency = (int*) malloc(num_indices * sizeof(int));
+    EdgeCollapse* collapses = (EdgeCollapse*) malloc(num_indices * sizeof(EdgeCollapse));
+
+    for (int v = 0; v < num_vertices; v++) {
+        if (next_wedge[v] != v) seam[position_id[v]] = true;
+    }
+
+    vec3 bounds_min, bounds_max;
+    glm_vec3_copy((float*) positions[0], bounds_min);
+    glm_vec3_copy((float*) positions[0], bounds_max);
+    for (int v = 1; v < num_vertices; v++) {
+        glm_vec3_minv(bounds_min, (float*) positions[v], bounds_min);
+        glm_vec3_maxv(bounds_max, (float*) positions[v], bounds_max);
+    }
+    double max_error_sq = max_error * glm_vec3_distance(bounds_min, bounds_max);
+    max_error_sq *= max_error_sq;
+
+    for (int t = 0; t < num_indices / 3; t++) {
+        const float* p0 = positions[indices[3 * t]];
+        const float* p1 = positions[indices[3 * t + 1]];
+        const float* p2 = positions[indices[3 * t + 2]];
+        vec3 e1, e2, n;
+        glm_vec3_sub((float*) p1, (float*) p0, e1);
+        glm_vec3_sub((float*) p2, (float*) p0, e2);
+        glm_vec3_cross(e1, e2, n);
+        float area = glm_vec3_norm(n) * 0.5f;
+        if (area <= 0.0f) continue;
+        glm_vec3_scale(n, 0.5f / area, n);
+        double d = -glm_vec3_dot(n, (float*) p0);
+        for (int k = 0; k < 3; k++) {
+            quadric_add_plane(&quadrics[position_id[indices[3 * t + k]]], n[0], n[1], n[2], d, area);
+        }
+    }
+
+    for (;;) {
+        int num_faces = num_indices / 3;
+        if (num_indices <= target_num_indices) break;
+
+        // triangles around each position
+        memset(counts, 0, num_ids * sizeof(int));
+        for (int i = 0; i < num_indices; i++) counts[position_id[indices[i]]]++;
+        offsets[0] = 0;
+        for (int id = 0; id < num_ids; id++) offsets[id + 1] = offsets[id] + counts[id];
+        memset(counts, 0, num_ids * sizeof(int));
+        for (int i = 0; i < num_indices; i++) {
+            unsigned int id = position_id[indices[i]];
+            adjacency[offsets[id] + counts[id]++] = i / 3;
+        }
+
+        // an edge without its reverse is on an open border, lock both ends
+        for (int t = 0; t < num_faces; t++) {
+            for (int k = 0; k < 3; k++) {
+                unsigned int a = position_id[indices[3 * t + k]];
+                unsigned int b = position_id[indices[3 * t + (k + 1) % 3]];
+                bool has_reverse = false;
+                for (int j = offsets[b]; j < offsets[b + 1] && !has_reverse; j++) {
+                    const unsigned int* tri = &indices[3 * adjacency[j]];
+                    for (int m = 0; m < 3; m++) {
+                        if (position_id[tri[m]] == b && position_id[tri[(m + 1) % 3]] == a) has_reverse = true;
+                    }
+                }
+                if (!has_reverse) locked[a] = locked[b] = true;
+            }
+        }
+
+        // each interior edge shows up once as a -> b with a < b
+        int num_collapses = 0;
+        for (int t = 0; t < num_faces; t++) {
+            for (int k = 0; k < 3; k++) {
+                unsigned int a = position_id[indices[3 * t + k]];
+                unsigned int b = position_id[indices[3 * t + (k + 1) % 3]];
+                if (a >= b) continue;
+
+                Quadric q = quadrics[a];
+                quadric_add(&q, &quadrics[b]);
+                // seam vertices only collapse onto other seam vertices
+                bool a_to_b = !locked[a] && (!seam[a] || seam[b]);
+                bool b_to_a = !locked[b] && (!seam[b] || seam[a]);
+                float error_a_to_b = a_to_b ? (float) quadric_error(&q, positions[id_vertex[b]]) : FLT_MAX;
+                float error_b_to_a = b_to_a ? (float) quadric_error(&q, positions[id_vertex[a]]) : FLT_MAX;
+                if (!a_to_b && !b_to_a) continue;
+
+                EdgeCollapse* c = &collapses[num_collapses++];
+                c->from = error_a_to_b <= error_b_to_a ? a : b;
+                c->to = error_a_to_b <= error_b_to_a ? b : a;
+                c->error = error_a_to_b <= error_b_to_a ? error_a_to_b : error_b_to_a;
+            }
+        }
+        qsort(collapses, num_collapses, sizeof(EdgeCollapse), compare_collapses);
+
+        for (int id = 0; id < num_ids; id++) id_remap[id] = id;
+        for (int v = 0; v < num_vertices; v++) vertex_remap[v] = v;
+        memset(touched, 0, num_ids * sizeof(bool));
+
+        // collapse the cheapest edges whose neighborhoods don't overlap, an
+        // interior collapse removes two triangles
+        int removed = 0;
+        int to_remove = (num_indices - target_num_indices) / 3;
+        for (int i = 0; i < num_collapses && removed < to_remove; i++) {
+            EdgeCollapse* c = &collapses[i];
+            if (c->error > max_error_sq) break;
+            if (touched[c->from] || touched[c->to]) continue;
+            if (collapse_flips_triangle(positions, indices, position_id, id_remap,
+                                        &adjacency[offsets[c->from]], offsets[c->from + 1] - offsets[c->from],
+                                        c->from, c->to, id_vertex)) {
+                continue;
+            }
+
+            // every wedge of from moves to the wedge of to it shares a
+            // triangle with, or else the one with the closest normal
+            int w = id_vertex[c->from];
+            do {
+                int target = -1;
+                for (int j = offsets[c->from]; j < offsets[c->from + 1] && target < 0; j++) {
+                    const unsigned int* tri = &indices[3 * adjacency[j]];
+                    if (tri[0] != (unsigned int) w && tri[1] != (unsigned int) w && tri[2] != (unsigned int) w) continue;
+                    for (int m = 0; m < 3; m++) {
+                        if (position_id[tri[m]] == c->to) target = tri[m];
+                    }
+                }
+                if (target < 0) {
+                    float best = -FLT_MAX;
+                    int u = id_vertex[c->to];
+                    do {
+                        float d = glm_vec3_dot((float*) normals[w], (float*) normals[u]);
+                        if (d > best) {
+                            best = d;
+                            target = u;
+                        }
+                        u = next_wedge[u];
+                    } while (u != (int) id_vertex[c->to]);
+                }
+                vertex_remap[w] = target;
+                w = next_wedge[w];
+            } while (w != (int) id_vertex[c->from]);
+
+            quadric_add(&quadrics[c->to], &quadrics[c->from]);
+            id_remap[c->from] = c->to;
+            touched[c->from] = touched[c->to] = true;
+            removed += 2;
+
+            // from's adjacent positions were updated with stale neighbors
+            // in mind, keep them out of this pass too
+            for (int j = offsets[c->from]; j < offsets[c->from + 1]; j++) {
+                const unsigned int* tri = &indices[3 * adjacency[j]];
+                for (int m = 0; m < 3; m++) touched[position_id[tri[m]]] = true;
+            }
+        }
+
+        if (removed == 0) break;
+
+        // apply the collapses, dropping triangles that became degenerate
+        int out = 0;
+        for (int t = 0; t < num_faces; t++) {
+            unsigned int a = vertex_remap[indices[3 * t]];
+            unsigned int b = vertex_remap[indices[3 * t + 1]];
+            unsigned int c = vertex_remap[indices[3 * t + 2]];
+            unsigned int ia = position_id[a], ib = position_id[b], ic = position_id[c];
+            if (ia == ib || ib == ic || ia == ic) continue;
+            indices[out++] = a;
+            indices[out++] = b;
+            indices[out++] = c;
+        }
+        num_indices = out;
+    }
+
+    free(collapses);
+    free(adjacency);
+    free(counts);
+    free(offsets);
+    free(touched);
+    free(vertex_remap);
+    free(id_remap);
+    free(seam);
+    free(locked);
+    free(quadrics);
+    free(next_wedge);
+    free(id_vertex);
+    free(position_id);
+
+    return num_indices;
+}
+
+// Appends up to MODEL_MAX_LODS - 1 coarser versions of the mesh to
+// model->indices, each simplified from the previous one to half its
+// triangles. A LOD that can't get below MESH_LOD_MIN_REDUCTION of the
+// previous one without exceeding MESH_LOD_MAX_ERROR ends the chain.
+void model_build_lods(Model* model, const char* name)
+{
+    int num_indices = model->num_faces * 3;
+    unsigned int* all = (unsigned int*) malloc(num_indices * MODEL_MAX_LODS * sizeof(unsigned int));
+    for (int i = 0; i < num_indices; i++) all[i] = model_get_index(model, i);
+
+    model->num_lods = 1;
+    model->lod_first_index[0] = 0;
+    model->lod_num_indices[0] = num_indices;
+
+    int total = num_indices;
+    while (model->num_lods < MODEL_MAX_LODS) {
+        int prev = model->num_lods - 1;
+        int prev_count = model->lod_num_indices[prev];
+        unsigned int* lod = &all[total];
+        memcpy(lod, &all[model->lod_first_index[prev]], prev_count * sizeof(unsigned int));
+
+        int target = (prev_count / 3 / 2) * 3;
+        int count = simplify_indices(lod, prev_count, model->vertices, model->normals,
+                                     model->num_vertices, target, MESH_LOD_MAX_ERROR);
+        if (count == 0 || count > prev_count * MESH_LOD_MIN_REDUCTION) break;
+
+        // reorder the new LOD's triangles for the vertex cache too
+        Model lod_model = *model;
+        lod_model.indices = malloc(count * model->index_size);
+        lod_model.num_faces = count / 3;
+        for (int i = 0; i < count; i++) model_set_index(&lod_model, i, lod[i]);
+        model_optimize_vertex_cache(&lod_model);
+        for (int i = 0; i < count; i++) lod[i] = model_get_index(&lod_model, i);
+        free(lod_model.indices);
+
+        model->lod_first_index[model->num_lods] = total;
+        model->lod_num_indices[model->num_lods] = count;
+        model->num_lods++;
+        total += count;
+    }
+
+    free(model->indices);
+    model->indices = malloc(total * model->index_size);
+    for (int i = 0; i < total; i++) model_set_index(model, i, all[i]);
+    free(all);
+
+    printf("Built %d LODs for '%s':", model->num_lods, name);
+    for (int i = 0; i < model->num_lods; i++) printf(" %d", model->lod_num_indices[i] / 3);
+    printf(" triangles\n");
+}
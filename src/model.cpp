@@ -1,251 +1,437 @@
-void destroyModel(int model)
+#define MODEL_HANDLE_INDEX_BITS 20
+#define MODEL_HANDLE_INDEX_MASK ((1u << MODEL_HANDLE_INDEX_BITS) - 1)
+
+Model* model_get(ModelHandle handle)
 {
-    free(loaded_models[model].vertices);
-    free(loaded_models[model].normals);
-    free(loaded_models[model].texture_coords);
+    unsigned int index = handle & MODEL_HANDLE_INDEX_MASK;
+    unsigned int generation = handle >> MODEL_HANDLE_INDEX_BITS;
+    if (index >= (unsigned int) loaded_models_n) return NULL;
 
-    if (loaded_models[model].face_type == VERTEX_ALL || loaded_models[model].face_type == VERTEX_ALL_ALPHA) {
-        glDeleteTextures(1, &loaded_models[model].texture_id);
-    }
+    Model* model = &loaded_models[index];
+    if (!model->in_use || model->generation != generation) return NULL;
+    return model;
 }
 
-int loadTexture(const char* filename)
+static ModelHandle model_handle(int index)
 {
-    assert(filename);
-    int w, h, n;
-    stbi_set_flip_vertically_on_load(true);
-    unsigned char* pixels = stbi_load(filename, &w, &h, &n, 3);
-    assert(pixels && w > 0 && h > 0 && n == 3);
-
-    GLuint tex;
-    glGenTextures(1, &tex);
-
-    glBindTexture(GL_TEXTURE_2D, tex);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
-		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
-        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, w, h, 0, GL_RGB, GL_UNSIGNED_BYTE, pixels);
-        glGenerateMipmap(GL_TEXTURE_2D);
-    glBindTexture(GL_TEXTURE_2D, 0);
-
-    stbi_image_free(pixels);
-
-    return tex;
-}
-
-void model_add_normal_map(Model* model, const char *normal_map_filename) {
-    model->has_normal_map = true;
-    model->normal_map_id = loadTexture(normal_map_filename);
+    return (loaded_models[index].generation << MODEL_HANDLE_INDEX_BITS) | index;
 }
 
-void generate_vertex_tangents_and_bitangents(Model* model, int vertex_idx) {
-    int k = vertex_idx;
+// Reuses the slot of an unloaded model or grows loaded_models, invalidating
+// Model pointers into it.
+static ModelHandle model_alloc(const char* source_key)
+{
+    int index = 0;
+    while (index < loaded_models_n && loaded_models[index].in_use) index++;
+
+    if (index == loaded_models_n) {
+        if (loaded_models_n == loaded_models_cap) {
+            int cap = loaded_models_cap ? loaded_models_cap * 2 : 16;
+            assert(cap <= (int) MODEL_HANDLE_INDEX_MASK + 1);
+            loaded_models = (Model*) realloc(loaded_models, cap * sizeof(Model));
+            assert(loaded_models);
+            memset(loaded_models + loaded_models_cap, 0, (cap - loaded_models_cap) * sizeof(Model));
+            loaded_models_cap = cap;
+        }
+        loaded_models_n++;
+    }
 
-	// face vertices
-	vec3 A = { model->vertices[k][0], model->vertices[k][1], model->vertices[k][2] };
-	vec3 B = { model->vertices[k + 1][0], model->vertices[k + 1][1], model->vertices[k + 1][2] };
-	vec3 C = { model->vertices[k + 2][0], model->vertices[k + 2][1], model->vertices[k + 2][2] };
+    Model* model = &loaded_models[index];
+    unsigned int generation = model->generation + 1;
+    if (generation >> (32 - MODEL_HANDLE_INDEX_BITS)) generation = 1;
 
-	// face UB
-	vec2 UV_A = { model->texture_coords[k][0], model->texture_coords[k][1] };
-	vec2 UV_B = { model->texture_coords[k + 1][0], model->texture_coords[k + 1][1] };
-	vec2 UV_C = { model->texture_coords[k + 2][0], model->texture_coords[k + 2][1] };
+    memset(model, 0, sizeof(*model));
+    model->generation = generation;
+    model->in_use = true;
+    model->source_key = source_key ? strdup(source_key) : NULL;
 
-	vec3 AB, AC;
-	glm_vec3_sub(B, A, AB);
-	glm_vec3_sub(C, A, AC);
+    return model_handle(index);
+}
 
-	vec2 deltaUV_AB, deltaUV_AC;
-	glm_vec2_sub(UV_B, UV_A, deltaUV_AB);
-	glm_vec2_sub(UV_C, UV_A, deltaUV_AC);
+static ModelHandle model_find(const char* source_key)
+{
+    for (int i = 0; i < loaded_models_n; i++) {
+        if (loaded_models[i].in_use && loaded_models[i].source_key &&
+            strcmp(loaded_models[i].source_key, source_key) == 0) {
+            return model_handle(i);
+        }
+    }
+    return 0;
+}
 
-	float fract = 1.0f / (deltaUV_AB[0] * deltaUV_AC[1] - deltaUV_AC[0] * deltaUV_AB[1]);
+void model_acquire(ModelHandle handle)
+{
+    Model* model = model_get(handle);
+    assert(model);
+    model->ref_count++;
+    model->unused_frames = 0;
+}
 
-	model->tangents[k][0] = fract * (deltaUV_AC[1] * AB[0] - deltaUV_AB[1] * AC[0]);
-	model->tangents[k][1] = fract * (deltaUV_AC[1] * AB[1] - deltaUV_AB[1] * AC[1]);
-	model->tangents[k][2] = fract * (deltaUV_AC[1] * AB[2] - deltaUV_AB[1] * AC[2]);
+// The model is not unloaded right away, model_collect_unused does that
+// once it went unreferenced for MODEL_UNLOAD_DELAY_FRAMES frames.
+void model_release(ModelHandle handle)
+{
+    Model* model = model_get(handle);
+    assert(model && model->ref_count > 0);
+    model->ref_count--;
+}
 
-	model->bitangents[k][0] = fract * (-deltaUV_AC[0] * AB[0] + deltaUV_AB[0] * AC[0]);
-	model->bitangents[k][1] = fract * (-deltaUV_AC[0] * AB[1] + deltaUV_AB[0] * AC[1]);
-	model->bitangents[k][2] = fract * (-deltaUV_AC[0] * AB[2] + deltaUV_AB[0] * AC[2]);
+static size_t model_cpu_bytes(Model* model)
+{
+    if (model->baked.data) return model->baked.size;
 
-	// TODO: smoothen bitangents and tangents by averaging them for each vector
-	model->tangents[k + 1][0] = model->tangents[k + 2][0] = model->tangents[k][0];
-	model->tangents[k + 1][1] = model->tangents[k + 2][1] = model->tangents[k][1];
-	model->tangents[k + 1][2] = model->tangents[k + 2][2] = model->tangents[k][2];
-	model->bitangents[k + 1][0] = model->bitangents[k + 2][0] = model->bitangents[k][0];
-	model->bitangents[k + 1][1] = model->bitangents[k + 2][1] = model->bitangents[k][1];
-	model->bitangents[k + 1][2] = model->bitangents[k + 2][2] = model->bitangents[k][2];
+    size_t bytes = (size_t) model->num_vertices * (2 * sizeof(vec3) + sizeof(vec2));
+    if (model->tangents) bytes += (size_t) model->num_vertices * 2 * sizeof(vec3);
+    if (model->packed_vertices) bytes += (size_t) model->num_vertices * sizeof(PackedVertex);
+    return bytes + (size_t) model_num_indices(model) * model->index_size;
 }
 
-int loadModel(const char* obj_filename, const char *texture_filename, FaceType face_type, bool calculate_tangents)
+void destroyModel(ModelHandle handle)
 {
-    File file = {0};
-
-    file.vertices = (vec3*) malloc(MAX_OBJ_SIZE * sizeof(vec3));
-    file.faces = (Face*) malloc(MAX_OBJ_SIZE * sizeof(Face));
-    file.normals = (vec3*) malloc(MAX_OBJ_SIZE * sizeof(vec3));
-    file.texture_coords = (vec2*) malloc(MAX_OBJ_SIZE * sizeof(vec2));
+    Model* model = model_get(handle);
+    assert(model);
+
+    if (model->in_arena) {
+        mesh_arena_remove(model);
+    } else if (model->vao) {
+        glDeleteVertexArrays(1, &model->vao);
+        glDeleteBuffers(5, model->vertex_buffers);
+        glDeleteBuffers(1, &model->index_buffer);
+    }
+    mesh_gpu_bytes -= model->gpu_bytes;
+
+    if (model->baked.data) {
+        unmap_file(&model->baked);
+    } else {
+        free(model->vertices);
+        free(model->normals);
+        free(model->texture_coords);
+        free(model->tangents);
+        free(model->bitangents);
+        free(model->indices);
+    }
+    free(model->packed_vertices);
 
-    FILE* f = fopen(obj_filename, "r");
-    if (!f) abort();
+    if (model->has_texture) {
+        texture_release(model->texture_id);
+    }
+    if (model->has_normal_map) {
+        texture_release(model->normal_map_id);
+    }
 
-    char buffer[40] = { 0 };
-    while ((fscanf(f, " %s", buffer)) != EOF) {
-        if (!strcmp(buffer, "v")) {
-            float* ptr = file.vertices[++file.num_vertices];
-            fscanf(f, " %f %f %f", &ptr[0], &ptr[1], &ptr[2]);
-        }
-        else if (!strcmp(buffer, "vn")) {
-            float* ptr = file.normals[++file.num_normals];
-            fscanf(f, " %f %f %f", &ptr[0], &ptr[1], &ptr[2]);
-        }
-        else if (!strcmp(buffer, "vt")) {
-            float* ptr = file.texture_coords[++file.num_texture_coords];
-            fscanf(f, " %f %f", &ptr[0], &ptr[1]);
-        }
-        else if (!strcmp(buffer, "f")) {
-            Face face;
-            switch (face_type) {
-            case VERTEX_ONLY:
-                fscanf(f, " %d %d %d",
-                       &face.vertices[0], &face.vertices[1], &face.vertices[2]
-                );
-                break;
-            case VERTEX_NORMAL:
-                fscanf(f, " %d//%d %d//%d %d//%d",
-                       &face.vertices[0], &face.normals[0], &face.vertices[1],
-                       &face.normals[1], &face.vertices[2], &face.normals[2]
-                );
-                break;
-            case VERTEX_ALL:
-            case VERTEX_ALL_ALPHA:
-            case VERTEX_TEXTURE:
-                fscanf(f, " %d/%d/%d %d/%d/%d %d/%d/%d",
-                       &face.vertices[0], &face.texture_coords[0], &face.normals[0],
-                       &face.vertices[1], &face.texture_coords[1], &face.normals[1],
-                       &face.vertices[2], &face.texture_coords[2], &face.normals[2]
-                );
-                break;
-            default:
-                assert(false);
-            }
+    free(model->source_key);
+    model->in_use = false;
+}
 
-            file.faces[file.num_faces++] = face;
-        }
+// Call once per frame.
+void model_collect_unused()
+{
+    for (int i = 0; i < loaded_models_n; i++) {
+        Model* model = &loaded_models[i];
+        if (!model->in_use || model->ref_count > 0) continue;
+        if (++model->unused_frames < MODEL_UNLOAD_DELAY_FRAMES) continue;
+
+        size_t cpu_bytes = model_cpu_bytes(model);
+        size_t gpu_bytes = model->gpu_bytes;
+        const char* name = model->source_key ? model->source_key : "<generated>";
+        printf("Unloading model '%.*s': %.1f KB CPU, %.1f KB GPU\n", (int) strcspn(name, "|"), name,
+               cpu_bytes / 1024.0, gpu_bytes / 1024.0);
+        destroyModel(model_handle(i));
     }
-    fclose(f);
+}
 
-    Model* model = &loaded_models[loaded_models_n];
+static GLuint model_load_texture(const char* filename, const unsigned char fallback_rgb[3])
+{
+#ifdef TEXTURE_STREAMING
+    return loadTextureAsync(filename, fallback_rgb);
+#else
+    return loadTexture(filename);
+#endif
+}
 
-    if (face_type == VERTEX_ALL || face_type == VERTEX_ALL_ALPHA || face_type == VERTEX_TEXTURE) {
-        if (texture_filename) {
-            model->has_texture = true;
-            model->texture_id = loadTexture(texture_filename);
-        } else {
-            fprintf(stderr, "Warning: Texture requested, but no filename given!\n");
-        }
-    }
-    model->face_type = face_type;
-    model->num_faces = file.num_faces;
+void model_add_normal_map(Model* model, const char *normal_map_filename) {
+    model->has_normal_map = true;
+    model->normal_map_id = model_load_texture(normal_map_filename, texture_fallback_normal);
+}
+
+static void model_from_obj_file(Model* model, File* file, bool calculate_tangents)
+{
+    model->face_type = obj_file_face_type(file);
+    model->num_faces = file->num_faces;
     model->vertices = (vec3*) malloc(model->num_faces * 3 * sizeof(vec3));
     model->normals = (vec3*) malloc(model->num_faces * 3 * sizeof(vec3));
     model->texture_coords = (vec2*) malloc(model->num_faces * 3 * sizeof(vec2));
 
-    if (calculate_tangents) {
-        model->has_tangents = true;
-        model->tangents = (vec3*)malloc(model->num_faces * 3 * sizeof(vec3));
-        model->bitangents = (vec3*)malloc(model->num_faces * 3 * sizeof(vec3));
-    }
-
     int k = 0;
-    for (int i = 0; i < file.num_faces; i++) {
+    for (int i = 0; i < file->num_faces; i++) {
         for (int j = 0; j < 3; j++) {
-            model->vertices[k][j] = file.vertices[file.faces[i].vertices[0]][j];
-            model->vertices[k + 1][j] = file.vertices[file.faces[i].vertices[1]][j];
-            model->vertices[k + 2][j] = file.vertices[file.faces[i].vertices[2]][j];
+            model->vertices[k][j] = file->vertices[file->faces[i].vertices[0]][j];
+            model->vertices[k + 1][j] = file->vertices[file->faces[i].vertices[1]][j];
+            model->vertices[k + 2][j] = file->vertices[file->faces[i].vertices[2]][j];
         }
 
         for (int j = 0; j < 3; j++) {
-            model->normals[k][j] = file.normals[file.faces[i].normals[0]][j];
-            model->normals[k + 1][j] = file.normals[file.faces[i].normals[1]][j];
-            model->normals[k + 2][j] = file.normals[file.faces[i].normals[2]][j];
+            model->normals[k][j] = file->normals[file->faces[i].normals[0]][j];
+            model->normals[k + 1][j] = file->normals[file->faces[i].normals[1]][j];
+            model->normals[k + 2][j] = file->normals[file->faces[i].normals[2]][j];
         }
 
         for (int j = 0; j < 2; j++) {
-            model->texture_coords[k][j] = file.texture_coords[file.faces[i].texture_coords[0]][j];
-            model->texture_coords[k + 1][j] = file.texture_coords[file.faces[i].texture_coords[1]][j];
-            model->texture_coords[k + 2][j] = file.texture_coords[file.faces[i].texture_coords[2]][j];
+            model->texture_coords[k][j] = file->texture_coords[file->faces[i].texture_coords[0]][j];
+            model->texture_coords[k + 1][j] = file->texture_coords[file->faces[i].texture_coords[1]][j];
+            model->texture_coords[k + 2][j] = file->texture_coords[file->faces[i].texture_coords[2]][j];
         }
 
-        // calculate tangents and bitangents if requested (outside this loop, when we have all vertex information loaded)
-        if (calculate_tangents) {
-            generate_vertex_tangents_and_bitangents(model, k);
-		}
-
         k += 3;
     }
 
-    free(file.vertices);
-    free(file.faces);
-    free(file.normals);
-    free(file.texture_coords);
+    // tangents are generated after welding so that they get smoothed over
+    // every face sharing a vertex
+    model_weld_vertices(model);
+    if (calculate_tangents) {
+        model->has_tangents = true;
+        model->tangents = (vec3*) malloc(model->num_vertices * sizeof(vec3));
+        model->bitangents = (vec3*) malloc(model->num_vertices * sizeof(vec3));
+        model_generate_tangents(model, model->num_faces);
+    }
+    model_compute_bounds(model, model->num_vertices);
+}
+
+// Returns the already loaded model if the same file was loaded with the same
+// texture and tangent settings. Loaded models start with no references, they
+// are unloaded unless an object is created for them in time.
+ModelHandle loadModel(const char* obj_filename, const char *texture_filename, bool calculate_tangents)
+{
+    char source_key[1024];
+    snprintf(source_key, sizeof(source_key), "%s|%s|%d", obj_filename,
+             texture_filename ? texture_filename : "", calculate_tangents);
+
+    ModelHandle handle = model_find(source_key);
+    if (handle) {
+        model_get(handle)->unused_frames = 0;
+        return handle;
+    }
+
+    handle = model_alloc(source_key);
+    Model* model = model_get(handle);
+
+    char baked_filename[512];
+    snprintf(baked_filename, sizeof(baked_filename), "%s%s", obj_filename, BAKED_MESH_EXTENSION);
+
+    if (!load_baked_model(model, baked_filename, obj_filename, calculate_tangents)) {
+        File file;
+        if (!parse_obj_file(obj_filename, &file, OBJ_PARSE_THREADS)) abort();
+
+#ifdef OBJ_PARSE_CHECK_DETERMINISM
+        if (!check_obj_parse_determinism(obj_filename, OBJ_PARSE_THREADS)) abort();
+#endif
+
+        model_from_obj_file(model, &file, calculate_tangents);
+        obj_file_free(&file);
+
+        model_optimize(model, obj_filename);
+        model_build_lods(model, obj_filename);
+
+        bake_model(model, baked_filename, obj_filename);
+    }
+
+#ifdef PACKED_VERTEX_FORMAT
+    model_pack_vertices(model);
+#endif
+
+    FaceType face_type = model->face_type;
+    if (face_type == VERTEX_ALL || face_type == VERTEX_ALL_ALPHA || face_type == VERTEX_TEXTURE) {
+        if (texture_filename) {
+            model->has_texture = true;
+            model->texture_id = model_load_texture(texture_filename, texture_fallback_color);
+        } else {
+            fprintf(stderr, "Warning: Texture requested, but no filename given!\n");
+        }
+    }
+
+    return handle;
+}
+
+// Fills the DrawData block shared by all instances of a draw of model.
+void model_draw_uniforms(Model* model, RenderPass pass, DrawUniforms* out)
+{
+    DrawUniforms data = {};
+
+    if (model->packed_vertices) {
+        glm_vec3_copy(model->position_scale, data.pos_scale);
+        glm_vec3_copy(model->position_offset, data.pos_offset);
+        data.packed_vertices = 1;
+    } else {
+        vec3 one = { 1.0f, 1.0f, 1.0f };
+        glm_vec3_copy(one, data.pos_scale);
+    }
+
+    if (pass == PASS_FINAL) {
+        data.has_texture = model->has_texture;
+        data.has_normal_map = model->has_normal_map;
+    }
 
-    return loaded_models_n++;
+    // out may point into a write-combined mapping
+    memcpy(out, &data, sizeof(data));
 }
 
-void draw_model_impl(int program, Object obj, bool force_color)
+void object_instance_data(Object* obj, InstanceData* out)
 {
     mat4 mat;
     glm_mat4_identity(mat);
-    glm_translate(mat, obj.pos);
-    double rad = atan2(-obj.dir[1], obj.dir[0]);
+    glm_translate(mat, obj->pos);
+    double rad = atan2(-obj->dir[1], obj->dir[0]);
     vec3 axis = { 0, 1, 0 };
     glm_rotate(mat, rad, axis);
-    glm_scale_uni(mat, obj.scale);
-    glUniform1i(glGetUniformLocation(program, "forceColor"), force_color);
-    glUniform1i(glGetUniformLocation(program, "shininess"), obj.shininess);
-    glUniformMatrix4fv(glGetUniformLocation(program, "model"), 1, GL_FALSE, (const GLfloat*)mat);
-    glBindVertexArray(obj.vao);
-    glDrawArrays(GL_TRIANGLES, 0, 3 * loaded_models[obj.model_id].num_faces);
-    glBindVertexArray(0);
+    glm_scale_uni(mat, obj->scale);
+
+    InstanceData data;
+    for (int row = 0; row < 3; row++) {
+        for (int col = 0; col < 4; col++) {
+            data.model_rows[row][col] = mat[col][row];
+        }
+    }
+    data.shininess = (float) obj->shininess;
+    data.scale_tex_coords = obj->scale_tex_coords;
+    data.draw_index = 0.0f;
+    data.face_mask = 0.0f;
+
+    memcpy(out, &data, sizeof(data));
 }
 
-void draw_model(int program, Object obj, RenderPass pass)
+// Whether draws of a and b can share their texture bindings.
+bool model_same_textures(Model* a, Model* b)
 {
-    bool has_texture = loaded_models[obj.model_id].has_texture;
-    bool has_normal_map = loaded_models[obj.model_id].has_normal_map;
+    return a->has_texture == b->has_texture && (!a->has_texture || a->texture_id == b->texture_id)
+        && a->has_normal_map == b->has_normal_map && (!a->has_normal_map || a->normal_map_id == b->normal_map_id);
+}
 
+void model_bind_textures(Model* model, RenderPass pass)
+{
     if (pass == PASS_FINAL) {
-        glUniform1i(glGetUniformLocation(program, "hasTexture"), has_texture);
-        glUniform1f(glGetUniformLocation(program, "scaleTexCoords"), obj.scale_tex_coords);
-        glUniform1f(glGetUniformLocation(program, "hasNormalMap"), has_normal_map);
-        if (has_texture) {
-            glActiveTexture(GL_TEXTURE2);
-            glBindTexture(GL_TEXTURE_2D, loaded_models[obj.model_id].texture_id);
-        }
-        if (has_normal_map) {
-            glActiveTexture(GL_TEXTURE3);
-            glBindTexture(GL_TEXTURE_2D, loaded_models[obj.model_id].normal_map_id);
-        }
+        if (model->has_texture) gl_state_bind_texture(2, GL_TEXTURE_2D, model->texture_id);
+        if (model->has_normal_map) gl_state_bind_texture(3, GL_TEXTURE_2D, model->normal_map_id);
+    }
+}
+
+// Draws num_instances instances of one LOD of model, their InstanceData
+// starting at instance_offset in the instance stream. The DrawData block
+// their draw_index refers to must be bound.
+void draw_model_instanced(Model* model, int lod, GLintptr instance_offset, int num_instances, RenderPass pass)
+{
+    model_bind_textures(model, pass);
+
+    gl_state_bind_vertex_array(model->vao);
+    instance_stream_attrib_pointers(instance_offset);
+    if (model->in_arena) {
+        glDrawElementsInstancedBaseVertex(GL_TRIANGLES, model->lod_num_indices[lod], GL_UNSIGNED_INT,
+                                          (void*) ((size_t) (model->arena_first_index + model->lod_first_index[lod]) * sizeof(unsigned int)),
+                                          num_instances, model->arena_first_vertex);
+    } else {
+        glDrawElementsInstanced(GL_TRIANGLES, model->lod_num_indices[lod], model->index_type,
+                                (void*) ((size_t) model->lod_first_index[lod] * model->index_size),
+                                num_instances);
     }
-        
-    draw_model_impl(program, obj, false);
 }
 
-void draw_model_force_rgb(int program, Object obj, float r, float g, float b)
+void draw_model_force_rgb(Object obj, float r, float g, float b)
 {
-    vec3 color = { r, g, b };
-    glUniform3fv(glGetUniformLocation(program, "forcedColor"), 1, color);
-    glUniform1i(glGetUniformLocation(program, "hasTexture"), 0);
-    draw_model_impl(program, obj, true);
+    Model* model = model_get(obj.model_id);
+
+    DrawUniforms data;
+    model_draw_uniforms(model, PASS_FINAL, &data);
+    data.force_color = 1;
+    data.has_texture = 0;
+    data.forced_color[0] = r;
+    data.forced_color[1] = g;
+    data.forced_color[2] = b;
+
+    // a whole DrawData block, the shader declares all of its draws
+    GLsizeiptr block_size = uniform_ring_block_size(DRAWS_PER_BLOCK * sizeof(DrawUniforms));
+    GLintptr offset;
+    char* block = uniform_ring_map(block_size, &offset);
+    memcpy(block, &data, sizeof(data));
+    uniform_ring_unmap();
+    uniform_ring_bind(UNIFORM_BLOCK_DRAW, offset, DRAWS_PER_BLOCK * sizeof(DrawUniforms));
+
+    GLintptr instance_offset;
+    object_instance_data(&obj, instance_stream_map(1, &instance_offset));
+    instance_stream_unmap();
+
+    draw_model_instanced(model, obj.lod, instance_offset, 1, PASS_FINAL);
 }
 
-Object create_object(ObjectType type, int model_id, float x, float y, float z, float speed, float scale, float shininess)
+static void model_buffer_data(Model* model, int slot, GLsizeiptr size, const void* data)
+{
+    glGenBuffers(1, &model->vertex_buffers[slot]);
+    glBindBuffer(GL_ARRAY_BUFFER, model->vertex_buffers[slot]);
+    glBufferData(GL_ARRAY_BUFFER, size, data, GL_STATIC_DRAW);
+    model->gpu_bytes += size;
+}
+
+// Uploads the mesh of a model once, every object of the model draws with
+// the same VAO.
+void model_upload(Model* model)
+{
+    if (model->vao) return;
+
+    model->gpu_bytes = 0;
+    if (mesh_arena_add(model)) {
+        mesh_gpu_bytes += model->gpu_bytes;
+        return;
+    }
+
+	// TODO: perhaps use glGetUniformLocation for vertex indices
+    glGenVertexArrays(1, &model->vao);
+    gl_state_bind_vertex_array(model->vao);
+        // pointed at the instance stream by every draw
+        for (int i = 0; i < 4; i++) {
+            glEnableVertexAttribArray(INSTANCE_ATTRIB_MODEL_ROWS + i);
+            glVertexAttribDivisor(INSTANCE_ATTRIB_MODEL_ROWS + i, 1);
+        }
+
+        GLsizeiptr index_bytes = (GLsizeiptr) model_num_indices(model) * model->index_size;
+        glGenBuffers(1, &model->index_buffer);
+        glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, model->index_buffer);
+        glBufferData(GL_ELEMENT_ARRAY_BUFFER, index_bytes, model->indices, GL_STATIC_DRAW);
+        model->gpu_bytes += index_bytes;
+
+        if (model->packed_vertices) {
+            model_buffer_data(model, 0, model->num_vertices * sizeof(PackedVertex), model->packed_vertices);
+            packed_vertex_attrib_pointers();
+        } else {
+            glEnableVertexAttribArray(0);
+            model_buffer_data(model, 0, model->num_vertices * sizeof(vec3), model->vertices);
+            glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+
+            glEnableVertexAttribArray(1);
+            model_buffer_data(model, 1, model->num_vertices * sizeof(vec3), model->normals);
+            glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+
+            if (model->has_texture) {
+                glEnableVertexAttribArray(2);
+                model_buffer_data(model, 2, model->num_vertices * sizeof(vec2), model->texture_coords);
+                glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, (void*)0);
+            }
+
+            if (model->has_normal_map) {
+                glEnableVertexAttribArray(3);
+                model_buffer_data(model, 3, model->num_vertices * sizeof(vec3), model->tangents);
+                glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+
+                glEnableVertexAttribArray(4);
+                model_buffer_data(model, 4, model->num_vertices * sizeof(vec3), model->bitangents);
+                glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
+            }
+        }
+    gl_state_bind_vertex_array(0);
+
+    mesh_gpu_bytes += model->gpu_bytes;
+}
+
+Object create_object(ObjectType type, ModelHandle model_id, float x, float y, float z, float speed, float scale, float shininess)
 {
     Object obj = {};
-    glGenVertexArrays(1, &obj.vao);
     obj.type = type;
     obj.pos[0] = x;
     obj.pos[1] = y;
@@ -255,52 +441,24 @@ Object create_object(ObjectType type, int model_id, float x, float y, float z, f
     obj.scale = scale;
     obj.shininess = shininess;
     obj.scale_tex_coords = 1.0;
+    obj.tree_leaf = -1;
+    obj.is_static = type != OBJ_CHARACTER;
 
-	// TODO: perhaps use glGetUniformLocation for vertex indices
-    glBindVertexArray(obj.vao);
-	    GLuint vbo1, vbo2, vbo3, vbo4, vbo5;
-        // TODO: free
-        glGenBuffers(1, &vbo1);
-        glGenBuffers(1, &vbo2);
-        glGenBuffers(1, &vbo3);
-        glGenBuffers(1, &vbo4);
-        glGenBuffers(1, &vbo5);
-
-        glEnableVertexAttribArray(0);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo1);
-        glBufferData(GL_ARRAY_BUFFER, loaded_models[obj.model_id].num_faces * 3 * sizeof(vec3), loaded_models[obj.model_id].vertices, GL_STATIC_DRAW);
-        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-
-        glEnableVertexAttribArray(1);
-        glBindBuffer(GL_ARRAY_BUFFER, vbo2);
-        glBufferData(GL_ARRAY_BUFFER, loaded_models[obj.model_id].num_faces * 3 * sizeof(vec3), loaded_models[obj.model_id].normals, GL_STATIC_DRAW);
-        glVertexAttribPointer(1, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-
-        if (loaded_models[obj.model_id].has_texture) {
-            glEnableVertexAttribArray(2);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo3);
-            glBufferData(GL_ARRAY_BUFFER, loaded_models[obj.model_id].num_faces * 3 * sizeof(vec2), loaded_models[obj.model_id].texture_coords, GL_STATIC_DRAW);
-            glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(float) * 2, (void*)0);
-        }
-
-        if (loaded_models[obj.model_id].has_normal_map) {
-            glEnableVertexAttribArray(3);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo4);
-            glBufferData(GL_ARRAY_BUFFER, loaded_models[obj.model_id].num_faces * 3 * sizeof(vec3), loaded_models[obj.model_id].tangents, GL_STATIC_DRAW);
-            glVertexAttribPointer(3, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-
-            glEnableVertexAttribArray(4);
-            glBindBuffer(GL_ARRAY_BUFFER, vbo5);
-            glBufferData(GL_ARRAY_BUFFER, loaded_models[obj.model_id].num_faces * 3 * sizeof(vec3), loaded_models[obj.model_id].bitangents, GL_STATIC_DRAW);
-            glVertexAttribPointer(4, 3, GL_FLOAT, GL_FALSE, sizeof(float) * 3, (void*)0);
-        }
-    glBindVertexArray(0);
+    model_acquire(model_id);
+    model_upload(model_get(model_id));
 
     return obj;
 }
 
-int create_tiled_plane(int subdivisions, float tile_size, float tex_scale, char *texture_filename) {
-    Model *m = &loaded_models[loaded_models_n];
+void destroy_object(Object* obj)
+{
+    model_release(obj->model_id);
+    obj->model_id = 0;
+}
+
+ModelHandle create_tiled_plane(int subdivisions, float tile_size, float tex_scale, char *texture_filename) {
+    ModelHandle handle = model_alloc(NULL);
+    Model *m = model_get(handle);
 
     m->face_type = VERTEX_TEXTURE;
     
@@ -313,8 +471,8 @@ int create_tiled_plane(int subdivisions, float tile_size, float tex_scale, char
     m->vertices = (vec3*) malloc(num_vertices * sizeof(vec3));
     m->texture_coords = (vec2*) malloc(num_vertices * sizeof(*m->texture_coords));
     m->normals = (vec3*) malloc(num_vertices * sizeof(*m->normals));
-    m->tangents = (vec3*) malloc(num_vertices * sizeof(*m->tangents));
-    m->bitangents = (vec3*) malloc(num_vertices * sizeof(*m->bitangents));
+    m->tangents = (vec3*) calloc(num_vertices, sizeof(*m->tangents));
+    m->bitangents = (vec3*) calloc(num_vertices, sizeof(*m->bitangents));
     
     int width = subdivisions * 6;
     for (int i = 0; i < subdivisions; i++) {
@@ -368,9 +526,6 @@ int create_tiled_plane(int subdivisions, float tile_size, float tex_scale, char
                 m->normals[i * width + j * 6 + k][1] = 1.0f;
                 m->normals[i * width + j * 6 + k][2] = 0.0f;
             }
-
-			generate_vertex_tangents_and_bitangents(m, i * width + j * 6);
-			generate_vertex_tangents_and_bitangents(m, i * width + j * 6 + 3);
         }
     }
 
@@ -453,10 +608,18 @@ int create_tiled_plane(int subdivisions, float tile_size, float tex_scale, char
 	m->vertices[subdivisions * width + 4 * 6 + 5][1] = tile_size * -10.0f;
 	m->vertices[subdivisions * width + 4 * 6 + 5][2] = subdivisions * tile_size;
 
+    // the terrain editing in main relies on the 6 vertices per tile layout,
+    // so the plane is indexed but not welded
+    model_index_identity(m);
+    model_compute_bounds(m, num_vertices);
+
+    // only the tiles have texture coordinates
+    model_generate_tangents(m, 2 * subdivisions_sq);
+
     if (texture_filename) {
         m->has_texture = true;
-		m->texture_id = loadTexture(texture_filename);
+		m->texture_id = model_load_texture(texture_filename, texture_fallback_color);
     }
 
-    return loaded_models_n++;
+    return handle;
 }
\ No newline at end of file
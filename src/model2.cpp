@@ -1,242 +1,431 @@
-#include <assimp/cimport.h>     // C++ importer interface
-#include <assimp/scene.h>       // Output data structure
-#include <assimp/postprocess.h> // Post processing flags
-#include <vector>
-#include <map>
-
-#define MAX_BONES_PER_VERTEX 4
+// Skinned meshes loaded through Assimp.
+//
+// All meshes of a scene are merged into one SkinnedModel. Bones and
+// keyframes live in flat arrays indexed by node; the node hierarchy is
+// flattened breadth-first so that every parent precedes its children and
+// skinned_model_pose is a single linear pass without any name lookups.
+// Vertices keep their SKINNED_MAX_INFLUENCES strongest influences as 8-bit
+// bone ids and unorm8 weights.
+
+#include <assimp/cimport.h>
+#include <assimp/scene.h>
+#include <assimp/postprocess.h>
+
+static void ai_to_mat4(const aiMatrix4x4* m, mat4 dest)
+{
+    // Assimp matrices are row major, cglm's column major
+    dest[0][0] = m->a1; dest[1][0] = m->a2; dest[2][0] = m->a3; dest[3][0] = m->a4;
+    dest[0][1] = m->b1; dest[1][1] = m->b2; dest[2][1] = m->b3; dest[3][1] = m->b4;
+    dest[0][2] = m->c1; dest[1][2] = m->c2; dest[2][2] = m->c3; dest[3][2] = m->c4;
+    dest[0][3] = m->d1; dest[1][3] = m->d2; dest[2][3] = m->d3; dest[3][3] = m->d4;
+}
 
-typedef struct {
-    int bone_ids[MAX_BONES_PER_VERTEX] = { 0 };
-    float weights[MAX_BONES_PER_VERTEX] = { 0.0f };
-    int num_bones = 0;
-} VertexBoneData;
+static int count_nodes(const aiNode* node)
+{
+    int n = 1;
+    for (unsigned int i = 0; i < node->mNumChildren; i++) {
+        n += count_nodes(node->mChildren[i]);
+    }
+    return n;
+}
 
-typedef struct {
-    //GLuint VAO;
+// only used while loading, poses work with node indices
+static int find_node(const aiNode** nodes, int num_nodes, const aiString* name)
+{
+    for (int i = 0; i < num_nodes; i++) {
+        if (!strcmp(nodes[i]->mName.data, name->data)) return i;
+    }
+    return -1;
+}
 
-    std::vector<VertexBoneData> bones;
-    std::vector<int> indices;
-    std::vector<float[3]> positions;
-    std::vector<float[3]> normals;
-    std::vector<float[2]> tex_coords;
+// Keeps the strongest influences of a vertex.
+static void add_influence(int ids[SKINNED_MAX_INFLUENCES], float weights[SKINNED_MAX_INFLUENCES],
+                          int bone, float weight)
+{
+    int weakest = 0;
+    for (int i = 1; i < SKINNED_MAX_INFLUENCES; i++) {
+        if (weights[i] < weights[weakest]) weakest = i;
+    }
+    if (weight > weights[weakest]) {
+        ids[weakest] = bone;
+        weights[weakest] = weight;
+    }
+}
 
-    std::map<std::string, int> bone_name2id;
-} Model;
+// Normalizes the weights and quantizes them to unorm8 summing to exactly 255.
+// Vertices without any influence get all zero weights.
+static void quantize_influences(const int ids[SKINNED_MAX_INFLUENCES], const float weights[SKINNED_MAX_INFLUENCES],
+                                unsigned char out_ids[SKINNED_MAX_INFLUENCES],
+                                unsigned char out_weights[SKINNED_MAX_INFLUENCES])
+{
+    float sum = 0.0f;
+    int strongest = 0;
+    for (int i = 0; i < SKINNED_MAX_INFLUENCES; i++) {
+        sum += weights[i];
+        if (weights[i] > weights[strongest]) strongest = i;
+    }
 
-std::vector<VertexBoneData> vertex2bones;
-std::vector<int> mesh_base_vertex;
-std::map<std::string, int> bone_name2id;
+    int total = 0;
+    for (int i = 0; i < SKINNED_MAX_INFLUENCES; i++) {
+        out_ids[i] = (unsigned char) ids[i];
+        out_weights[i] = sum > 0.0f ? (unsigned char) (weights[i] / sum * 255.0f + 0.5f) : 0;
+        total += out_weights[i];
+    }
+    if (sum > 0.0f) out_weights[strongest] += 255 - total;
+}
 
-bool loadModel(char *filename)
+static void load_animation(SkeletalAnimation* anim, const aiAnimation* src,
+                           const aiNode** nodes, int num_nodes)
 {
-    // Release the previously loaded mesh (if it exists)
-    //Clear();
+    anim->duration = (float) src->mDuration;
+    anim->ticks_per_second = src->mTicksPerSecond > 0.0 ? (float) src->mTicksPerSecond : 25.0f;
+
+    int num_positions = 0, num_rotations = 0, num_scalings = 0;
+    for (unsigned int c = 0; c < src->mNumChannels; c++) {
+        num_positions += src->mChannels[c]->mNumPositionKeys;
+        num_rotations += src->mChannels[c]->mNumRotationKeys;
+        num_scalings += src->mChannels[c]->mNumScalingKeys;
+    }
 
-    // Create the VAO
-    //glGenVertexArrays(1, &m_VAO);
-    //glBindVertexArray(m_VAO);
+    anim->position_ranges = (KeyRange*) calloc(num_nodes, sizeof(KeyRange));
+    anim->rotation_ranges = (KeyRange*) calloc(num_nodes, sizeof(KeyRange));
+    anim->scaling_ranges = (KeyRange*) calloc(num_nodes, sizeof(KeyRange));
+    anim->animated = (bool*) calloc(num_nodes, sizeof(bool));
+    anim->position_times = (float*) malloc(num_positions * sizeof(float));
+    anim->positions = (vec3*) malloc(num_positions * sizeof(vec3));
+    anim->rotation_times = (float*) malloc(num_rotations * sizeof(float));
+    anim->rotations = (versor*) malloc(num_rotations * sizeof(versor));
+    anim->scaling_times = (float*) malloc(num_scalings * sizeof(float));
+    anim->scalings = (vec3*) malloc(num_scalings * sizeof(vec3));
+
+    num_positions = num_rotations = num_scalings = 0;
+    for (unsigned int c = 0; c < src->mNumChannels; c++) {
+        const aiNodeAnim* channel = src->mChannels[c];
+        int node = find_node(nodes, num_nodes, &channel->mNodeName);
+        if (node == -1) {
+            fprintf(stderr, "Warning: animation channel for unknown node '%s'\n", channel->mNodeName.data);
+            continue;
+        }
+        anim->animated[node] = true;
+
+        anim->position_ranges[node].first = num_positions;
+        anim->position_ranges[node].count = channel->mNumPositionKeys;
+        for (unsigned int k = 0; k < channel->mNumPositionKeys; k++, num_positions++) {
+            const aiVectorKey* key = &channel->mPositionKeys[k];
+            anim->position_times[num_positions] = (float) key->mTime;
+            anim->positions[num_positions][0] = key->mValue.x;
+            anim->positions[num_positions][1] = key->mValue.y;
+            anim->positions[num_positions][2] = key->mValue.z;
+        }
 
-    // Create the buffers for the vertices attributes
-    //glGenBuffers(ARRAY_SIZE_IN_ELEMENTS(m_Buffers), m_Buffers);
+        anim->rotation_ranges[node].first = num_rotations;
+        anim->rotation_ranges[node].count = channel->mNumRotationKeys;
+        for (unsigned int k = 0; k < channel->mNumRotationKeys; k++, num_rotations++) {
+            const aiQuatKey* key = &channel->mRotationKeys[k];
+            anim->rotation_times[num_rotations] = (float) key->mTime;
+            // versors are x, y, z, w
+            anim->rotations[num_rotations][0] = key->mValue.x;
+            anim->rotations[num_rotations][1] = key->mValue.y;
+            anim->rotations[num_rotations][2] = key->mValue.z;
+            anim->rotations[num_rotations][3] = key->mValue.w;
+        }
 
-    const aiScene *scene = aiImportFile(filename, aiProcess_Triangulate | aiProcess_GenSmoothNormals | aiProcess_JoinIdenticalVertices);
-    if (!scene) {
-        fprintf(stderr, "Error parsing '%s': '%s'\n", filename, aiGetErrorString());
-        return false;
+        anim->scaling_ranges[node].first = num_scalings;
+        anim->scaling_ranges[node].count = channel->mNumScalingKeys;
+        for (unsigned int k = 0; k < channel->mNumScalingKeys; k++, num_scalings++) {
+            const aiVectorKey* key = &channel->mScalingKeys[k];
+            anim->scaling_times[num_scalings] = (float) key->mTime;
+            anim->scalings[num_scalings][0] = key->mValue.x;
+            anim->scalings[num_scalings][1] = key->mValue.y;
+            anim->scalings[num_scalings][2] = key->mValue.z;
+        }
     }
+}
 
-    mesh_base_vertex.resize(scene->mNumMeshes);
+static bool skinned_model_from_scene(SkinnedModel* model, const aiScene* scene, const char* filename)
+{
+    *model = {};
+
+    // flatten the hierarchy breadth-first, parents before children
+    model->num_nodes = count_nodes(scene->mRootNode);
+    const aiNode** nodes = (const aiNode**) malloc(model->num_nodes * sizeof(aiNode*));
+    model->node_parent = (int*) malloc(model->num_nodes * sizeof(int));
+    model->node_transforms = (mat4*) malloc(model->num_nodes * sizeof(mat4));
+    model->node_globals = (mat4*) malloc(model->num_nodes * sizeof(mat4));
+
+    nodes[0] = scene->mRootNode;
+    model->node_parent[0] = -1;
+    int num_queued = 1;
+    for (int i = 0; i < model->num_nodes; i++) {
+        ai_to_mat4(&nodes[i]->mTransformation, model->node_transforms[i]);
+        for (unsigned int c = 0; c < nodes[i]->mNumChildren; c++) {
+            nodes[num_queued] = nodes[i]->mChildren[c];
+            model->node_parent[num_queued] = i;
+            num_queued++;
+        }
+    }
 
-    int total_vertices = 0;
+    ai_to_mat4(&scene->mRootNode->mTransformation, model->global_inverse);
+    glm_mat4_inv(model->global_inverse, model->global_inverse);
 
-    for (int i = 0; i < scene->mNumMeshes; i++) {
-        const aiMesh* mesh = scene->mMeshes[i];
-        fprintf(stderr, "Loaded Mesh #%d with %d vertices and % bones.\n", i, mesh->mNumVertices, mesh->mNumBones);
+    int num_indices = 0;
+    for (unsigned int m = 0; m < scene->mNumMeshes; m++) {
+        model->num_vertices += scene->mMeshes[m]->mNumVertices;
+        for (unsigned int f = 0; f < scene->mMeshes[m]->mNumFaces; f++) {
+            if (scene->mMeshes[m]->mFaces[f].mNumIndices == 3) num_indices += 3;
+        }
+    }
 
-        mesh_base_vertex[i] = total_vertices;
-        total_vertices += mesh->mNumVertices;
+    model->positions = (vec3*) malloc(model->num_vertices * sizeof(vec3));
+    model->normals = (vec3*) calloc(model->num_vertices, sizeof(vec3));
+    model->texture_coords = (vec2*) calloc(model->num_vertices, sizeof(vec2));
+    model->bone_ids = (unsigned char (*)[SKINNED_MAX_INFLUENCES]) malloc(model->num_vertices * SKINNED_MAX_INFLUENCES);
+    model->bone_weights = (unsigned char (*)[SKINNED_MAX_INFLUENCES]) malloc(model->num_vertices * SKINNED_MAX_INFLUENCES);
+    model->indices = (unsigned int*) malloc(num_indices * sizeof(unsigned int));
+
+    // influences are gathered as floats and quantized at the end
+    int (*influence_ids)[SKINNED_MAX_INFLUENCES] =
+        (int (*)[SKINNED_MAX_INFLUENCES]) calloc(model->num_vertices, sizeof(*influence_ids));
+    float (*influence_weights)[SKINNED_MAX_INFLUENCES] =
+        (float (*)[SKINNED_MAX_INFLUENCES]) calloc(model->num_vertices, sizeof(*influence_weights));
+
+    // bones are numbered in the order they are first referenced
+    int* node_bone = (int*) malloc(model->num_nodes * sizeof(int));
+    for (int i = 0; i < model->num_nodes; i++) node_bone[i] = -1;
+    model->bone_node = (int*) malloc(model->num_nodes * sizeof(int));
+    model->bone_offsets = (mat4*) malloc(model->num_nodes * sizeof(mat4));
+
+    bool ok = true;
+    int base_vertex = 0;
+    for (unsigned int m = 0; m < scene->mNumMeshes && ok; m++) {
+        const aiMesh* mesh = scene->mMeshes[m];
+
+        for (unsigned int v = 0; v < mesh->mNumVertices; v++) {
+            int k = base_vertex + v;
+            model->positions[k][0] = mesh->mVertices[v].x;
+            model->positions[k][1] = mesh->mVertices[v].y;
+            model->positions[k][2] = mesh->mVertices[v].z;
+            if (mesh->mNormals) {
+                model->normals[k][0] = mesh->mNormals[v].x;
+                model->normals[k][1] = mesh->mNormals[v].y;
+                model->normals[k][2] = mesh->mNormals[v].z;
+            }
+            if (mesh->mTextureCoords[0]) {
+                model->texture_coords[k][0] = mesh->mTextureCoords[0][v].x;
+                model->texture_coords[k][1] = mesh->mTextureCoords[0][v].y;
+            }
+        }
 
-        vertex2bones.resize(total_vertices);
+        for (unsigned int f = 0; f < mesh->mNumFaces; f++) {
+            const aiFace* face = &mesh->mFaces[f];
+            if (face->mNumIndices != 3) continue; // points and lines
+            for (int j = 0; j < 3; j++) {
+                model->indices[model->num_indices++] = base_vertex + face->mIndices[j];
+            }
+        }
 
-        for (int b = 0; b < mesh->mNumBones; b++) {
+        for (unsigned int b = 0; b < mesh->mNumBones; b++) {
             const aiBone* bone = mesh->mBones[b];
+            int node = find_node(nodes, model->num_nodes, &bone->mName);
+            if (node == -1) {
+                fprintf(stderr, "Error loading '%s': bone '%s' has no node\n", filename, bone->mName.data);
+                ok = false;
+                break;
+            }
 
-            std::string bone_name(bone->mName.C_Str());
-            if (bone_name2id.find(bone_name) == bone_name2id.end()) {
-                bone_name2id[bone_name] = bone_name2id.size();
+            if (node_bone[node] == -1) {
+                if (model->num_bones == 256) {
+                    fprintf(stderr, "Error loading '%s': more than 256 bones\n", filename);
+                    ok = false;
+                    break;
+                }
+                node_bone[node] = model->num_bones;
+                model->bone_node[model->num_bones] = node;
+                ai_to_mat4(&bone->mOffsetMatrix, model->bone_offsets[model->num_bones]);
+                model->num_bones++;
             }
-            int bone_id = bone_name2id[bone_name];
 
-            for (int w = 0; w < bone->mNumWeights; w++) {
-                const aiVertexWeight vw = bone->mWeights[w];
+            for (unsigned int w = 0; w < bone->mNumWeights; w++) {
+                int v = base_vertex + bone->mWeights[w].mVertexId;
+                add_influence(influence_ids[v], influence_weights[v], node_bone[node], bone->mWeights[w].mWeight);
+            }
+        }
 
-                int vertex_id = mesh_base_vertex[i] + vw.mVertexId;
+        base_vertex += mesh->mNumVertices;
+    }
 
-                assert(vertex_id < vertex2bones.size());
-                vertex2bones[vertex_id].bone_ids[vertex2bones[vertex_id].num_bones] = bone_id;
-                vertex2bones[vertex_id].weights[vertex2bones[vertex_id].num_bones] = vw.mWeight;
-                vertex2bones[vertex_id].num_bones++;
-            }
+    for (int v = 0; v < model->num_vertices; v++) {
+        quantize_influences(influence_ids[v], influence_weights[v], model->bone_ids[v], model->bone_weights[v]);
+    }
+
+    if (ok) {
+        model->num_animations = scene->mNumAnimations;
+        model->animations = (SkeletalAnimation*) calloc(model->num_animations, sizeof(SkeletalAnimation));
+        for (int a = 0; a < model->num_animations; a++) {
+            load_animation(&model->animations[a], scene->mAnimations[a], nodes, model->num_nodes);
         }
     }
 
-    // Make sure the VAO is not changed from the outside
-    //glBindVertexArray(0);
+    free(node_bone);
+    free(influence_weights);
+    free(influence_ids);
+    free(nodes);
 
-    return true;
+    return ok;
 }
 
-bool initFromScene(const aiScene* pScene, const string& Filename)
+void skinned_model_free(SkinnedModel* model)
 {
-    ...
-        vector<VertexBoneData> Bones;
-    ...
-        Bones.resize(NumVertices);
-    ...
-        glBindBuffer(GL_ARRAY_BUFFER, m_Buffers[BONE_VB]);
-    glBufferData(GL_ARRAY_BUFFER, sizeof(Bones[0]) * Bones.size(), &Bones[0], GL_STATIC_DRAW);
-    glEnableVertexAttribArray(BONE_ID_LOCATION);
-    glVertexAttribIPointer(BONE_ID_LOCATION, 4, GL_INT, sizeof(VertexBoneData), (const GLvoid*)0);
-    glEnableVertexAttribArray(BONE_WEIGHT_LOCATION);
-    glVertexAttribPointer(BONE_WEIGHT_LOCATION, 4, GL_FLOAT, GL_FALSE, sizeof(VertexBoneData), (const GLvoid*)16);
-    ...
+    for (int a = 0; a < model->num_animations; a++) {
+        SkeletalAnimation* anim = &model->animations[a];
+        free(anim->position_ranges);
+        free(anim->rotation_ranges);
+        free(anim->scaling_ranges);
+        free(anim->animated);
+        free(anim->position_times);
+        free(anim->positions);
+        free(anim->rotation_times);
+        free(anim->rotations);
+        free(anim->scaling_times);
+        free(anim->scalings);
+    }
+    free(model->animations);
+
+    free(model->positions);
+    free(model->normals);
+    free(model->texture_coords);
+    free(model->bone_ids);
+    free(model->bone_weights);
+    free(model->indices);
+    free(model->node_parent);
+    free(model->node_transforms);
+    free(model->node_globals);
+    free(model->bone_node);
+    free(model->bone_offsets);
+    *model = {};
 }
 
-void Mesh::LoadBones(uint MeshIndex, const aiMesh* pMesh, vector& Bones)
+bool load_skinned_model(SkinnedModel* model, const char* filename)
 {
-    for (uint i = 0; i < pMesh->mNumBones; i++) {
-        uint BoneIndex = 0;
-        string BoneName(pMesh->mBones[i]->mName.data);
-
-        if (m_BoneMapping.find(BoneName) == m_BoneMapping.end()) {
-            BoneIndex = m_NumBones;
-            m_NumBones++;
-            BoneInfo bi;
-            m_BoneInfo.push_back(bi);
-        }
-        else {
-            BoneIndex = m_BoneMapping[BoneName];
-        }
+    double start = glfwGetTime();
 
-        m_BoneMapping[BoneName] = BoneIndex;
-        m_BoneInfo[BoneIndex].BoneOffset = pMesh->mBones[i]->mOffsetMatrix;
-
-        for (uint j = 0; j < pMesh->mBones[i]->mNumWeights; j++) {
-            uint VertexID = m_Entries[MeshIndex].BaseVertex + pMesh->mBones[i]->mWeights[j].mVertexId;
-            float Weight = pMesh->mBones[i]->mWeights[j].mWeight;
-            Bones[VertexID].AddBoneData(BoneIndex, Weight);
-        }
+    const aiScene* scene = aiImportFile(filename, aiProcess_Triangulate | aiProcess_GenSmoothNormals |
+                                                  aiProcess_JoinIdenticalVertices | aiProcess_LimitBoneWeights);
+    if (!scene || !scene->mRootNode) {
+        fprintf(stderr, "Error parsing '%s': '%s'\n", filename, aiGetErrorString());
+        return false;
     }
-}
 
-void Mesh::VertexBoneData::AddBoneData(uint BoneID, float Weight)
-{
-    for (uint i = 0; i < ARRAY_SIZE_IN_ELEMENTS(IDs); i++) {
-        if (Weights[i] == 0.0) {
-            IDs[i] = BoneID;
-            Weights[i] = Weight;
-            return;
-        }
+    bool ok = skinned_model_from_scene(model, scene, filename);
+    aiReleaseImport(scene);
+    if (!ok) {
+        skinned_model_free(model);
+        return false;
     }
 
-    // should never get here - more bones than we have space for
-    assert(0);
+    printf("Loaded skinned mesh '%s': %d vertices, %d triangles, %d nodes, %d bones, %d animations in %.2f ms\n",
+           filename, model->num_vertices, model->num_indices / 3, model->num_nodes, model->num_bones,
+           model->num_animations, (glfwGetTime() - start) * 1000.0);
+
+    return true;
 }
 
-Matrix4f Mesh::BoneTransform(float TimeInSeconds, vector<Matrix4f>& Transforms)
+// Last key at or before time, binary search over the key times.
+static int find_key(const float* times, int count, float time)
 {
-    Matrix4f Identity;
-    Identity.InitIdentity();
-
-    float TicksPerSecond = m_pScene->mAnimations[0]->mTicksPerSecond != 0 ?
-        m_pScene->mAnimations[0]->mTicksPerSecond : 25.0f;
-    float TimeInTicks = TimeInSeconds * TicksPerSecond;
-    float AnimationTime = fmod(TimeInTicks, m_pScene->mAnimations[0]->mDuration);
-
-    ReadNodeHeirarchy(AnimationTime, m_pScene->mRootNode, Identity);
-
-    Transforms.resize(m_NumBones);
-
-    for (uint i = 0; i < m_NumBones; i++) {
-        Transforms[i] = m_BoneInfo[i].FinalTransformation;
+    int lo = 0, hi = count - 1;
+    while (lo < hi) {
+        int mid = (lo + hi + 1) / 2;
+        if (times[mid] <= time) lo = mid;
+        else hi = mid - 1;
     }
+    return lo;
 }
 
-void Mesh::ReadNodeHeirarchy(float AnimationTime, const aiNode* pNode, const Matrix4f& ParentTransform)
+// Interpolation factor between key k and k + 1.
+static float key_factor(const float* times, int count, int k, float time)
 {
-    string NodeName(pNode->mName.data);
-
-    const aiAnimation* pAnimation = m_pScene->mAnimations[0];
-
-    Matrix4f NodeTransformation(pNode->mTransformation);
-
-    const aiNodeAnim* pNodeAnim = FindNodeAnim(pAnimation, NodeName);
-
-    if (pNodeAnim) {
-        // Interpolate scaling and generate scaling transformation matrix
-        aiVector3D Scaling;
-        CalcInterpolatedScaling(Scaling, AnimationTime, pNodeAnim);
-        Matrix4f ScalingM;
-        ScalingM.InitScaleTransform(Scaling.x, Scaling.y, Scaling.z);
-
-        // Interpolate rotation and generate rotation transformation matrix
-        aiQuaternion RotationQ;
-        CalcInterpolatedRotation(RotationQ, AnimationTime, pNodeAnim);
-        Matrix4f RotationM = Matrix4f(RotationQ.GetMatrix());
-
-        // Interpolate translation and generate translation transformation matrix
-        aiVector3D Translation;
-        CalcInterpolatedPosition(Translation, AnimationTime, pNodeAnim);
-        Matrix4f TranslationM;
-        TranslationM.InitTranslationTransform(Translation.x, Translation.y, Translation.z);
+    if (k + 1 >= count) return 0.0f;
+    float dt = times[k + 1] - times[k];
+    float t = dt > 0.0f ? (time - times[k]) / dt : 0.0f;
+    return t < 0.0f ? 0.0f : (t > 1.0f ? 1.0f : t);
+}
 
-        // Combine the above transformations
-        NodeTransformation = TranslationM * RotationM * ScalingM;
+// Translation * rotation * scaling of an animated node at time (in ticks).
+static void animated_node_transform(const SkeletalAnimation* anim, int node, float time, mat4 dest)
+{
+    vec3 position = { 0.0f, 0.0f, 0.0f };
+    versor rotation = { 0.0f, 0.0f, 0.0f, 1.0f };
+    vec3 scaling = { 1.0f, 1.0f, 1.0f };
+
+    KeyRange range = anim->position_ranges[node];
+    if (range.count) {
+        const float* times = anim->position_times + range.first;
+        int k = find_key(times, range.count, time);
+        int next = k + 1 < range.count ? k + 1 : k;
+        glm_vec3_lerp((float*) anim->positions[range.first + k], (float*) anim->positions[range.first + next],
+                      key_factor(times, range.count, k, time), position);
     }
 
-    Matrix4f GlobalTransformation = ParentTransform * NodeTransformation;
+    range = anim->rotation_ranges[node];
+    if (range.count) {
+        const float* times = anim->rotation_times + range.first;
+        int k = find_key(times, range.count, time);
+        int next = k + 1 < range.count ? k + 1 : k;
+        glm_quat_slerp((float*) anim->rotations[range.first + k], (float*) anim->rotations[range.first + next],
+                       key_factor(times, range.count, k, time), rotation);
+        glm_quat_normalize(rotation);
+    }
 
-    if (m_BoneMapping.find(NodeName) != m_BoneMapping.end()) {
-        uint BoneIndex = m_BoneMapping[NodeName];
-        m_BoneInfo[BoneIndex].FinalTransformation = m_GlobalInverseTransform * GlobalTransformation *
-            m_BoneInfo[BoneIndex].BoneOffset;
+    range = anim->scaling_ranges[node];
+    if (range.count) {
+        const float* times = anim->scaling_times + range.first;
+        int k = find_key(times, range.count, time);
+        int next = k + 1 < range.count ? k + 1 : k;
+        glm_vec3_lerp((float*) anim->scalings[range.first + k], (float*) anim->scalings[range.first + next],
+                      key_factor(times, range.count, k, time), scaling);
     }
 
-    for (uint i = 0; i < pNode->mNumChildren; i++) {
-        ReadNodeHeirarchy(AnimationTime, pNode->mChildren[i], GlobalTransformation);
+    glm_quat_mat4(rotation, dest);
+    for (int c = 0; c < 3; c++) {
+        glm_vec4_scale(dest[c], scaling[c], dest[c]);
     }
+    dest[3][0] = position[0];
+    dest[3][1] = position[1];
+    dest[3][2] = position[2];
 }
 
-void Mesh::CalcInterpolatedRotation(aiQuaternion& Out, float AnimationTime, const aiNodeAnim* pNodeAnim)
+// Writes num_bones skinning matrices for the given animation at time (in
+// seconds, looping), or the bind pose when animation is out of range.
+void skinned_model_pose(SkinnedModel* model, int animation, float time, mat4* bone_matrices)
 {
-    // we need at least two values to interpolate...
-    if (pNodeAnim->mNumRotationKeys == 1) {
-        Out = pNodeAnim->mRotationKeys[0].mValue;
-        return;
-    }
-
-    uint RotationIndex = FindRotation(AnimationTime, pNodeAnim);
-    uint NextRotationIndex = (RotationIndex + 1);
-    assert(NextRotationIndex < pNodeAnim->mNumRotationKeys);
-    float DeltaTime = pNodeAnim->mRotationKeys[NextRotationIndex].mTime - pNodeAnim->mRotationKeys[RotationIndex].mTime;
-    float Factor = (AnimationTime - (float)pNodeAnim->mRotationKeys[RotationIndex].mTime) / DeltaTime;
-    assert(Factor >= 0.0f && Factor <= 1.0f);
-    const aiQuaternion& StartRotationQ = pNodeAnim->mRotationKeys[RotationIndex].mValue;
-    const aiQuaternion& EndRotationQ = pNodeAnim->mRotationKeys[NextRotationIndex].mValue;
-    aiQuaternion::Interpolate(Out, StartRotationQ, EndRotationQ, Factor);
-    Out = Out.Normalize();
-}
+    const SkeletalAnimation* anim = NULL;
+    float ticks = 0.0f;
+    if (animation >= 0 && animation < model->num_animations) {
+        anim = &model->animations[animation];
+        ticks = time * anim->ticks_per_second;
+        if (anim->duration > 0.0f) ticks = fmodf(ticks, anim->duration);
+    }
 
-uint Mesh::FindRotation(float AnimationTime, const aiNodeAnim* pNodeAnim)
-{
-    assert(pNodeAnim->mNumRotationKeys > 0);
+    for (int i = 0; i < model->num_nodes; i++) {
+        mat4 local;
+        if (anim && anim->animated[i]) {
+            animated_node_transform(anim, i, ticks, local);
+        } else {
+            glm_mat4_copy(model->node_transforms[i], local);
+        }
 
-    for (uint i = 0; i < pNodeAnim->mNumRotationKeys - 1; i++) {
-        if (AnimationTime < (float)pNodeAnim->mRotationKeys[i + 1].mTime) {
-            return i;
+        int parent = model->node_parent[i];
+        if (parent == -1) {
+            glm_mat4_copy(local, model->node_globals[i]);
+        } else {
+            glm_mat4_mul(model->node_globals[parent], local, model->node_globals[i]);
         }
     }
 
-    assert(0);
-}
\ No newline at end of file
+    for (int b = 0; b < model->num_bones; b++) {
+        mat4 bone;
+        glm_mat4_mul(model->node_globals[model->bone_node[b]], model->bone_offsets[b], bone);
+        glm_mat4_mul(model->global_inverse, bone, bone_matrices[b]);
+    }
+}
@@ -0,0 +1,460 @@
+// Wavefront OBJ parser working directly on a memory-mapped file.
+//
+// Only the parts of the format we render are understood (v, vn, vt, f),
+// every other statement is skipped. Faces can use any of the v, v/t, v//n
+// and v/t/n corner formats, negative (relative) indices, and polygons with
+// more than 3 corners, which get fan triangulated.
+//
+// The vertex/normal/texture coordinate arrays are 1-based like OBJ indices,
+// slot 0 is kept zeroed so that a face corner without a normal/texture
+// coordinate reads zeros. Faces are 0-based.
+//
+// Big files can be split at line boundaries and parsed by several threads
+// (see parse_obj_mapped). Each chunk only knows its own element counts, so
+// face indices are left unresolved while parsing and fixed up afterwards by
+// obj_resolve_faces, which is also what the serial path does, so both
+// produce the exact same File.
+
+#include <thread>
+
+static void* grow_array(void* ptr, int* cap, int needed, size_t elem_size)
+{
+    if (needed <= *cap) return ptr;
+
+    int new_cap = *cap ? *cap : 256;
+    while (new_cap < needed) new_cap *= 2;
+
+    ptr = realloc(ptr, new_cap * elem_size);
+    if (!ptr) abort();
+    *cap = new_cap;
+
+    return ptr;
+}
+
+#define FILE_PUSH(file, arr, num, cap) \
+    ((file)->arr = (decltype((file)->arr)) grow_array((file)->arr, &(file)->cap, (file)->num + 2, sizeof(*(file)->arr)), \
+     (file)->arr[++(file)->num])
+
+static inline bool obj_is_space(char c)
+{
+    return c == ' ' || c == '\t' || c == '\r';
+}
+
+static inline const char* obj_skip_space(const char* p, const char* end)
+{
+    while (p < end && obj_is_space(*p)) p++;
+    return p;
+}
+
+static inline const char* obj_skip_line(const char* p, const char* end)
+{
+    const char* nl = (const char*) memchr(p, '\n', end - p);
+    return nl ? nl + 1 : end;
+}
+
+// Hand-written replacement for strtof, about an order of magnitude faster
+// since it does no locale handling. Accepts [+-]digits[.digits][(e|E)[+-]digits].
+static const char* obj_parse_float(const char* p, const char* end, float* out)
+{
+    static const double pow10[] = {
+        1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+        1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+
+    p = obj_skip_space(p, end);
+
+    bool negative = false;
+    if (p < end && (*p == '-' || *p == '+')) {
+        negative = *p == '-';
+        p++;
+    }
+
+    unsigned long long mantissa = 0;
+    int num_digits = 0;
+    int exponent = 0;
+
+    while (p < end && *p >= '0' && *p <= '9') {
+        // digits past what fits in the mantissa only scale the value
+        if (num_digits < 18) {
+            mantissa = mantissa * 10 + (*p - '0');
+            if (mantissa) num_digits++;
+        } else {
+            exponent++;
+        }
+        p++;
+    }
+
+    if (p < end && *p == '.') {
+        p++;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (num_digits < 18) {
+                mantissa = mantissa * 10 + (*p - '0');
+                if (mantissa) num_digits++;
+                exponent--;
+            }
+            p++;
+        }
+    }
+
+    if (p < end && (*p == 'e' || *p == 'E')) {
+        p++;
+        bool exp_negative = false;
+        if (p < end && (*p == '-' || *p == '+')) {
+            exp_negative = *p == '-';
+            p++;
+        }
+        int e = 0;
+        while (p < end && *p >= '0' && *p <= '9') {
+            if (e < 10000) e = e * 10 + (*p - '0');
+            p++;
+        }
+        exponent += exp_negative ? -e : e;
+    }
+
+    double value = (double) mantissa;
+    if (exponent < 0) {
+        value = -exponent <= 22 ? value / pow10[-exponent] : value * pow(10.0, exponent);
+    } else if (exponent > 0) {
+        value = exponent <= 22 ? value * pow10[exponent] : value * pow(10.0, exponent);
+    }
+
+    *out = (float) (negative ? -value : value);
+    return p;
+}
+
+static inline const char* obj_parse_int(const char* p, const char* end, int* out)
+{
+    bool negative = false;
+    if (p < end && *p == '-') {
+        negative = true;
+        p++;
+    }
+
+    int value = 0;
+    while (p < end && *p >= '0' && *p <= '9') {
+        value = value * 10 + (*p - '0');
+        p++;
+    }
+
+    *out = negative ? -value : value;
+    return p;
+}
+
+// Relative (negative) OBJ indices are stored as an index into the chunk
+// being parsed, shifted by this bias to tell them apart from absolute ones.
+// The chunk-local index can be <= 0 when it points into a previous chunk.
+#define OBJ_RELATIVE_BIAS (1 << 30)
+
+static inline int obj_encode_index(int idx, int chunk_count)
+{
+    if (idx < 0) return chunk_count + idx + 1 - OBJ_RELATIVE_BIAS;
+    return idx;
+}
+
+// Turns an encoded index into a File array slot, 0 meaning missing/invalid.
+static inline int obj_resolve_index(int idx, int base, int total)
+{
+    if (idx < 0) idx += OBJ_RELATIVE_BIAS + base;
+    return (idx > 0 && idx <= total) ? idx : 0;
+}
+
+static const char* obj_parse_face(const char* p, const char* end, File* file)
+{
+    int corner_v[3], corner_t[3], corner_n[3];
+    int num_corners = 0;
+
+    for (;;) {
+        p = obj_skip_space(p, end);
+        if (p >= end || *p == '\n' || *p == '#') break;
+
+        int v = 0, t = 0, n = 0;
+        p = obj_parse_int(p, end, &v);
+        if (p < end && *p == '/') {
+            p++;
+            if (p < end && *p != '/') {
+                p = obj_parse_int(p, end, &t);
+                file->faces_have_texture_coords = true;
+            }
+            if (p < end && *p == '/') {
+                p++;
+                p = obj_parse_int(p, end, &n);
+                file->faces_have_normals = true;
+            }
+        }
+
+        // garbage in the corner list, give up on the rest of the line
+        if (p < end && !obj_is_space(*p) && *p != '\n') break;
+
+        v = obj_encode_index(v, file->num_vertices);
+        t = obj_encode_index(t, file->num_texture_coords);
+        n = obj_encode_index(n, file->num_normals);
+
+        // fan triangulation: (0, i-1, i)
+        if (num_corners < 2) {
+            corner_v[num_corners] = v;
+            corner_t[num_corners] = t;
+            corner_n[num_corners] = n;
+        } else {
+            corner_v[2] = v;
+            corner_t[2] = t;
+            corner_n[2] = n;
+
+            file->faces = (Face*) grow_array(file->faces, &file->cap_faces, file->num_faces + 1, sizeof(Face));
+            Face& face = file->faces[file->num_faces++];
+            for (int i = 0; i < 3; i++) {
+                face.vertices[i] = corner_v[i];
+                face.texture_coords[i] = corner_t[i];
+                face.normals[i] = corner_n[i];
+            }
+
+            corner_v[1] = corner_v[2];
+            corner_t[1] = corner_t[2];
+            corner_n[1] = corner_n[2];
+        }
+        num_corners++;
+    }
+
+    return p;
+}
+
+// Parses OBJ text in [p, end) appending to file, which must already hold
+// the zeroed slot 0 of every array (see obj_file_init). Face indices are
+// left encoded until obj_resolve_faces is called.
+void parse_obj_buffer(const char* p, const char* end, File* file)
+{
+    while (p < end) {
+        p = obj_skip_space(p, end);
+        if (p >= end) break;
+
+        if (p[0] == 'v' && p + 1 < end) {
+            if (obj_is_space(p[1])) {
+                float* v = FILE_PUSH(file, vertices, num_vertices, cap_vertices);
+                p = obj_parse_float(p + 2, end, &v[0]);
+                p = obj_parse_float(p, end, &v[1]);
+                p = obj_parse_float(p, end, &v[2]);
+            } else if (p[1] == 'n' && p + 2 < end && obj_is_space(p[2])) {
+                float* n = FILE_PUSH(file, normals, num_normals, cap_normals);
+                p = obj_parse_float(p + 3, end, &n[0]);
+                p = obj_parse_float(p, end, &n[1]);
+                p = obj_parse_float(p, end, &n[2]);
+            } else if (p[1] == 't' && p + 2 < end && obj_is_space(p[2])) {
+                float* t = FILE_PUSH(file, texture_coords, num_texture_coords, cap_texture_coords);
+                p = obj_parse_float(p + 3, end, &t[0]);
+                p = obj_parse_float(p, end, &t[1]);
+            }
+        } else if (p[0] == 'f' && p + 1 < end && obj_is_space(p[1])) {
+            p = obj_parse_face(p + 2, end, file);
+        }
+
+        p = obj_skip_line(p, end);
+    }
+}
+
+void obj_file_init(File* file)
+{
+    *file = {};
+    file->vertices = (vec3*) grow_array(NULL, &file->cap_vertices, 1, sizeof(vec3));
+    file->normals = (vec3*) grow_array(NULL, &file->cap_normals, 1, sizeof(vec3));
+    file->texture_coords = (vec2*) grow_array(NULL, &file->cap_texture_coords, 1, sizeof(vec2));
+    file->faces = (Face*) grow_array(NULL, &file->cap_faces, 1, sizeof(Face));
+    memset(file->vertices[0], 0, sizeof(vec3));
+    memset(file->normals[0], 0, sizeof(vec3));
+    memset(file->texture_coords[0], 0, sizeof(vec2));
+}
+
+void obj_file_free(File* file)
+{
+    free(file->vertices);
+    free(file->faces);
+    free(file->normals);
+    free(file->texture_coords);
+    *file = {};
+}
+
+FaceType obj_file_face_type(File* file)
+{
+    if (file->faces_have_texture_coords) return VERTEX_TEXTURE;
+    if (file->faces_have_normals) return VERTEX_NORMAL;
+    return VERTEX_ONLY;
+}
+
+// Resolves the encoded indices of faces [first, first + count), which were
+// parsed in a chunk whose elements start after the given bases.
+static void obj_resolve_faces(File* file, int first, int count,
+                              int base_vertices, int base_normals,
+                              int base_texture_coords)
+{
+    for (int i = first; i < first + count; i++) {
+        Face* face = &file->faces[i];
+        for (int j = 0; j < 3; j++) {
+            face->vertices[j] = obj_resolve_index(face->vertices[j], base_vertices,
+                                                  file->num_vertices);
+            face->normals[j] = obj_resolve_index(face->normals[j], base_normals,
+                                                 file->num_normals);
+            face->texture_coords[j] = obj_resolve_index(face->texture_coords[j], base_texture_coords,
+                                                        file->num_texture_coords);
+        }
+    }
+}
+
+// Parses a whole OBJ buffer into file using num_threads chunks split at line
+// boundaries. The chunks are parsed into their own File and stitched back
+// together in order, so the result does not depend on num_threads.
+void parse_obj_mapped(const char* data, size_t size, File* file, int num_threads)
+{
+    obj_file_init(file);
+
+    if (num_threads <= 1) {
+        parse_obj_buffer(data, data + size, file);
+        obj_resolve_faces(file, 0, file->num_faces, 0, 0, 0);
+        return;
+    }
+
+    const char** bounds = (const char**) malloc((num_threads + 1) * sizeof(*bounds));
+    bounds[0] = data;
+    for (int i = 1; i < num_threads; i++) {
+        const char* p = data + size * i / num_threads;
+        if (p < bounds[i - 1]) p = bounds[i - 1];
+        // every chunk starts right after a newline
+        bounds[i] = p > data ? obj_skip_line(p - 1, data + size) : data;
+    }
+    bounds[num_threads] = data + size;
+
+    File* chunks = (File*) malloc(num_threads * sizeof(File));
+    std::thread* workers = new std::thread[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        obj_file_init(&chunks[i]);
+        if (i == 0) continue;
+        workers[i] = std::thread(parse_obj_buffer, bounds[i], bounds[i + 1], &chunks[i]);
+    }
+    parse_obj_buffer(bounds[0], bounds[1], &chunks[0]);
+    for (int i = 1; i < num_threads; i++) {
+        workers[i].join();
+    }
+
+    int total_vertices = 0, total_normals = 0, total_texture_coords = 0, total_faces = 0;
+    for (int i = 0; i < num_threads; i++) {
+        total_vertices += chunks[i].num_vertices;
+        total_normals += chunks[i].num_normals;
+        total_texture_coords += chunks[i].num_texture_coords;
+        total_faces += chunks[i].num_faces;
+        file->faces_have_normals |= chunks[i].faces_have_normals;
+        file->faces_have_texture_coords |= chunks[i].faces_have_texture_coords;
+    }
+
+    file->vertices = (vec3*) grow_array(file->vertices, &file->cap_vertices, total_vertices + 1, sizeof(vec3));
+    file->normals = (vec3*) grow_array(file->normals, &file->cap_normals, total_normals + 1, sizeof(vec3));
+    file->texture_coords = (vec2*) grow_array(file->texture_coords, &file->cap_texture_coords, total_texture_coords + 1, sizeof(vec2));
+    file->faces = (Face*) grow_array(file->faces, &file->cap_faces, total_faces, sizeof(Face));
+    file->num_vertices = total_vertices;
+    file->num_normals = total_normals;
+    file->num_texture_coords = total_texture_coords;
+
+    int base_vertices = 0, base_normals = 0, base_texture_coords = 0;
+    for (int i = 0; i < num_threads; i++) {
+        File* chunk = &chunks[i];
+
+        memcpy(file->vertices[base_vertices + 1], chunk->vertices[1], chunk->num_vertices * sizeof(vec3));
+        memcpy(file->normals[base_normals + 1], chunk->normals[1], chunk->num_normals * sizeof(vec3));
+        memcpy(file->texture_coords[base_texture_coords + 1], chunk->texture_coords[1],
+               chunk->num_texture_coords * sizeof(vec2));
+        memcpy(&file->faces[file->num_faces], chunk->faces, chunk->num_faces * sizeof(Face));
+
+        obj_resolve_faces(file, file->num_faces, chunk->num_faces,
+                          base_vertices, base_normals, base_texture_coords);
+
+        file->num_faces += chunk->num_faces;
+        base_vertices += chunk->num_vertices;
+        base_normals += chunk->num_normals;
+        base_texture_coords += chunk->num_texture_coords;
+
+        obj_file_free(chunk);
+    }
+
+    delete[] workers;
+    free(chunks);
+    free(bounds);
+}
+
+static int obj_parse_thread_count(size_t size, int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+
+    // not worth spawning threads for small chunks
+    int max_threads = (int) (size / OBJ_PARSE_MIN_CHUNK_SIZE);
+    if (num_threads > max_threads) num_threads = max_threads;
+
+    return num_threads > 1 ? num_threads : 1;
+}
+
+// num_threads <= 0 uses one thread per core. Files smaller than
+// OBJ_PARSE_MIN_CHUNK_SIZE per thread are parsed with fewer threads.
+bool parse_obj_file(const char* filename, File* file, int num_threads)
+{
+    double start = glfwGetTime();
+
+    MappedFile mapped = map_file(filename);
+    if (!mapped.data) {
+        fprintf(stderr, "Error: could not open '%s'\n", filename);
+        return false;
+    }
+
+    num_threads = obj_parse_thread_count(mapped.size, num_threads);
+    parse_obj_mapped(mapped.data, mapped.size, file, num_threads);
+
+    double elapsed = glfwGetTime() - start;
+    double mb = mapped.size / (1024.0 * 1024.0);
+    printf("Parsed '%s': %d vertices, %d faces, %.2f MB in %.2f ms (%.1f MB/s, %d thread%s)\n",
+           filename, file->num_vertices, file->num_faces, mb, elapsed * 1000.0,
+           elapsed > 0.0 ? mb / elapsed : 0.0, num_threads, num_threads > 1 ? "s" : "");
+
+    unmap_file(&mapped);
+    return true;
+}
+
+static bool obj_files_equal(File* a, File* b)
+{
+    return a->num_vertices == b->num_vertices &&
+           a->num_normals == b->num_normals &&
+           a->num_texture_coords == b->num_texture_coords &&
+           a->num_faces == b->num_faces &&
+           a->faces_have_normals == b->faces_have_normals &&
+           a->faces_have_texture_coords == b->faces_have_texture_coords &&
+           !memcmp(a->vertices, b->vertices, (a->num_vertices + 1) * sizeof(vec3)) &&
+           !memcmp(a->normals, b->normals, (a->num_normals + 1) * sizeof(vec3)) &&
+           !memcmp(a->texture_coords, b->texture_coords, (a->num_texture_coords + 1) * sizeof(vec2)) &&
+           !memcmp(a->faces, b->faces, a->num_faces * sizeof(Face));
+}
+
+// Parses filename serially and split in num_threads chunks (regardless of
+// OBJ_PARSE_MIN_CHUNK_SIZE) and checks that both give the same File.
+bool check_obj_parse_determinism(const char* filename, int num_threads)
+{
+    MappedFile mapped = map_file(filename);
+    if (!mapped.data) {
+        fprintf(stderr, "Error: could not open '%s'\n", filename);
+        return false;
+    }
+
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency();
+    }
+
+    File serial, parallel;
+    parse_obj_mapped(mapped.data, mapped.size, &serial, 1);
+    parse_obj_mapped(mapped.data, mapped.size, &parallel, num_threads);
+
+    bool equal = obj_files_equal(&serial, &parallel);
+    if (!equal) {
+        fprintf(stderr, "Error: '%s' parsed with %d threads differs from the serial parse!\n",
+                filename, num_threads);
+    }
+
+    obj_file_free(&serial);
+    obj_file_free(&parallel);
+    unmap_file(&mapped);
+
+    return equal;
+}
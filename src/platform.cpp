@@ -0,0 +1,89 @@
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+// Maps a whole file read-only into memory. On failure the returned
+// MappedFile has data == NULL.
+MappedFile map_file(const char *path)
+{
+    MappedFile file = {};
+
+#ifdef _WIN32
+    HANDLE handle = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, NULL,
+                                OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (handle == INVALID_HANDLE_VALUE) return file;
+
+    LARGE_INTEGER size;
+    if (!GetFileSizeEx(handle, &size) || size.QuadPart == 0) {
+        CloseHandle(handle);
+        return file;
+    }
+
+    HANDLE mapping = CreateFileMappingA(handle, NULL, PAGE_READONLY, 0, 0, NULL);
+    CloseHandle(handle);
+    if (!mapping) return file;
+
+    file.data = (char*) MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+    CloseHandle(mapping);
+    if (file.data) file.size = (size_t) size.QuadPart;
+#else
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return file;
+
+    struct stat st;
+    if (fstat(fd, &st) < 0 || st.st_size == 0) {
+        close(fd);
+        return file;
+    }
+
+    void *ptr = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    // the mapping keeps its own reference to the file
+    close(fd);
+    if (ptr == MAP_FAILED) return file;
+
+    // we always read these front to back
+    madvise(ptr, st.st_size, MADV_SEQUENTIAL);
+
+    file.data = (char*) ptr;
+    file.size = st.st_size;
+#endif
+
+    return file;
+}
+
+void unmap_file(MappedFile *file)
+{
+    if (!file->data) return;
+
+#ifdef _WIN32
+    UnmapViewOfFile(file->data);
+#else
+    munmap((void*) file->data, file->size);
+#endif
+
+    file->data = NULL;
+    file->size = 0;
+}
+
+// Size and modification time of a file, used to tell whether derived data
+// (like baked meshes) is out of date.
+bool file_stat(const char *path, long long *size, long long *mtime)
+{
+#ifdef _WIN32
+    WIN32_FILE_ATTRIBUTE_DATA attr;
+    if (!GetFileAttributesExA(path, GetFileExInfoStandard, &attr)) return false;
+    *size = ((long long) attr.nFileSizeHigh << 32) | attr.nFileSizeLow;
+    *mtime = ((long long) attr.ftLastWriteTime.dwHighDateTime << 32) | attr.ftLastWriteTime.dwLowDateTime;
+#else
+    struct stat st;
+    if (stat(path, &st) < 0) return false;
+    *size = st.st_size;
+    *mtime = st.st_mtime;
+#endif
+    return true;
+}
@@ -0,0 +1,190 @@
+// Draw ordering and redundant GL state filtering for scene passes.
+//
+// Every object of a pass becomes a DrawItem with a 64-bit sort key, most
+// significant field first:
+//
+//   pass:1 program:7 material:16 mesh:16 lod:4 type:4 depth:16
+//
+// so after sorting, draws sharing a program, textures and a mesh are next
+// to each other and each run is drawn front to back. The items are radix
+// sorted, which is stable, so equal keys keep the scene order. Fields are
+// truncated to their widths, so different meshes or textures can share a
+// key: keys only order draws, draw_items_merge checks the objects too.
+//
+// The GL state cache remembers the program, VAO, textures, face culling
+// and uniform buffer ranges it last bound and skips binds that are
+// already current. It only sees binds that go through it: call
+// gl_state_invalidate after other code may have changed that state.
+
+#define DRAW_KEY_DEPTH_BITS 16
+// the part of the key shared by all instances of one draw
+#define DRAW_KEY_GROUP_MASK (~(uint64_t) 0 << DRAW_KEY_DEPTH_BITS)
+
+struct DrawItem {
+    uint64_t key;
+    int object;
+};
+
+// consecutive sorted items drawn together
+struct DrawGroup {
+    int first;
+    int count;
+};
+
+// Whether two sorted items can be instances of one draw. objects are what
+// the items' object fields index.
+static inline bool draw_items_merge(DrawItem* a, DrawItem* b, Object** objects)
+{
+#ifdef MULTI_DRAW_BENCHMARK
+    return false; // every object is its own draw
+#else
+    Object* obj_a = objects[a->object];
+    Object* obj_b = objects[b->object];
+    return (a->key & DRAW_KEY_GROUP_MASK) == (b->key & DRAW_KEY_GROUP_MASK) &&
+           obj_a->model_id == obj_b->model_id && obj_a->lod == obj_b->lod && obj_a->type == obj_b->type;
+#endif
+}
+
+uint64_t draw_sort_key(RenderPass pass, GLuint program, GLuint material, ModelHandle mesh,
+                       int lod, ObjectType type, float depth)
+{
+    // quantize the view distance, keys sort nearest first
+    float d = depth / FAR_PLANE;
+    d = d < 0.0f ? 0.0f : d > 1.0f ? 1.0f : d;
+    uint64_t depth_bits = (uint64_t) (d * ((1 << DRAW_KEY_DEPTH_BITS) - 1));
+
+    return ((uint64_t) (pass & 0x1) << 63)
+         | ((uint64_t) (program & 0x7f) << 56)
+         | ((uint64_t) (material & 0xffff) << 40)
+         | ((uint64_t) (mesh & 0xffff) << 24)
+         | ((uint64_t) (lod & 0xf) << 20)
+         | ((uint64_t) (type & 0xf) << 16)
+         | depth_bits;
+}
+
+// LSD radix sort on 8-bit digits. tmp must hold count items. Digits that
+// are the same for every item (most of the key within a pass) are skipped.
+void radix_sort_draw_items(DrawItem* items, DrawItem* tmp, int count)
+{
+    int histograms[8][256] = {};
+    for (int i = 0; i < count; i++) {
+        uint64_t key = items[i].key;
+        for (int digit = 0; digit < 8; digit++) {
+            histograms[digit][(key >> (digit * 8)) & 0xff]++;
+        }
+    }
+
+    DrawItem* src = items;
+    DrawItem* dst = tmp;
+    for (int digit = 0; digit < 8; digit++) {
+        int* histogram = histograms[digit];
+        if (count == 0 || histogram[(src[0].key >> (digit * 8)) & 0xff] == count) continue;
+
+        int offset = 0;
+        for (int b = 0; b < 256; b++) {
+            int n = histogram[b];
+            histogram[b] = offset;
+            offset += n;
+        }
+        for (int i = 0; i < count; i++) {
+            dst[histogram[(src[i].key >> (digit * 8)) & 0xff]++] = src[i];
+        }
+
+        DrawItem* swap = src;
+        src = dst;
+        dst = swap;
+    }
+
+    if (src != items) memcpy(items, src, count * sizeof(DrawItem));
+}
+
+#define GL_STATE_TEXTURE_UNITS 4
+
+struct GLStateCache {
+    bool valid;
+    GLuint program;
+    GLuint vao;
+    GLenum active_texture;
+    GLuint textures[GL_STATE_TEXTURE_UNITS];
+    GLenum cull_face;
+    GLuint uniform_buffers[UNIFORM_BLOCK_COUNT];
+    GLintptr uniform_offsets[UNIFORM_BLOCK_COUNT];
+    GLsizeiptr uniform_sizes[UNIFORM_BLOCK_COUNT];
+};
+
+static GLStateCache gl_state;
+
+void gl_state_invalidate()
+{
+    gl_state.valid = false;
+}
+
+// Called by every bind below: forgets the cached state if it was
+// invalidated and counts the bind as issued or skipped.
+static bool gl_state_changed(bool current)
+{
+    if (!gl_state.valid) {
+        memset(&gl_state, 0, sizeof(gl_state));
+        gl_state.active_texture = GL_INVALID_ENUM;
+        gl_state.cull_face = GL_INVALID_ENUM;
+        gl_state.program = gl_state.vao = (GLuint) -1;
+        for (int i = 0; i < GL_STATE_TEXTURE_UNITS; i++) gl_state.textures[i] = (GLuint) -1;
+        for (int i = 0; i < UNIFORM_BLOCK_COUNT; i++) gl_state.uniform_buffers[i] = (GLuint) -1;
+        gl_state.valid = true;
+        current = false;
+    }
+#ifndef GL_STATE_CACHE
+    current = false;
+#endif
+    if (current) {
+        state_changes_skipped++;
+        return false;
+    }
+    state_changes++;
+    return true;
+}
+
+void gl_state_use_program(GLuint program)
+{
+    if (!gl_state_changed(gl_state.valid && gl_state.program == program)) return;
+    glUseProgram(program);
+    gl_state.program = program;
+}
+
+void gl_state_bind_vertex_array(GLuint vao)
+{
+    if (!gl_state_changed(gl_state.valid && gl_state.vao == vao)) return;
+    glBindVertexArray(vao);
+    gl_state.vao = vao;
+}
+
+void gl_state_bind_texture(GLuint unit, GLenum target, GLuint texture)
+{
+    assert(unit < GL_STATE_TEXTURE_UNITS);
+    if (!gl_state_changed(gl_state.valid && gl_state.textures[unit] == texture)) return;
+    if (gl_state.active_texture != GL_TEXTURE0 + unit) {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        gl_state.active_texture = GL_TEXTURE0 + unit;
+    }
+    glBindTexture(target, texture);
+    gl_state.textures[unit] = texture;
+}
+
+void gl_state_cull_face(GLenum mode)
+{
+    if (!gl_state_changed(gl_state.valid && gl_state.cull_face == mode)) return;
+    glEnable(GL_CULL_FACE);
+    glCullFace(mode);
+    gl_state.cull_face = mode;
+}
+
+void gl_state_bind_uniform_range(UniformBlock block, GLuint buffer, GLintptr offset, GLsizeiptr size)
+{
+    bool current = gl_state.valid && gl_state.uniform_buffers[block] == buffer
+                && gl_state.uniform_offsets[block] == offset && gl_state.uniform_sizes[block] == size;
+    if (!gl_state_changed(current)) return;
+    glBindBufferRange(GL_UNIFORM_BUFFER, block, buffer, offset, size);
+    gl_state.uniform_buffers[block] = buffer;
+    gl_state.uniform_offsets[block] = offset;
+    gl_state.uniform_sizes[block] = size;
+}
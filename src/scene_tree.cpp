@@ -0,0 +1,609 @@
+// Dynamic AABB tree over the objects of a scene, used for culling and
+// gameplay queries.
+//
+// Each leaf holds one object, its box is the object's bounding sphere
+// enlarged by SCENE_TREE_MARGIN. Inserting descends to the sibling that
+// grows the tree's surface area least and rebalances with rotations on the
+// way back up; removing replaces the leaf's parent with its sibling.
+//
+// Moving objects don't restructure the tree: once an object leaves its box,
+// the leaf gets a new box and its ancestors are refitted around it. That
+// slowly makes the tree worse, so scene_tree_maintain rebuilds it top-down
+// with binned SAH once the internal nodes' surface area has grown by
+// SCENE_TREE_REBUILD_RATIO. Objects keep their leaf across rebuilds.
+
+#include <float.h>
+
+#define SCENE_TREE_SAH_BINS 16
+
+static float aabb_area(AABB* box)
+{
+    float dx = box->max[0] - box->min[0];
+    float dy = box->max[1] - box->min[1];
+    float dz = box->max[2] - box->min[2];
+    return 2.0f * (dx * dy + dy * dz + dz * dx);
+}
+
+static void aabb_union(AABB* a, AABB* b, AABB* out)
+{
+    glm_vec3_minv(a->min, b->min, out->min);
+    glm_vec3_maxv(a->max, b->max, out->max);
+}
+
+static bool aabb_contains(AABB* outer, AABB* inner)
+{
+    return outer->min[0] <= inner->min[0] && outer->min[1] <= inner->min[1] && outer->min[2] <= inner->min[2]
+        && outer->max[0] >= inner->max[0] && outer->max[1] >= inner->max[1] && outer->max[2] >= inner->max[2];
+}
+
+static void object_aabb(Object* obj, float margin, AABB* out)
+{
+    float r = obj->world_radius + margin;
+    for (int i = 0; i < 3; i++) {
+        out->min[i] = obj->world_center[i] - r;
+        out->max[i] = obj->world_center[i] + r;
+    }
+}
+
+void scene_tree_init(SceneTree* tree, int capacity)
+{
+    memset(tree, 0, sizeof(*tree));
+    tree->root = -1;
+    tree->free_list = -1;
+    tree->capacity = capacity < 16 ? 16 : capacity;
+    tree->nodes = (SceneTreeNode*) malloc(tree->capacity * sizeof(SceneTreeNode));
+    for (int i = tree->capacity - 1; i >= 0; i--) {
+        tree->nodes[i].height = -1;
+        tree->nodes[i].parent = tree->free_list;
+        tree->free_list = i;
+    }
+}
+
+void scene_tree_free(SceneTree* tree)
+{
+    for (int i = 0; i < tree->capacity; i++) {
+        if (tree->nodes[i].height == 0) tree->nodes[i].object->tree_leaf = -1;
+    }
+    free(tree->nodes);
+    memset(tree, 0, sizeof(*tree));
+    tree->root = -1;
+}
+
+// May move the nodes, don't keep pointers to them across this.
+static int tree_alloc_node(SceneTree* tree)
+{
+    if (tree->free_list == -1) {
+        int old_capacity = tree->capacity;
+        tree->capacity *= 2;
+        tree->nodes = (SceneTreeNode*) realloc(tree->nodes, tree->capacity * sizeof(SceneTreeNode));
+        for (int i = tree->capacity - 1; i >= old_capacity; i--) {
+            tree->nodes[i].height = -1;
+            tree->nodes[i].parent = tree->free_list;
+            tree->free_list = i;
+        }
+    }
+    int index = tree->free_list;
+    SceneTreeNode* node = &tree->nodes[index];
+    tree->free_list = node->parent;
+    node->parent = -1;
+    node->children[0] = node->children[1] = -1;
+    node->height = 0;
+    node->object = NULL;
+    return index;
+}
+
+static void tree_free_node(SceneTree* tree, int index)
+{
+    tree->nodes[index].height = -1;
+    tree->nodes[index].parent = tree->free_list;
+    tree->free_list = index;
+}
+
+static void tree_replace_child(SceneTree* tree, int parent, int old_child, int new_child)
+{
+    if (parent == -1) {
+        tree->root = new_child;
+        return;
+    }
+    SceneTreeNode* node = &tree->nodes[parent];
+    if (node->children[0] == old_child) node->children[0] = new_child;
+    else node->children[1] = new_child;
+}
+
+static void tree_fit_node(SceneTree* tree, int index)
+{
+    SceneTreeNode* node = &tree->nodes[index];
+    SceneTreeNode* a = &tree->nodes[node->children[0]];
+    SceneTreeNode* b = &tree->nodes[node->children[1]];
+    aabb_union(&a->box, &b->box, &node->box);
+    node->height = 1 + (a->height > b->height ? a->height : b->height);
+}
+
+// If one child of a is more than one level taller than the other, rotates
+// it up to replace a. Returns the node now in a's place.
+static int tree_balance(SceneTree* tree, int a)
+{
+    SceneTreeNode* nodes = tree->nodes;
+    if (nodes[a].height < 2) return a;
+
+    int b = nodes[a].children[0];
+    int c = nodes[a].children[1];
+    int balance = nodes[c].height - nodes[b].height;
+    if (balance >= -1 && balance <= 1) return a;
+
+    // the taller child goes up, a takes its place and keeps the taller of
+    // its grandchildren away from the other child
+    int up = balance > 1 ? c : b;
+    int keep_side = balance > 1 ? 1 : 0; // the side of a that up was on
+    int f = nodes[up].children[0];
+    int g = nodes[up].children[1];
+
+    nodes[up].children[0] = a;
+    nodes[up].parent = nodes[a].parent;
+    nodes[a].parent = up;
+    tree_replace_child(tree, nodes[up].parent, a, up);
+
+    int taller = nodes[f].height > nodes[g].height ? f : g;
+    int shorter = taller == f ? g : f;
+    nodes[up].children[1] = taller;
+    nodes[a].children[keep_side] = shorter;
+    nodes[shorter].parent = a;
+
+    tree_fit_node(tree, a);
+    tree_fit_node(tree, up);
+    return up;
+}
+
+// Refits and rebalances from index to the root.
+static void tree_fix_upwards(SceneTree* tree, int index)
+{
+    while (index != -1) {
+        index = tree_balance(tree, index);
+        tree_fit_node(tree, index);
+        index = tree->nodes[index].parent;
+    }
+}
+
+static void tree_insert_leaf(SceneTree* tree, int leaf)
+{
+    if (tree->root == -1) {
+        tree->root = leaf;
+        tree->nodes[leaf].parent = -1;
+        return;
+    }
+
+    // descend while pushing the leaf further down is cheaper than pairing
+    // it with the current node
+    AABB leaf_box = tree->nodes[leaf].box;
+    int index = tree->root;
+    while (tree->nodes[index].height > 0) {
+        SceneTreeNode* node = &tree->nodes[index];
+        AABB combined;
+        aabb_union(&node->box, &leaf_box, &combined);
+        float combined_area = aabb_area(&combined);
+        float cost = 2.0f * combined_area;
+        float inheritance = 2.0f * (combined_area - aabb_area(&node->box));
+
+        float child_cost[2];
+        for (int i = 0; i < 2; i++) {
+            SceneTreeNode* child = &tree->nodes[node->children[i]];
+            aabb_union(&child->box, &leaf_box, &combined);
+            child_cost[i] = aabb_area(&combined) + inheritance;
+            if (child->height > 0) child_cost[i] -= aabb_area(&child->box);
+        }
+
+        if (cost < child_cost[0] && cost < child_cost[1]) break;
+        index = child_cost[0] < child_cost[1] ? node->children[0] : node->children[1];
+    }
+
+    int sibling = index;
+    int old_parent = tree->nodes[sibling].parent;
+    int parent = tree_alloc_node(tree);
+    SceneTreeNode* nodes = tree->nodes;
+    nodes[parent].parent = old_parent;
+    nodes[parent].children[0] = sibling;
+    nodes[parent].children[1] = leaf;
+    nodes[sibling].parent = parent;
+    nodes[leaf].parent = parent;
+    tree_replace_child(tree, old_parent, sibling, parent);
+
+    tree_fix_upwards(tree, parent);
+}
+
+static void tree_remove_leaf(SceneTree* tree, int leaf)
+{
+    if (leaf == tree->root) {
+        tree->root = -1;
+        return;
+    }
+
+    SceneTreeNode* nodes = tree->nodes;
+    int parent = nodes[leaf].parent;
+    int grandparent = nodes[parent].parent;
+    int sibling = nodes[parent].children[0] == leaf ? nodes[parent].children[1] : nodes[parent].children[0];
+
+    tree_replace_child(tree, grandparent, parent, sibling);
+    nodes[sibling].parent = grandparent;
+    tree_free_node(tree, parent);
+    tree_fix_upwards(tree, grandparent);
+}
+
+// obj's bounds must be up to date, see object_update_bounds.
+void scene_tree_insert(SceneTree* tree, Object* obj)
+{
+    assert(obj->tree_leaf == -1);
+    int leaf = tree_alloc_node(tree);
+    SceneTreeNode* node = &tree->nodes[leaf];
+    node->object = obj;
+    object_aabb(obj, SCENE_TREE_MARGIN, &node->box);
+    obj->tree_leaf = leaf;
+    tree->num_leaves++;
+    tree_insert_leaf(tree, leaf);
+}
+
+void scene_tree_remove(SceneTree* tree, Object* obj)
+{
+    tree_remove_leaf(tree, obj->tree_leaf);
+    tree_free_node(tree, obj->tree_leaf);
+    obj->tree_leaf = -1;
+    tree->num_leaves--;
+}
+
+// Call after obj moved, once its bounds are updated. Nothing changes while
+// it stays inside its leaf's box.
+void scene_tree_update(SceneTree* tree, Object* obj)
+{
+    AABB tight;
+    object_aabb(obj, 0.0f, &tight);
+    SceneTreeNode* leaf = &tree->nodes[obj->tree_leaf];
+    if (aabb_contains(&leaf->box, &tight)) return;
+
+    object_aabb(obj, SCENE_TREE_MARGIN, &leaf->box);
+    for (int index = leaf->parent; index != -1; index = tree->nodes[index].parent) {
+        SceneTreeNode* node = &tree->nodes[index];
+        AABB box;
+        aabb_union(&tree->nodes[node->children[0]].box, &tree->nodes[node->children[1]].box, &box);
+        // the ancestors above already contain this box
+        if (memcmp(&box, &node->box, sizeof(box)) == 0) break;
+        node->box = box;
+    }
+}
+
+// Sum of the internal nodes' surface areas, proportional to the expected
+// cost of a query.
+float scene_tree_cost(SceneTree* tree)
+{
+    float cost = 0.0f;
+    for (int i = 0; i < tree->capacity; i++) {
+        if (tree->nodes[i].height > 0) cost += aabb_area(&tree->nodes[i].box);
+    }
+    return cost;
+}
+
+static float leaf_centroid(SceneTree* tree, int leaf, int axis)
+{
+    AABB* box = &tree->nodes[leaf].box;
+    return 0.5f * (box->min[axis] + box->max[axis]);
+}
+
+// Builds a subtree over count leaves, reordering them, and returns its root.
+static int tree_build(SceneTree* tree, int* leaves, int count, int parent)
+{
+    if (count == 1) {
+        tree->nodes[leaves[0]].parent = parent;
+        return leaves[0];
+    }
+
+    // split along the longest axis of the leaves' centroids
+    vec3 cmin = { FLT_MAX, FLT_MAX, FLT_MAX }, cmax = { -FLT_MAX, -FLT_MAX, -FLT_MAX };
+    for (int i = 0; i < count; i++) {
+        for (int axis = 0; axis < 3; axis++) {
+            float c = leaf_centroid(tree, leaves[i], axis);
+            if (c < cmin[axis]) cmin[axis] = c;
+            if (c > cmax[axis]) cmax[axis] = c;
+        }
+    }
+    int axis = 0;
+    for (int i = 1; i < 3; i++) {
+        if (cmax[i] - cmin[i] > cmax[axis] - cmin[axis]) axis = i;
+    }
+    float extent = cmax[axis] - cmin[axis];
+
+    int mid = count / 2;
+    if (extent > 0.0f) {
+        // bin the centroids and pick the bin boundary with the lowest
+        // count * area on both sides
+        int bin_count[SCENE_TREE_SAH_BINS] = {};
+        AABB bin_box[SCENE_TREE_SAH_BINS];
+        float scale = SCENE_TREE_SAH_BINS / extent;
+        for (int i = 0; i < count; i++) {
+            int bin = (int) ((leaf_centroid(tree, leaves[i], axis) - cmin[axis]) * scale);
+            if (bin >= SCENE_TREE_SAH_BINS) bin = SCENE_TREE_SAH_BINS - 1;
+            if (bin_count[bin]++ == 0) bin_box[bin] = tree->nodes[leaves[i]].box;
+            else aabb_union(&bin_box[bin], &tree->nodes[leaves[i]].box, &bin_box[bin]);
+        }
+
+        float right_cost[SCENE_TREE_SAH_BINS];
+        AABB box;
+        int n = 0;
+        for (int bin = SCENE_TREE_SAH_BINS - 1; bin > 0; bin--) {
+            if (bin_count[bin] > 0) {
+                if (n == 0) box = bin_box[bin];
+                else aabb_union(&box, &bin_box[bin], &box);
+                n += bin_count[bin];
+            }
+            right_cost[bin] = n > 0 ? n * aabb_area(&box) : 0.0f;
+        }
+
+        float best_cost = FLT_MAX;
+        int best_split = -1;
+        n = 0;
+        for (int bin = 0; bin < SCENE_TREE_SAH_BINS - 1; bin++) {
+            if (bin_count[bin] > 0) {
+                if (n == 0) box = bin_box[bin];
+                else aabb_union(&box, &bin_box[bin], &box);
+                n += bin_count[bin];
+            }
+            if (n == 0 || n == count) continue;
+            float cost = n * aabb_area(&box) + right_cost[bin + 1];
+            if (cost < best_cost) {
+                best_cost = cost;
+                best_split = bin + 1;
+            }
+        }
+
+        if (best_split > 0) {
+            int i = 0, j = count - 1;
+            while (i <= j) {
+                int bin = (int) ((leaf_centroid(tree, leaves[i], axis) - cmin[axis]) * scale);
+                if (bin < best_split) {
+                    i++;
+                } else {
+                    int swap = leaves[i];
+                    leaves[i] = leaves[j];
+                    leaves[j--] = swap;
+                }
+            }
+            if (i > 0 && i < count) mid = i;
+        }
+    }
+
+    int node = tree_alloc_node(tree);
+    tree->nodes[node].parent = parent;
+    int left = tree_build(tree, leaves, mid, node);
+    int right = tree_build(tree, leaves + mid, count - mid, node);
+    tree->nodes[node].children[0] = left;
+    tree->nodes[node].children[1] = right;
+    tree_fit_node(tree, node);
+    return node;
+}
+
+// Rebuilds the internal nodes from scratch, leaves and objects keep their
+// nodes.
+void scene_tree_rebuild(SceneTree* tree)
+{
+    if (tree->num_leaves == 0) return;
+
+    int* leaves = (int*) malloc(tree->num_leaves * sizeof(int));
+    int num_leaves = 0;
+    for (int i = 0; i < tree->capacity; i++) {
+        SceneTreeNode* node = &tree->nodes[i];
+        if (node->height == 0) leaves[num_leaves++] = i;
+        else if (node->height > 0) tree_free_node(tree, i);
+    }
+    assert(num_leaves == tree->num_leaves);
+
+    tree->root = tree_build(tree, leaves, num_leaves, -1);
+    tree->rebuild_cost = scene_tree_cost(tree);
+    free(leaves);
+}
+
+// Call once per frame after the updates, rebuilds the tree when refitting
+// made it too costly to query. Returns whether it did.
+bool scene_tree_maintain(SceneTree* tree)
+{
+    if (scene_tree_cost(tree) <= tree->rebuild_cost * SCENE_TREE_REBUILD_RATIO) return false;
+    scene_tree_rebuild(tree);
+    return true;
+}
+
+// Traversal stack, large enough for every node of the tree.
+static int* tree_stack(SceneTree* tree)
+{
+    static int* stack = NULL;
+    static int capacity = 0;
+    if (tree->capacity > capacity) {
+        capacity = tree->capacity;
+        stack = (int*) realloc(stack, capacity * sizeof(int));
+    }
+    return stack;
+}
+
+// Writes the objects whose bounding spheres intersect the frustum of
+// view_proj to visible and returns their count. visible must hold
+// tree->num_leaves objects. Subtrees entirely inside the frustum are
+// accepted without testing their objects, only leaves whose boxes cross a
+// plane have their spheres tested.
+int scene_tree_query_frustum(SceneTree* tree, mat4 view_proj, Object** visible)
+{
+    static Object** border = NULL;
+    static int border_capacity = 0;
+    if (tree->num_leaves > border_capacity) {
+        border_capacity = tree->num_leaves;
+        border = (Object**) realloc(border, border_capacity * sizeof(Object*));
+    }
+    if (tree->root == -1) return 0;
+
+    vec4 planes[6];
+    frustum_planes(view_proj, planes);
+
+    // entries are node * 2 + 1 for subtrees known to be inside
+    int* stack = tree_stack(tree);
+    int top = 0;
+    stack[top++] = tree->root * 2;
+    int num_visible = 0, num_border = 0;
+    while (top > 0) {
+        int entry = stack[--top];
+        SceneTreeNode* node = &tree->nodes[entry >> 1];
+        bool inside = entry & 1;
+
+        if (!inside) {
+            inside = true;
+            bool outside = false;
+            for (int p = 0; p < 6 && !outside; p++) {
+                // the box corners furthest along and against the normal
+                float d_max = planes[p][3], d_min = planes[p][3];
+                for (int i = 0; i < 3; i++) {
+                    float lo = planes[p][i] * node->box.min[i], hi = planes[p][i] * node->box.max[i];
+                    d_max += lo > hi ? lo : hi;
+                    d_min += lo < hi ? lo : hi;
+                }
+                outside = d_max < 0.0f;
+                inside = inside && d_min >= 0.0f;
+            }
+            if (outside) continue;
+        }
+
+        if (node->height == 0) {
+            if (inside) visible[num_visible++] = node->object;
+            else border[num_border++] = node->object;
+        } else {
+            stack[top++] = node->children[0] * 2 + inside;
+            stack[top++] = node->children[1] * 2 + inside;
+        }
+    }
+
+    return num_visible + cull_spheres(planes, border, num_border, visible + num_visible);
+}
+
+// Culls against the six faces of a shadow cube at once. Writes the objects
+// visible from any face to visible, and to face_masks the faces each one is
+// visible from as bits, returns their count.
+int scene_tree_query_cube(SceneTree* tree, mat4 face_view_proj[6], Object** visible, int* face_masks)
+{
+    static Object** face_visible = NULL;
+    static int face_capacity = 0;
+    if (tree->num_leaves > face_capacity) {
+        face_capacity = tree->num_leaves;
+        face_visible = (Object**) realloc(face_visible, face_capacity * sizeof(Object*));
+    }
+    // indexed by leaf, all zero between calls
+    static int* leaf_masks = NULL;
+    static int leaf_capacity = 0;
+    if (tree->capacity > leaf_capacity) {
+        leaf_capacity = tree->capacity;
+        free(leaf_masks);
+        leaf_masks = (int*) calloc(leaf_capacity, sizeof(int));
+    }
+
+    int num_visible = 0;
+    for (int face = 0; face < 6; face++) {
+        int n = scene_tree_query_frustum(tree, face_view_proj[face], face_visible);
+        for (int i = 0; i < n; i++) {
+            int leaf = face_visible[i]->tree_leaf;
+            if (leaf_masks[leaf] == 0) visible[num_visible++] = face_visible[i];
+            leaf_masks[leaf] |= 1 << face;
+        }
+    }
+    for (int i = 0; i < num_visible; i++) {
+        face_masks[i] = leaf_masks[visible[i]->tree_leaf];
+        leaf_masks[visible[i]->tree_leaf] = 0;
+    }
+    return num_visible;
+}
+
+// Writes up to max_results objects whose bounding spheres intersect the
+// sphere to results and returns their count. Only objects whose
+// 1 << type is set in type_mask are considered.
+int scene_tree_query_sphere(SceneTree* tree, vec3 center, float radius, unsigned type_mask,
+                            Object** results, int max_results)
+{
+    if (tree->root == -1) return 0;
+
+    int* stack = tree_stack(tree);
+    int top = 0;
+    stack[top++] = tree->root;
+    int num_results = 0;
+    while (top > 0 && num_results < max_results) {
+        SceneTreeNode* node = &tree->nodes[stack[--top]];
+
+        float d2 = 0.0f;
+        for (int i = 0; i < 3; i++) {
+            float d = center[i] < node->box.min[i] ? node->box.min[i] - center[i]
+                    : center[i] > node->box.max[i] ? center[i] - node->box.max[i] : 0.0f;
+            d2 += d * d;
+        }
+        if (d2 > radius * radius) continue;
+
+        if (node->height == 0) {
+            if (!(type_mask & (1u << node->object->type))) continue;
+            float r = radius + node->object->world_radius;
+            if (glm_vec3_distance2(center, node->object->world_center) <= r * r) {
+                results[num_results++] = node->object;
+            }
+        } else {
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+    return num_results;
+}
+
+// Returns the object in type_mask whose bounding sphere the ray hits first
+// within max_t, NULL if none. dir must be normalized, *t is the distance of
+// the hit.
+Object* scene_tree_raycast(SceneTree* tree, vec3 origin, vec3 dir, float max_t, unsigned type_mask, float* t)
+{
+    if (tree->root == -1) return NULL;
+
+    vec3 inv_dir;
+    for (int i = 0; i < 3; i++) inv_dir[i] = 1.0f / dir[i];
+
+    int* stack = tree_stack(tree);
+    int top = 0;
+    stack[top++] = tree->root;
+    Object* hit = NULL;
+    float best_t = max_t;
+    while (top > 0) {
+        SceneTreeNode* node = &tree->nodes[stack[--top]];
+
+        // slab test, skipping boxes behind the closest hit so far
+        float t_enter = 0.0f, t_exit = best_t;
+        for (int i = 0; i < 3; i++) {
+            float t0 = (node->box.min[i] - origin[i]) * inv_dir[i];
+            float t1 = (node->box.max[i] - origin[i]) * inv_dir[i];
+            if (t0 > t1) {
+                float swap = t0;
+                t0 = t1;
+                t1 = swap;
+            }
+            if (t0 > t_enter) t_enter = t0;
+            if (t1 < t_exit) t_exit = t1;
+        }
+        if (t_enter > t_exit) continue;
+
+        if (node->height == 0) {
+            Object* obj = node->object;
+            if (!(type_mask & (1u << obj->type))) continue;
+            vec3 oc;
+            glm_vec3_sub(obj->world_center, origin, oc);
+            float tc = glm_vec3_dot(oc, dir);
+            float d2 = glm_vec3_dot(oc, oc) - tc * tc;
+            float r2 = obj->world_radius * obj->world_radius;
+            if (d2 > r2) continue;
+            float half_chord = sqrtf(r2 - d2);
+            // from inside the sphere the hit is where the ray leaves it
+            float t_hit = tc - half_chord >= 0.0f ? tc - half_chord : tc + half_chord;
+            if (t_hit >= 0.0f && t_hit < best_t) {
+                best_t = t_hit;
+                hit = obj;
+            }
+        } else {
+            stack[top++] = node->children[0];
+            stack[top++] = node->children[1];
+        }
+    }
+
+    if (hit) *t = best_t;
+    return hit;
+}
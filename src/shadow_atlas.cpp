@@ -0,0 +1,311 @@
+// Shadow map storage shared by all lights.
+//
+// Lights draw their shadow maps into square tiles of one 2D depth
+// texture: a point light gets a tile per cube face, other lights one.
+// Tiles are powers of two, allocated quadtree style: a free tile of level
+// l (level 0 is the whole atlas) splits into four of level l + 1, and four
+// free siblings merge back. Each light asks for its own resolution and
+// gets smaller tiles when the atlas is full.
+//
+// With ARB_copy_image a second texture of the same layout holds the depth
+// of cached lights' static casters, see ShadowCache.
+
+#define SHADOW_ATLAS_MAX_LEVELS 16
+
+struct ShadowAtlas {
+    GLuint fbo;
+    GLuint tex;
+    GLuint static_tex; // 0 without ARB_copy_image
+    int size;
+    int bytes_per_texel;
+    int num_levels; // tiles go from size down to SHADOW_ATLAS_MIN_TILE
+    ShadowTile* free_tiles[SHADOW_ATLAS_MAX_LEVELS];
+    int num_free[SHADOW_ATLAS_MAX_LEVELS];
+    int cap_free[SHADOW_ATLAS_MAX_LEVELS];
+    long long used_texels;
+};
+
+static ShadowAtlas shadow_atlas;
+
+// The faces of a point light's shadow cube, in tile order
+static vec3 shadow_cube_dirs[6] = {
+    {1.0f, 0.0f, 0.0f},
+    {-1.0f, 0.0f, 0.0f},
+    {0.0f, 1.0f, 0.0f},
+    {0.0f, -1.0f, 0.0f},
+    {0.0f, 0.0f, 1.0f},
+    {0.0f, 0.0f, -1.0f},
+};
+static vec3 shadow_cube_ups[6] = {
+    {0.0f, -1.0f, 0.0f},
+    {0.0f, -1.0f, 0.0f},
+    {0.0f, 0.0f, 1.0f},
+    {0.0f, 0.0f, -1.0f},
+    {0.0f, -1.0f, 0.0f},
+    {0.0f, -1.0f, 0.0f},
+};
+
+void shadow_cube_matrices(vec3 light_pos, mat4 proj_mat, mat4 view_mats[6])
+{
+    glm_perspective(GLM_PI_2f, 1, 0.01f, FAR_PLANE, proj_mat);
+    for (int i = 0; i < 6; i++) {
+        vec3 target;
+        glm_vec3_add(light_pos, shadow_cube_dirs[i], target);
+        glm_lookat(light_pos, target, shadow_cube_ups[i], view_mats[i]);
+    }
+}
+
+// Views of the hemispheres of a dual-paraboloid map, below and above the
+// light like the cube's -Y and +Y faces. The ground stays clear of the
+// seam between them.
+void shadow_paraboloid_matrices(vec3 light_pos, mat4 view_mats[2])
+{
+    int faces[2] = { 3, 2 };
+    for (int i = 0; i < 2; i++) {
+        vec3 target;
+        glm_vec3_add(light_pos, shadow_cube_dirs[faces[i]], target);
+        glm_lookat(light_pos, target, shadow_cube_ups[faces[i]], view_mats[i]);
+    }
+}
+
+static GLuint shadow_atlas_create_texture()
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+#ifdef SHADOW_DEPTH16
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT16, shadow_atlas.size, shadow_atlas.size, 0,
+                     GL_DEPTH_COMPONENT, GL_UNSIGNED_SHORT, NULL);
+#else
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_DEPTH_COMPONENT32F, shadow_atlas.size, shadow_atlas.size, 0,
+                     GL_DEPTH_COMPONENT, GL_FLOAT, NULL);
+#endif
+        // lookups are clamped to their tile, see shadow_atlas_tile_rects
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_CLAMP_TO_EDGE);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_NEAREST);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_NEAREST);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return tex;
+}
+
+static int shadow_tile_level(int size)
+{
+    int level = 0;
+    while (level < shadow_atlas.num_levels - 1 && (shadow_atlas.size >> (level + 1)) >= size) level++;
+    return level;
+}
+
+static void shadow_atlas_push(int level, ShadowTile tile)
+{
+    if (shadow_atlas.num_free[level] == shadow_atlas.cap_free[level]) {
+        int cap = shadow_atlas.cap_free[level] ? shadow_atlas.cap_free[level] * 2 : 16;
+        shadow_atlas.free_tiles[level] = (ShadowTile*) realloc(shadow_atlas.free_tiles[level], cap * sizeof(ShadowTile));
+        shadow_atlas.cap_free[level] = cap;
+    }
+    shadow_atlas.free_tiles[level][shadow_atlas.num_free[level]++] = tile;
+}
+
+// Index of the free tile at x, y of level, -1 if it isn't free.
+static int shadow_atlas_find(int level, int x, int y)
+{
+    for (int i = 0; i < shadow_atlas.num_free[level]; i++) {
+        ShadowTile* tile = &shadow_atlas.free_tiles[level][i];
+        if (tile->x == x && tile->y == y) return i;
+    }
+    return -1;
+}
+
+static void shadow_atlas_remove(int level, int index)
+{
+    shadow_atlas.free_tiles[level][index] = shadow_atlas.free_tiles[level][--shadow_atlas.num_free[level]];
+}
+
+void shadow_atlas_init()
+{
+    shadow_atlas.size = SHADOW_ATLAS_SIZE;
+#ifdef SHADOW_DEPTH16
+    shadow_atlas.bytes_per_texel = 2;
+#else
+    shadow_atlas.bytes_per_texel = 4;
+#endif
+    shadow_atlas.num_levels = 1;
+    while (shadow_atlas.num_levels < SHADOW_ATLAS_MAX_LEVELS &&
+           (shadow_atlas.size >> shadow_atlas.num_levels) >= SHADOW_ATLAS_MIN_TILE) {
+        shadow_atlas.num_levels++;
+    }
+    ShadowTile whole = { 0, 0, shadow_atlas.size };
+    shadow_atlas_push(0, whole);
+
+    shadow_atlas.tex = shadow_atlas_create_texture();
+    if (GLEW_ARB_copy_image) {
+        shadow_atlas.static_tex = shadow_atlas_create_texture();
+    } else {
+        printf("Shadow cache: no ARB_copy_image, redrawing static casters every frame\n");
+    }
+
+    // TODO: remember to free resources
+    glGenFramebuffers(1, &shadow_atlas.fbo);
+    glBindFramebuffer(GL_FRAMEBUFFER, shadow_atlas.fbo);
+    // we only need the depth buffer
+    glDrawBuffer(GL_NONE);
+    glReadBuffer(GL_NONE);
+    glBindFramebuffer(GL_FRAMEBUFFER, 0);
+
+    double mb = (double) shadow_atlas.size * shadow_atlas.size * shadow_atlas.bytes_per_texel / (1024 * 1024);
+    printf("Shadow atlas: %d^2 texels of %d-bit depth, %.1f MB%s\n", shadow_atlas.size,
+           shadow_atlas.bytes_per_texel * 8, mb, shadow_atlas.static_tex ? " and as much for the static cache" : "");
+}
+
+// Hands out a free tile of at least size texels, up to the atlas size.
+// Returns false when none is left.
+static bool shadow_atlas_alloc(int size, ShadowTile* tile)
+{
+    int level = shadow_tile_level(size);
+    int l = level;
+    while (l >= 0 && shadow_atlas.num_free[l] == 0) l--;
+    if (l < 0) return false;
+
+    ShadowTile t = shadow_atlas.free_tiles[l][--shadow_atlas.num_free[l]];
+    // split down to the level, keeping the first quarter each time
+    for (; l < level; l++) {
+        int half = t.size / 2;
+        ShadowTile quarters[3] = {
+            { t.x + half, t.y, half },
+            { t.x, t.y + half, half },
+            { t.x + half, t.y + half, half },
+        };
+        for (int i = 2; i >= 0; i--) shadow_atlas_push(l + 1, quarters[i]);
+        t.size = half;
+    }
+    shadow_atlas.used_texels += (long long) t.size * t.size;
+    *tile = t;
+    return true;
+}
+
+static void shadow_atlas_free(ShadowTile tile)
+{
+    shadow_atlas.used_texels -= (long long) tile.size * tile.size;
+    int level = shadow_tile_level(tile.size);
+
+    // merge with the three siblings while they're free too
+    while (level > 0) {
+        int parent_size = tile.size * 2;
+        int px = tile.x / parent_size * parent_size;
+        int py = tile.y / parent_size * parent_size;
+        int siblings[3][2];
+        int n = 0;
+        for (int i = 0; i < 4; i++) {
+            int x = px + (i & 1) * tile.size, y = py + (i >> 1) * tile.size;
+            if (x != tile.x || y != tile.y) {
+                siblings[n][0] = x;
+                siblings[n][1] = y;
+                n++;
+            }
+        }
+        bool all_free = true;
+        for (int i = 0; i < 3 && all_free; i++) {
+            all_free = shadow_atlas_find(level, siblings[i][0], siblings[i][1]) >= 0;
+        }
+        if (!all_free) break;
+
+        for (int i = 0; i < 3; i++) {
+            shadow_atlas_remove(level, shadow_atlas_find(level, siblings[i][0], siblings[i][1]));
+        }
+        tile.x = px;
+        tile.y = py;
+        tile.size = parent_size;
+        level--;
+    }
+    shadow_atlas_push(level, tile);
+}
+
+void shadow_atlas_free_light(Light* light)
+{
+    for (int i = 0; i < light->num_shadow_tiles; i++) shadow_atlas_free(light->shadow_tiles[i]);
+    light->num_shadow_tiles = 0;
+}
+
+// Gives light its tiles, halving their size until they all fit. Returns
+// false, leaving the light without shadows, when even the smallest don't.
+bool shadow_atlas_alloc_light(Light* light)
+{
+    shadow_atlas_free_light(light);
+    light->shadow_cache.valid = false;
+    light->shadow_valid_faces = 0;
+
+    int faces = 1;
+    if (light->type == POINTLIGHT) faces = light->shadow_mode == SHADOW_DUAL_PARABOLOID ? 2 : 6;
+    int first_size = light->shadow_resolution > SHADOW_ATLAS_MIN_TILE ? light->shadow_resolution : SHADOW_ATLAS_MIN_TILE;
+    for (int size = first_size; size >= SHADOW_ATLAS_MIN_TILE; size /= 2) {
+        int n = 0;
+        while (n < faces && shadow_atlas_alloc(size, &light->shadow_tiles[n])) n++;
+        if (n == faces) {
+            light->num_shadow_tiles = faces;
+            if (light->shadow_tiles[0].size < light->shadow_resolution) {
+                printf("Shadow atlas: full, light gets %d^2 tiles instead of %d^2\n",
+                       light->shadow_tiles[0].size, light->shadow_resolution);
+            }
+            return true;
+        }
+        while (n > 0) shadow_atlas_free(light->shadow_tiles[--n]);
+    }
+    printf("Shadow atlas: full, light casts no shadows\n");
+    return false;
+}
+
+// Bytes of the atlas light's tiles take, the static cache takes as many
+// again.
+long long shadow_light_bytes(Light* light)
+{
+    long long texels = 0;
+    for (int i = 0; i < light->num_shadow_tiles; i++) {
+        texels += (long long) light->shadow_tiles[i].size * light->shadow_tiles[i].size;
+    }
+    return texels * shadow_atlas.bytes_per_texel;
+}
+
+// Where the final pass finds light's tiles in atlas coordinates: offset
+// in xy, size in z and half a texel of the tile in w, lookups clamp to it
+// so they never read a neighbouring tile. All zero for missing tiles and
+// ones that weren't drawn yet.
+void shadow_atlas_tile_rects(Light* light, vec4 rects[6])
+{
+    memset(rects, 0, 6 * sizeof(vec4));
+    for (int i = 0; i < light->num_shadow_tiles; i++) {
+        if (!(light->shadow_valid_faces & (1 << i))) continue;
+        ShadowTile* tile = &light->shadow_tiles[i];
+        rects[i][0] = (float) tile->x / shadow_atlas.size;
+        rects[i][1] = (float) tile->y / shadow_atlas.size;
+        rects[i][2] = (float) tile->size / shadow_atlas.size;
+        rects[i][3] = 0.5f / tile->size;
+    }
+}
+
+// Makes draws and clears only touch tile. Leaves the scissor test enabled.
+void shadow_atlas_target_tile(ShadowTile* tile)
+{
+    glEnable(GL_SCISSOR_TEST);
+    glViewport(tile->x, tile->y, tile->size, tile->size);
+    glScissor(tile->x, tile->y, tile->size, tile->size);
+}
+
+void shadow_atlas_copy_tile(GLuint src, GLuint dst, ShadowTile* tile)
+{
+    glCopyImageSubData(src, GL_TEXTURE_2D, 0, tile->x, tile->y, 0,
+                       dst, GL_TEXTURE_2D, 0, tile->x, tile->y, 0,
+                       tile->size, tile->size, 1);
+}
+
+void shadow_atlas_print_stats(Light* lights, int num_lights)
+{
+    double mb = 1.0 / (1024 * 1024);
+    printf("Shadow atlas: %.1f of %.1f MB used", shadow_atlas.used_texels * shadow_atlas.bytes_per_texel * mb,
+           (double) shadow_atlas.size * shadow_atlas.size * shadow_atlas.bytes_per_texel * mb);
+    for (int i = 0; i < num_lights; i++) {
+        Light* light = &lights[i];
+        int size = light->num_shadow_tiles ? light->shadow_tiles[0].size : 0;
+        printf(", light %d: %d x %d^2, %.1f MB", i, light->num_shadow_tiles, size, shadow_light_bytes(light) * mb);
+    }
+    printf("\n");
+}
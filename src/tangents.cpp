@@ -0,0 +1,212 @@
+// Tangent frame generation for indexed meshes.
+//
+// The per-face tangent and bitangent are computed in batches over SoA
+// streams of edge vectors and texture coordinate deltas (AVX2 or SSE when
+// the compiler targets them, scalar otherwise). They are then summed for
+// every vertex the face references, so faces sharing a welded vertex
+// smooth its frame, and finally Gram-Schmidt orthonormalized against the
+// vertex normal. The bitangent keeps the handedness of the accumulated one.
+// Vertices are welded by position, normal and texture coordinate for the
+// sums only, so meshes that keep a vertex per face corner (the ground
+// plane) are smoothed as well.
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+enum FaceStream {
+    FACE_E1_X, FACE_E1_Y, FACE_E1_Z,
+    FACE_E2_X, FACE_E2_Y, FACE_E2_Z,
+    FACE_DUV1_U, FACE_DUV1_V,
+    FACE_DUV2_U, FACE_DUV2_V,
+    FACE_T_X, FACE_T_Y, FACE_T_Z,
+    FACE_B_X, FACE_B_Y, FACE_B_Z,
+    FACE_STREAM_COUNT
+};
+
+// faces with a smaller UV area get no tangent contribution
+#define TANGENT_MIN_UV_AREA 1e-20f
+
+static void face_tangents_scalar(float** s, int first, int count)
+{
+    for (int i = first; i < first + count; i++) {
+        float det = s[FACE_DUV1_U][i] * s[FACE_DUV2_V][i] - s[FACE_DUV2_U][i] * s[FACE_DUV1_V][i];
+        float r = fabsf(det) > TANGENT_MIN_UV_AREA ? 1.0f / det : 0.0f;
+        float dv2 = s[FACE_DUV2_V][i] * r, dv1 = s[FACE_DUV1_V][i] * r;
+        float du1 = s[FACE_DUV1_U][i] * r, du2 = s[FACE_DUV2_U][i] * r;
+        for (int c = 0; c < 3; c++) {
+            s[FACE_T_X + c][i] = dv2 * s[FACE_E1_X + c][i] - dv1 * s[FACE_E2_X + c][i];
+            s[FACE_B_X + c][i] = du1 * s[FACE_E2_X + c][i] - du2 * s[FACE_E1_X + c][i];
+        }
+    }
+}
+
+#if defined(__AVX2__)
+#define FACE_BATCH 8
+static void face_tangents_batch(float** s, int i)
+{
+    __m256 du1 = _mm256_loadu_ps(s[FACE_DUV1_U] + i), dv1 = _mm256_loadu_ps(s[FACE_DUV1_V] + i);
+    __m256 du2 = _mm256_loadu_ps(s[FACE_DUV2_U] + i), dv2 = _mm256_loadu_ps(s[FACE_DUV2_V] + i);
+    __m256 det = _mm256_sub_ps(_mm256_mul_ps(du1, dv2), _mm256_mul_ps(du2, dv1));
+    __m256 abs_det = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), det);
+    __m256 valid = _mm256_cmp_ps(abs_det, _mm256_set1_ps(TANGENT_MIN_UV_AREA), _CMP_GT_OQ);
+    __m256 r = _mm256_and_ps(valid, _mm256_div_ps(_mm256_set1_ps(1.0f), det));
+    du1 = _mm256_mul_ps(du1, r); dv1 = _mm256_mul_ps(dv1, r);
+    du2 = _mm256_mul_ps(du2, r); dv2 = _mm256_mul_ps(dv2, r);
+    for (int c = 0; c < 3; c++) {
+        __m256 e1 = _mm256_loadu_ps(s[FACE_E1_X + c] + i);
+        __m256 e2 = _mm256_loadu_ps(s[FACE_E2_X + c] + i);
+        _mm256_storeu_ps(s[FACE_T_X + c] + i, _mm256_sub_ps(_mm256_mul_ps(dv2, e1), _mm256_mul_ps(dv1, e2)));
+        _mm256_storeu_ps(s[FACE_B_X + c] + i, _mm256_sub_ps(_mm256_mul_ps(du1, e2), _mm256_mul_ps(du2, e1)));
+    }
+}
+#elif defined(__SSE2__)
+#define FACE_BATCH 4
+static void face_tangents_batch(float** s, int i)
+{
+    __m128 du1 = _mm_loadu_ps(s[FACE_DUV1_U] + i), dv1 = _mm_loadu_ps(s[FACE_DUV1_V] + i);
+    __m128 du2 = _mm_loadu_ps(s[FACE_DUV2_U] + i), dv2 = _mm_loadu_ps(s[FACE_DUV2_V] + i);
+    __m128 det = _mm_sub_ps(_mm_mul_ps(du1, dv2), _mm_mul_ps(du2, dv1));
+    __m128 abs_det = _mm_andnot_ps(_mm_set1_ps(-0.0f), det);
+    __m128 valid = _mm_cmpgt_ps(abs_det, _mm_set1_ps(TANGENT_MIN_UV_AREA));
+    __m128 r = _mm_and_ps(valid, _mm_div_ps(_mm_set1_ps(1.0f), det));
+    du1 = _mm_mul_ps(du1, r); dv1 = _mm_mul_ps(dv1, r);
+    du2 = _mm_mul_ps(du2, r); dv2 = _mm_mul_ps(dv2, r);
+    for (int c = 0; c < 3; c++) {
+        __m128 e1 = _mm_loadu_ps(s[FACE_E1_X + c] + i);
+        __m128 e2 = _mm_loadu_ps(s[FACE_E2_X + c] + i);
+        _mm_storeu_ps(s[FACE_T_X + c] + i, _mm_sub_ps(_mm_mul_ps(dv2, e1), _mm_mul_ps(dv1, e2)));
+        _mm_storeu_ps(s[FACE_B_X + c] + i, _mm_sub_ps(_mm_mul_ps(du1, e2), _mm_mul_ps(du2, e1)));
+    }
+}
+#else
+#define FACE_BATCH 1
+static void face_tangents_batch(float** s, int i)
+{
+    face_tangents_scalar(s, i, 1);
+}
+#endif
+
+// Any unit vector perpendicular to n, for vertices without usable UVs.
+static void perpendicular_unit(vec3 n, vec3 out)
+{
+    vec3 axis = { 1.0f, 0.0f, 0.0f };
+    if (fabsf(n[0]) > 0.9f) axis[0] = 0.0f, axis[1] = 1.0f;
+    glm_vec3_cross(n, axis, out);
+    glm_vec3_normalize(out);
+}
+
+// For every vertex, the first one with the same position, normal and
+// texture coordinate.
+static unsigned int* tangent_weld_map(Model* model)
+{
+    int n = model->num_vertices;
+    int table_size = 1;
+    while (table_size < n * 2) table_size *= 2;
+    int* table = (int*) malloc(table_size * sizeof(int));
+    memset(table, -1, table_size * sizeof(int));
+
+    unsigned int* weld = (unsigned int*) malloc(n * sizeof(unsigned int));
+    for (int i = 0; i < n; i++) {
+        unsigned int h = 2166136261u;
+        h = hash_bytes(h, model->vertices[i], sizeof(vec3));
+        h = hash_bytes(h, model->normals[i], sizeof(vec3));
+        h = hash_bytes(h, model->texture_coords[i], sizeof(vec2));
+        unsigned int slot = h & (table_size - 1);
+        while (table[slot] != -1) {
+            int j = table[slot];
+            if (!memcmp(model->vertices[i], model->vertices[j], sizeof(vec3)) &&
+                !memcmp(model->normals[i], model->normals[j], sizeof(vec3)) &&
+                !memcmp(model->texture_coords[i], model->texture_coords[j], sizeof(vec2))) break;
+            slot = (slot + 1) & (table_size - 1);
+        }
+        if (table[slot] == -1) table[slot] = i;
+        weld[i] = table[slot];
+    }
+
+    free(table);
+    return weld;
+}
+
+// Generates tangents and bitangents for the vertices referenced by the
+// first num_faces triangles of an indexed model, others are not touched.
+// model->tangents/bitangents must hold num_vertices entries.
+void model_generate_tangents(Model* model, int num_faces)
+{
+    double start = glfwGetTime();
+
+    float* block = (float*) malloc((size_t) FACE_STREAM_COUNT * num_faces * sizeof(float));
+    float* s[FACE_STREAM_COUNT];
+    for (int i = 0; i < FACE_STREAM_COUNT; i++) s[i] = block + (size_t) i * num_faces;
+
+    for (int f = 0; f < num_faces; f++) {
+        unsigned int a = model_get_index(model, f * 3);
+        unsigned int b = model_get_index(model, f * 3 + 1);
+        unsigned int c = model_get_index(model, f * 3 + 2);
+        for (int j = 0; j < 3; j++) {
+            s[FACE_E1_X + j][f] = model->vertices[b][j] - model->vertices[a][j];
+            s[FACE_E2_X + j][f] = model->vertices[c][j] - model->vertices[a][j];
+        }
+        for (int j = 0; j < 2; j++) {
+            s[FACE_DUV1_U + j][f] = model->texture_coords[b][j] - model->texture_coords[a][j];
+            s[FACE_DUV2_U + j][f] = model->texture_coords[c][j] - model->texture_coords[a][j];
+        }
+    }
+
+    int batched = num_faces - num_faces % FACE_BATCH;
+    for (int f = 0; f < batched; f += FACE_BATCH) {
+        face_tangents_batch(s, f);
+    }
+    face_tangents_scalar(s, batched, num_faces - batched);
+
+    // sum the face frames of every welded vertex
+    unsigned int* weld = tangent_weld_map(model);
+    vec3* tangent_sum = (vec3*) calloc(model->num_vertices, sizeof(vec3));
+    vec3* bitangent_sum = (vec3*) calloc(model->num_vertices, sizeof(vec3));
+    unsigned char* referenced = (unsigned char*) calloc(model->num_vertices, 1);
+    for (int f = 0; f < num_faces; f++) {
+        for (int k = 0; k < 3; k++) {
+            unsigned int v = model_get_index(model, f * 3 + k);
+            unsigned int w = weld[v];
+            for (int j = 0; j < 3; j++) {
+                tangent_sum[w][j] += s[FACE_T_X + j][f];
+                bitangent_sum[w][j] += s[FACE_B_X + j][f];
+            }
+            referenced[v] = 1;
+        }
+    }
+
+    int num_welded = 0;
+    for (int v = 0; v < model->num_vertices; v++) {
+        if (!referenced[v]) continue;
+        if (weld[v] == (unsigned int) v) num_welded++;
+
+        float* n = model->normals[v];
+        vec3 t;
+        glm_vec3_copy(tangent_sum[weld[v]], t);
+        vec3 along_normal;
+        glm_vec3_scale(n, glm_vec3_dot(n, t), along_normal);
+        glm_vec3_sub(t, along_normal, t);
+        if (glm_vec3_norm2(t) > 1e-12f) {
+            glm_vec3_normalize(t);
+        } else {
+            perpendicular_unit(n, t);
+        }
+
+        vec3 b;
+        glm_vec3_cross(n, t, b);
+        if (glm_vec3_dot(b, bitangent_sum[weld[v]]) < 0.0f) glm_vec3_scale(b, -1.0f, b);
+
+        glm_vec3_copy(t, model->tangents[v]);
+        glm_vec3_copy(b, model->bitangents[v]);
+    }
+
+    free(referenced);
+    free(weld);
+    free(bitangent_sum);
+    free(tangent_sum);
+    free(block);
+
+    printf("Generated tangents for %d faces, %d vertices (%d welded) in %.2f ms (%d-wide)\n",
+           num_faces, model->num_vertices, num_welded, (glfwGetTime() - start) * 1000.0, FACE_BATCH);
+}
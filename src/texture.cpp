@@ -0,0 +1,363 @@
+// Texture registry and decoded texture cache.
+//
+// loadTexture hands out one GL texture per image: repeated loads of a path,
+// or of a different path with the same file contents, share it and are
+// reference counted. Decoded pixels are cached next to the image as
+// "<image>.tex" with the whole mip chain already built, so a warm start maps
+// that file and uploads it without decoding or generating mipmaps.
+//
+// Layout: TextureFileHeader followed by the mip levels, largest first, each
+// starting at a TEXTURE_LEVEL_ALIGNMENT aligned offset. Pixels are tightly
+// packed RGB8 rows, bottom row first (as uploaded). Bump
+// TEXTURE_FILE_VERSION whenever the layout changes, old files are then
+// rebuilt.
+
+#include <stdint.h>
+
+#define TEXTURE_FILE_MAGIC 0x58455444 // "DTEX"
+#define TEXTURE_FILE_VERSION 1
+#define TEXTURE_LEVEL_ALIGNMENT 64
+#define TEXTURE_MAX_LEVELS 16
+
+// shown by textures that failed to load or are still streaming in
+const unsigned char texture_fallback_color[3] = { 128, 128, 128 };
+const unsigned char texture_fallback_normal[3] = { 128, 128, 255 };
+
+struct TextureFileHeader {
+    uint32_t magic;
+    uint32_t version;
+
+    // the image this was decoded from, to detect stale files
+    int64_t source_size;
+    int64_t source_mtime;
+    uint64_t content_hash;
+
+    int32_t width;
+    int32_t height;
+    int32_t num_levels;
+    int32_t padding;
+
+    uint64_t level_offsets[TEXTURE_MAX_LEVELS];
+    uint64_t level_sizes[TEXTURE_MAX_LEVELS];
+};
+
+struct Texture {
+    char* path; // the first path this texture was loaded from
+    uint64_t content_hash;
+    GLuint id;
+    int ref_count;
+    bool streaming; // see texture_streaming.cpp, content_hash is not known yet
+};
+
+static Texture* textures;
+static int textures_n;
+static int textures_cap;
+
+static uint64_t hash_file_contents(const char* data, size_t size)
+{
+    // FNV-1a
+    uint64_t h = 14695981039346656037ull;
+    for (size_t i = 0; i < size; i++) {
+        h ^= (unsigned char) data[i];
+        h *= 1099511628211ull;
+    }
+    return h;
+}
+
+static int texture_level_size(int size, int level)
+{
+    size >>= level;
+    return size > 0 ? size : 1;
+}
+
+static int texture_num_levels(int w, int h)
+{
+    int levels = 1;
+    while ((w >> levels) || (h >> levels)) levels++;
+    return levels < TEXTURE_MAX_LEVELS ? levels : TEXTURE_MAX_LEVELS;
+}
+
+// 2x2 box filter, edge texels are repeated for odd sizes
+static void downsample_rgb(const unsigned char* src, int sw, int sh, unsigned char* dst, int dw, int dh)
+{
+    for (int y = 0; y < dh; y++) {
+        int y0 = 2 * y < sh ? 2 * y : sh - 1;
+        int y1 = 2 * y + 1 < sh ? 2 * y + 1 : sh - 1;
+        for (int x = 0; x < dw; x++) {
+            int x0 = 2 * x < sw ? 2 * x : sw - 1;
+            int x1 = 2 * x + 1 < sw ? 2 * x + 1 : sw - 1;
+            for (int c = 0; c < 3; c++) {
+                int sum = src[(y0 * sw + x0) * 3 + c] + src[(y0 * sw + x1) * 3 + c] +
+                          src[(y1 * sw + x0) * 3 + c] + src[(y1 * sw + x1) * 3 + c];
+                dst[(y * dw + x) * 3 + c] = (unsigned char) ((sum + 2) / 4);
+            }
+        }
+    }
+}
+
+// Maps the cached texture if it exists and is up to date with its source.
+static bool map_texture_cache(const char* cache_filename, const char* source_filename, MappedFile* mapped)
+{
+    *mapped = map_file(cache_filename);
+    if (!mapped->data) return false;
+
+    const TextureFileHeader* header = (const TextureFileHeader*) mapped->data;
+
+    long long source_size, source_mtime;
+    bool valid = mapped->size >= sizeof(*header) &&
+                 header->magic == TEXTURE_FILE_MAGIC &&
+                 header->version == TEXTURE_FILE_VERSION &&
+                 file_stat(source_filename, &source_size, &source_mtime) &&
+                 header->source_size == source_size &&
+                 header->source_mtime == source_mtime &&
+                 header->width > 0 && header->height > 0 &&
+                 header->num_levels == texture_num_levels(header->width, header->height);
+
+    for (int i = 0; valid && i < header->num_levels; i++) {
+        uint64_t w = texture_level_size(header->width, i);
+        uint64_t h = texture_level_size(header->height, i);
+        valid = header->level_sizes[i] == w * h * 3 &&
+                header->level_offsets[i] % TEXTURE_LEVEL_ALIGNMENT == 0 &&
+                header->level_offsets[i] + header->level_sizes[i] <= mapped->size;
+    }
+
+    if (!valid) unmap_file(mapped);
+    return valid;
+}
+
+// Fills in the header fields that follow from the image size. The levels
+// are laid out the same in memory as in the file, starting at
+// level_offsets[0].
+static void texture_file_layout(TextureFileHeader* header, int w, int h)
+{
+    header->magic = TEXTURE_FILE_MAGIC;
+    header->version = TEXTURE_FILE_VERSION;
+    header->width = w;
+    header->height = h;
+    header->num_levels = texture_num_levels(w, h);
+
+    uint64_t offset = sizeof(*header);
+    for (int i = 0; i < header->num_levels; i++) {
+        offset = (offset + TEXTURE_LEVEL_ALIGNMENT - 1) & ~(uint64_t) (TEXTURE_LEVEL_ALIGNMENT - 1);
+        header->level_offsets[i] = offset;
+        header->level_sizes[i] = (uint64_t) texture_level_size(w, i) * texture_level_size(h, i) * 3;
+        offset += header->level_sizes[i];
+    }
+}
+
+static size_t texture_pixels_size(const TextureFileHeader* header)
+{
+    int last = header->num_levels - 1;
+    return header->level_offsets[last] + header->level_sizes[last] - header->level_offsets[0];
+}
+
+// Reads the image size without decoding it.
+static bool texture_info(const MappedFile* source, TextureFileHeader* header)
+{
+    int w, h, n;
+    if (!stbi_info_from_memory((const stbi_uc*) source->data, (int) source->size, &w, &h, &n)) return false;
+    if (w <= 0 || h <= 0) return false;
+
+    memset(header, 0, sizeof(*header));
+    texture_file_layout(header, w, h);
+    return true;
+}
+
+// Decodes the image into pixels (texture_pixels_size bytes) and builds its
+// mip chain there.
+static bool decode_texture(const MappedFile* source, const TextureFileHeader* header, unsigned char* pixels)
+{
+    int w, h, n;
+    stbi_set_flip_vertically_on_load_thread(true);
+    unsigned char* decoded = stbi_load_from_memory((const stbi_uc*) source->data, (int) source->size, &w, &h, &n, 3);
+    if (!decoded) return false;
+
+    bool ok = w == header->width && h == header->height;
+    if (ok) {
+        memcpy(pixels, decoded, header->level_sizes[0]);
+        for (int i = 1; i < header->num_levels; i++) {
+            downsample_rgb(pixels + header->level_offsets[i - 1] - header->level_offsets[0],
+                           texture_level_size(w, i - 1), texture_level_size(h, i - 1),
+                           pixels + header->level_offsets[i] - header->level_offsets[0],
+                           texture_level_size(w, i), texture_level_size(h, i));
+        }
+    }
+    stbi_image_free(decoded);
+
+    return ok;
+}
+
+static void write_texture_cache(const char* cache_filename, const TextureFileHeader* header,
+                                const unsigned char* pixels)
+{
+    static const char padding[TEXTURE_LEVEL_ALIGNMENT] = { 0 };
+    size_t pad = header->level_offsets[0] - sizeof(*header);
+    size_t size = texture_pixels_size(header);
+
+    FILE* f = fopen(cache_filename, "wb");
+    bool ok = f && fwrite(header, sizeof(*header), 1, f) == 1 &&
+              fwrite(padding, 1, pad, f) == pad &&
+              fwrite(pixels, 1, size, f) == size;
+    if (f) fclose(f);
+
+    if (!ok) {
+        fprintf(stderr, "Warning: could not write texture cache '%s'\n", cache_filename);
+        remove(cache_filename);
+    }
+}
+
+static GLuint upload_texture(const TextureFileHeader* header, const unsigned char* const* levels)
+{
+    GLuint tex;
+    glGenTextures(1, &tex);
+
+    glBindTexture(GL_TEXTURE_2D, tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->num_levels - 1);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        for (int i = 0; i < header->num_levels; i++) {
+            glTexImage2D(GL_TEXTURE_2D, i, GL_RGB, texture_level_size(header->width, i),
+                         texture_level_size(header->height, i), 0, GL_RGB, GL_UNSIGNED_BYTE, levels[i]);
+        }
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    return tex;
+}
+
+static GLuint upload_fallback_texture(const unsigned char rgb[3])
+{
+    TextureFileHeader header = {};
+    header.width = header.height = 1;
+    header.num_levels = 1;
+    const unsigned char* levels[1] = { rgb };
+    return upload_texture(&header, levels);
+}
+
+static Texture* texture_add(const char* path, uint64_t content_hash, GLuint id)
+{
+    if (textures_n == textures_cap) {
+        textures_cap = textures_cap ? textures_cap * 2 : 16;
+        textures = (Texture*) realloc(textures, textures_cap * sizeof(Texture));
+        assert(textures);
+    }
+
+    Texture* texture = &textures[textures_n++];
+    texture->path = strdup(path);
+    texture->content_hash = content_hash;
+    texture->id = id;
+    texture->ref_count = 0;
+    texture->streaming = false;
+    return texture;
+}
+
+static Texture* find_texture_by_hash(uint64_t content_hash)
+{
+    for (int i = 0; i < textures_n; i++) {
+        if (!textures[i].streaming && textures[i].content_hash == content_hash) return &textures[i];
+    }
+    return NULL;
+}
+
+// Returns a reference to the texture of the image at filename, give it back
+// with texture_release.
+GLuint loadTexture(const char* filename)
+{
+    assert(filename);
+
+    for (int i = 0; i < textures_n; i++) {
+        if (strcmp(textures[i].path, filename) == 0) {
+            textures[i].ref_count++;
+            return textures[i].id;
+        }
+    }
+
+    double start = glfwGetTime();
+
+    char cache_filename[512];
+    snprintf(cache_filename, sizeof(cache_filename), "%s%s", filename, TEXTURE_CACHE_EXTENSION);
+
+    Texture* texture = NULL;
+    MappedFile mapped;
+    if (map_texture_cache(cache_filename, filename, &mapped)) {
+        const TextureFileHeader* header = (const TextureFileHeader*) mapped.data;
+
+        // same image under another name
+        texture = find_texture_by_hash(header->content_hash);
+        if (!texture) {
+            const unsigned char* levels[TEXTURE_MAX_LEVELS];
+            for (int i = 0; i < header->num_levels; i++) {
+                levels[i] = (const unsigned char*) mapped.data + header->level_offsets[i];
+            }
+            texture = texture_add(filename, header->content_hash, upload_texture(header, levels));
+            printf("Loaded texture '%s' from cache: %dx%d, %d levels in %.2f ms\n", filename,
+                   header->width, header->height, header->num_levels, (glfwGetTime() - start) * 1000.0);
+        }
+        unmap_file(&mapped);
+    } else {
+        long long source_size, source_mtime;
+        MappedFile source = map_file(filename);
+        bool ok = source.data && file_stat(filename, &source_size, &source_mtime);
+
+        uint64_t content_hash = ok ? hash_file_contents(source.data, source.size) : 0;
+        if (ok) texture = find_texture_by_hash(content_hash);
+        if (ok && !texture) {
+            TextureFileHeader header;
+            unsigned char* pixels = NULL;
+            ok = texture_info(&source, &header);
+            if (ok) {
+                header.source_size = source_size;
+                header.source_mtime = source_mtime;
+                header.content_hash = content_hash;
+
+                pixels = (unsigned char*) malloc(texture_pixels_size(&header));
+                ok = decode_texture(&source, &header, pixels);
+            }
+            if (ok) {
+                write_texture_cache(cache_filename, &header, pixels);
+
+                const unsigned char* levels[TEXTURE_MAX_LEVELS];
+                for (int i = 0; i < header.num_levels; i++) {
+                    levels[i] = pixels + header.level_offsets[i] - header.level_offsets[0];
+                }
+                texture = texture_add(filename, header.content_hash, upload_texture(&header, levels));
+                printf("Loaded texture '%s': %dx%d, %d levels in %.2f ms\n", filename,
+                       header.width, header.height, header.num_levels, (glfwGetTime() - start) * 1000.0);
+            }
+            free(pixels);
+        }
+        if (!ok) {
+            // nothing is cached, the next run tries again
+            fprintf(stderr, "Warning: could not load texture '%s', using a fallback color\n", filename);
+            texture = texture_add(filename, 0, upload_fallback_texture(texture_fallback_color));
+        }
+        unmap_file(&source);
+    }
+    texture->ref_count++;
+
+    return texture->id;
+}
+
+static void texture_release_unused(Texture* texture)
+{
+    glDeleteTextures(1, &texture->id);
+    free(texture->path);
+    *texture = textures[--textures_n];
+}
+
+void texture_release(GLuint id)
+{
+    for (int i = 0; i < textures_n; i++) {
+        if (textures[i].id != id) continue;
+
+        assert(textures[i].ref_count > 0);
+        // textures still streaming in are deleted once their upload is done
+        if (--textures[i].ref_count == 0 && !textures[i].streaming) {
+            texture_release_unused(&textures[i]);
+        }
+        return;
+    }
+}
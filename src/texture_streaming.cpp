@@ -0,0 +1,417 @@
+// Asynchronous texture loading.
+//
+// loadTextureAsync returns right away with a texture holding a 1x1 fallback
+// color. Worker threads map the image (or its cache, see texture.cpp),
+// decode it and build the mip chain straight into a slot of a persistently
+// mapped pixel unpack buffer. texture_streaming_update, called once per
+// frame on the GL thread, uploads at most TEXTURE_STREAM_BUDGET bytes per
+// frame from there, smallest mip level first. GL_TEXTURE_BASE_LEVEL follows
+// the uploaded levels, so textures sharpen over a few frames instead of
+// stalling one.
+//
+// Without ARB_buffer_storage, or for images larger than a slot, the workers
+// decode into malloc'ed memory and uploads come from there.
+
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+
+#define TEXTURE_STREAM_NO_SLOT -1
+
+struct TextureStreamJob {
+    char* path;
+    GLuint id;
+    double request_time;
+
+    // filled in by the worker
+    TextureFileHeader header;
+    bool from_cache;
+    bool failed;
+    int slot;
+    unsigned char* pixels; // levels laid out as in the cache file
+
+    // upload progress, GL thread only
+    int level; // counts down to 0
+    int row;
+    int first_update;
+
+    TextureStreamJob* next;
+};
+
+struct TextureStreamFence {
+    GLsync fence;
+    int slot;
+};
+
+static std::mutex stream_mutex;
+static std::condition_variable stream_cv; // new jobs, free slots and quitting
+static TextureStreamJob* stream_queue; // waiting for a worker
+static TextureStreamJob* stream_done; // decoded, waiting for the GL thread
+static bool stream_slot_busy[TEXTURE_STREAM_SLOTS];
+static bool stream_quit;
+static std::thread* stream_workers;
+static int stream_workers_n;
+
+// GL thread only
+static GLuint stream_pbo;
+static unsigned char* stream_pbo_data;
+static TextureStreamJob* stream_uploading;
+static TextureStreamFence stream_fences[TEXTURE_STREAM_SLOTS];
+static int stream_fences_n;
+static int stream_jobs_in_flight;
+static int stream_updates;
+
+static void push_job(TextureStreamJob** list, TextureStreamJob* job)
+{
+    // FIFO, the lists stay short
+    job->next = NULL;
+    while (*list) list = &(*list)->next;
+    *list = job;
+}
+
+static TextureStreamJob* pop_job(TextureStreamJob** list)
+{
+    TextureStreamJob* job = *list;
+    if (job) *list = job->next;
+    return job;
+}
+
+// Blocks until a PBO slot is free. Falls back to malloc when there are no
+// PBOs or the image does not fit.
+static unsigned char* texture_stream_alloc(TextureStreamJob* job, size_t size)
+{
+    job->slot = TEXTURE_STREAM_NO_SLOT;
+    if (stream_pbo_data && size <= TEXTURE_STREAM_SLOT_SIZE) {
+        std::unique_lock<std::mutex> lock(stream_mutex);
+        while (!stream_quit) {
+            for (int i = 0; i < TEXTURE_STREAM_SLOTS; i++) {
+                if (!stream_slot_busy[i]) {
+                    stream_slot_busy[i] = true;
+                    job->slot = i;
+                    return stream_pbo_data + (size_t) i * TEXTURE_STREAM_SLOT_SIZE;
+                }
+            }
+            stream_cv.wait(lock);
+        }
+    }
+    return (unsigned char*) malloc(size);
+}
+
+static void load_texture_job(TextureStreamJob* job)
+{
+    char cache_filename[512];
+    snprintf(cache_filename, sizeof(cache_filename), "%s%s", job->path, TEXTURE_CACHE_EXTENSION);
+
+    MappedFile mapped;
+    if (map_texture_cache(cache_filename, job->path, &mapped)) {
+        job->from_cache = true;
+        job->header = *(const TextureFileHeader*) mapped.data;
+        size_t size = texture_pixels_size(&job->header);
+        job->pixels = texture_stream_alloc(job, size);
+        memcpy(job->pixels, mapped.data + job->header.level_offsets[0], size);
+        job->level = job->header.num_levels - 1;
+        unmap_file(&mapped);
+        return;
+    }
+
+    long long source_size, source_mtime;
+    MappedFile source = map_file(job->path);
+    if (!source.data || !file_stat(job->path, &source_size, &source_mtime) ||
+        !texture_info(&source, &job->header)) {
+        fprintf(stderr, "Warning: could not load texture '%s'\n", job->path);
+        unmap_file(&source);
+        job->failed = true;
+        return;
+    }
+    job->header.source_size = source_size;
+    job->header.source_mtime = source_mtime;
+    job->header.content_hash = hash_file_contents(source.data, source.size);
+
+    job->pixels = texture_stream_alloc(job, texture_pixels_size(&job->header));
+    if (decode_texture(&source, &job->header, job->pixels)) {
+        write_texture_cache(cache_filename, &job->header, job->pixels);
+        job->level = job->header.num_levels - 1;
+    } else {
+        fprintf(stderr, "Warning: could not decode texture '%s'\n", job->path);
+        job->failed = true;
+    }
+    unmap_file(&source);
+}
+
+static void texture_stream_worker()
+{
+    std::unique_lock<std::mutex> lock(stream_mutex);
+    while (!stream_quit) {
+        TextureStreamJob* job = pop_job(&stream_queue);
+        if (!job) {
+            stream_cv.wait(lock);
+            continue;
+        }
+
+        lock.unlock();
+        load_texture_job(job);
+        lock.lock();
+
+        push_job(&stream_done, job);
+    }
+}
+
+// num_threads 0 = one thread per core, leaving one for the GL thread
+void texture_streaming_init(int num_threads)
+{
+    if (num_threads <= 0) {
+        num_threads = std::thread::hardware_concurrency() - 1;
+        if (num_threads < 1) num_threads = 1;
+    }
+
+    if (GLEW_ARB_buffer_storage) {
+        GLsizeiptr size = (GLsizeiptr) TEXTURE_STREAM_SLOTS * TEXTURE_STREAM_SLOT_SIZE;
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        glGenBuffers(1, &stream_pbo);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream_pbo);
+        glBufferStorage(GL_PIXEL_UNPACK_BUFFER, size, NULL, flags);
+        stream_pbo_data = (unsigned char*) glMapBufferRange(GL_PIXEL_UNPACK_BUFFER, 0, size, flags);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+    }
+
+    stream_quit = false;
+    stream_workers_n = num_threads;
+    stream_workers = new std::thread[num_threads];
+    for (int i = 0; i < num_threads; i++) {
+        stream_workers[i] = std::thread(texture_stream_worker);
+    }
+
+    printf("Texture streaming: %d threads, %s\n", num_threads,
+           stream_pbo_data ? "persistently mapped PBOs" : "no PBOs");
+}
+
+void texture_streaming_shutdown()
+{
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        stream_quit = true;
+    }
+    stream_cv.notify_all();
+    for (int i = 0; i < stream_workers_n; i++) {
+        stream_workers[i].join();
+    }
+    delete[] stream_workers;
+    stream_workers = NULL;
+    stream_workers_n = 0;
+
+    // drop the jobs still queued, decoded or uploading, the PBO and its
+    // slots go below
+    TextureStreamJob* lists[3] = { stream_queue, stream_done, stream_uploading };
+    stream_queue = stream_done = stream_uploading = NULL;
+    for (int i = 0; i < 3; i++) {
+        TextureStreamJob* job;
+        while ((job = pop_job(&lists[i]))) {
+            if (job->slot == TEXTURE_STREAM_NO_SLOT) free(job->pixels);
+            free(job->path);
+            free(job);
+        }
+    }
+    for (int i = 0; i < stream_fences_n; i++) glDeleteSync(stream_fences[i].fence);
+    stream_fences_n = 0;
+    memset(stream_slot_busy, 0, sizeof(stream_slot_busy));
+    stream_jobs_in_flight = 0;
+
+    if (stream_pbo) {
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, stream_pbo);
+        glUnmapBuffer(GL_PIXEL_UNPACK_BUFFER);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glDeleteBuffers(1, &stream_pbo);
+        stream_pbo = 0;
+        stream_pbo_data = NULL;
+    }
+}
+
+// Like loadTexture, but the texture shows fallback_rgb until its pixels are
+// streamed in by texture_streaming_update.
+GLuint loadTextureAsync(const char* filename, const unsigned char fallback_rgb[3])
+{
+    assert(filename && stream_workers_n > 0);
+
+    for (int i = 0; i < textures_n; i++) {
+        if (strcmp(textures[i].path, filename) == 0) {
+            textures[i].ref_count++;
+            return textures[i].id;
+        }
+    }
+
+    GLuint tex;
+    glGenTextures(1, &tex);
+    glBindTexture(GL_TEXTURE_2D, tex);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER, GL_LINEAR_MIPMAP_LINEAR);
+		glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+        glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        glTexImage2D(GL_TEXTURE_2D, 0, GL_RGB, 1, 1, 0, GL_RGB, GL_UNSIGNED_BYTE, fallback_rgb);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    glBindTexture(GL_TEXTURE_2D, 0);
+
+    Texture* texture = texture_add(filename, 0, tex);
+    texture->streaming = true;
+    texture->ref_count++;
+
+    TextureStreamJob* job = (TextureStreamJob*) calloc(1, sizeof(TextureStreamJob));
+    job->path = strdup(filename);
+    job->id = tex;
+    job->slot = TEXTURE_STREAM_NO_SLOT; // until texture_stream_alloc runs
+    job->request_time = glfwGetTime();
+    stream_jobs_in_flight++;
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        push_job(&stream_queue, job);
+    }
+    stream_cv.notify_one();
+
+    return tex;
+}
+
+static void free_slot(int slot)
+{
+    {
+        std::lock_guard<std::mutex> lock(stream_mutex);
+        stream_slot_busy[slot] = false;
+    }
+    stream_cv.notify_all();
+}
+
+static void finish_job(TextureStreamJob* job, bool uploaded_from_slot)
+{
+    if (job->slot != TEXTURE_STREAM_NO_SLOT) {
+        if (uploaded_from_slot) {
+            // the slot is reused once the GPU has read it
+            stream_fences[stream_fences_n].fence = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+            stream_fences[stream_fences_n].slot = job->slot;
+            stream_fences_n++;
+        } else {
+            free_slot(job->slot);
+        }
+    } else {
+        free(job->pixels);
+    }
+
+    Texture* texture = NULL;
+    for (int i = 0; i < textures_n && !texture; i++) {
+        if (textures[i].id == job->id) texture = &textures[i];
+    }
+    assert(texture);
+    texture->streaming = false;
+    texture->content_hash = job->header.content_hash;
+
+    if (texture->ref_count == 0) {
+        // released while streaming
+        texture_release_unused(texture);
+    } else if (!job->failed) {
+        printf("Streamed texture '%s'%s: %dx%d in %.2f ms, uploaded over %d frames\n", job->path,
+               job->from_cache ? " from cache" : "", job->header.width, job->header.height,
+               (glfwGetTime() - job->request_time) * 1000.0, stream_updates - job->first_update + 1);
+    }
+
+    stream_jobs_in_flight--;
+    free(job->path);
+    free(job);
+}
+
+// Uploads streamed texture data, at most budget bytes (but at least one
+// row) per call. Call once per frame on the GL thread. Returns the number of
+// bytes uploaded.
+size_t texture_streaming_update(size_t budget)
+{
+    for (int i = 0; i < stream_fences_n; i++) {
+        GLenum status = glClientWaitSync(stream_fences[i].fence, 0, 0);
+        if (status == GL_ALREADY_SIGNALED || status == GL_CONDITION_SATISFIED) {
+            glDeleteSync(stream_fences[i].fence);
+            free_slot(stream_fences[i].slot);
+            stream_fences[i--] = stream_fences[--stream_fences_n];
+        }
+    }
+
+    size_t uploaded = 0;
+    bool bound = false;
+    while (uploaded < budget || uploaded == 0) {
+        TextureStreamJob* job = stream_uploading;
+        if (!job) {
+            std::lock_guard<std::mutex> lock(stream_mutex);
+            job = stream_uploading = pop_job(&stream_done);
+            if (job) job->first_update = stream_updates;
+        }
+        if (!job) break;
+
+        bool released = false;
+        for (int i = 0; i < textures_n; i++) {
+            if (textures[i].id == job->id) released = textures[i].ref_count == 0;
+        }
+
+        if (job->failed || released) {
+            stream_uploading = NULL;
+            finish_job(job, false);
+            continue;
+        }
+
+        if (!bound) {
+            bound = true;
+            glPixelStorei(GL_UNPACK_ALIGNMENT, 1);
+        }
+        glBindTexture(GL_TEXTURE_2D, job->id);
+
+        const TextureFileHeader* header = &job->header;
+        if (job->level == header->num_levels - 1 && job->row == 0) {
+            // allocate every level up front, with no PBO bound so nothing is
+            // read. The fallback is replaced too, but the smallest level is a
+            // single row and is uploaded right below, before anything samples.
+            glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+            for (int i = 0; i < header->num_levels; i++) {
+                glTexImage2D(GL_TEXTURE_2D, i, GL_RGB, texture_level_size(header->width, i),
+                             texture_level_size(header->height, i), 0, GL_RGB, GL_UNSIGNED_BYTE, NULL);
+            }
+        }
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, job->slot != TEXTURE_STREAM_NO_SLOT ? stream_pbo : 0);
+        int w = texture_level_size(header->width, job->level);
+        int h = texture_level_size(header->height, job->level);
+        size_t row_size = (size_t) w * 3;
+
+        size_t rows = budget > uploaded ? (budget - uploaded) / row_size : 0;
+        if (rows < 1) rows = 1;
+        if (rows > (size_t) (h - job->row)) rows = h - job->row;
+
+        // with a PBO bound the pixel pointer is an offset into it
+        size_t offset = header->level_offsets[job->level] - header->level_offsets[0] + job->row * row_size;
+        const unsigned char* src = job->slot != TEXTURE_STREAM_NO_SLOT
+            ? (const unsigned char*) ((size_t) job->slot * TEXTURE_STREAM_SLOT_SIZE + offset)
+            : job->pixels + offset;
+
+        glTexSubImage2D(GL_TEXTURE_2D, job->level, 0, job->row, w, rows, GL_RGB, GL_UNSIGNED_BYTE, src);
+        uploaded += rows * row_size;
+        job->row += rows;
+
+        if (job->row == h) {
+            // levels job->level..num_levels-1 are complete, sample from them
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_BASE_LEVEL, job->level);
+            glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, header->num_levels - 1);
+            job->row = 0;
+            if (job->level-- == 0) {
+                stream_uploading = NULL;
+                finish_job(job, job->slot != TEXTURE_STREAM_NO_SLOT);
+            }
+        }
+    }
+
+    if (bound) {
+        glBindTexture(GL_TEXTURE_2D, 0);
+        glBindBuffer(GL_PIXEL_UNPACK_BUFFER, 0);
+        glPixelStorei(GL_UNPACK_ALIGNMENT, 4);
+    }
+
+    stream_updates++;
+    return uploaded;
+}
+
+int texture_streaming_pending()
+{
+    return stream_jobs_in_flight;
+}
@@ -0,0 +1,188 @@
+// Per-frame GPU data: uniform blocks shared by all scene programs and the
+// per-instance stream.
+//
+// FrameUniforms live in their own buffer, written once per frame after
+// the shadow passes.
+// PassUniforms and DrawUniforms are appended to one ring buffer: a pass
+// maps its pass block and DrawData blocks at once, and then only rebinds
+// them with glBindBufferRange. Instance data and indirect draw commands
+// are streamed the same way through their own buffers. Streams are
+// orphaned when they wrap, so mapping them never waits on the GPU.
+
+struct StreamBuffer {
+    GLenum target;
+    GLuint buffer;
+    GLsizeiptr size;
+    GLintptr head;
+    bool mapped;
+};
+
+static const char* uniform_block_names[UNIFORM_BLOCK_COUNT] = {
+    "FrameData",
+    "PassData",
+    "DrawData",
+};
+
+static GLuint frame_uniform_buffer;
+static StreamBuffer uniform_ring;
+static GLint uniform_ring_alignment;
+static StreamBuffer instance_stream;
+static StreamBuffer indirect_stream;
+
+static void stream_buffer_init(StreamBuffer* stream, GLenum target, GLsizeiptr size)
+{
+    stream->target = target;
+    stream->size = size;
+    stream->head = 0;
+    glGenBuffers(1, &stream->buffer);
+    glBindBuffer(target, stream->buffer);
+    glBufferData(target, size, NULL, GL_STREAM_DRAW);
+    glBindBuffer(target, 0);
+}
+
+// Maps size bytes of the stream, write-only: fill them with memcpy and
+// unmap before drawing. *offset is where they start in the buffer.
+static char* stream_buffer_map(StreamBuffer* stream, GLsizeiptr size, GLintptr* offset)
+{
+    assert(size <= stream->size);
+    *offset = stream->head;
+    stream->mapped = size > 0;
+    if (!stream->mapped) return NULL;
+
+    GLbitfield access = GL_MAP_WRITE_BIT | GL_MAP_UNSYNCHRONIZED_BIT | GL_MAP_INVALIDATE_RANGE_BIT;
+    if (stream->head + size > stream->size) {
+        stream->head = 0;
+        access = GL_MAP_WRITE_BIT | GL_MAP_INVALIDATE_BUFFER_BIT;
+    }
+
+    *offset = stream->head;
+    glBindBuffer(stream->target, stream->buffer);
+    char* data = (char*) glMapBufferRange(stream->target, stream->head, size, access);
+    stream->head += size;
+    return data;
+}
+
+static void stream_buffer_unmap(StreamBuffer* stream)
+{
+    if (!stream->mapped) return;
+    glBindBuffer(stream->target, stream->buffer);
+    glUnmapBuffer(stream->target);
+    glBindBuffer(stream->target, 0);
+}
+
+void uniform_buffers_init()
+{
+    glGetIntegerv(GL_UNIFORM_BUFFER_OFFSET_ALIGNMENT, &uniform_ring_alignment);
+
+    // shadow passes only read the far plane, they run before the frame's
+    // lights are written
+    FrameUniforms frame = {};
+    frame.far_plane = FAR_PLANE;
+    glGenBuffers(1, &frame_uniform_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_uniform_buffer);
+    glBufferData(GL_UNIFORM_BUFFER, sizeof(FrameUniforms), &frame, GL_DYNAMIC_DRAW);
+    glBindBufferBase(GL_UNIFORM_BUFFER, UNIFORM_BLOCK_FRAME, frame_uniform_buffer);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+
+    stream_buffer_init(&uniform_ring, GL_UNIFORM_BUFFER, UNIFORM_RING_SIZE);
+    stream_buffer_init(&instance_stream, GL_ARRAY_BUFFER, INSTANCE_STREAM_SIZE);
+#ifdef MULTI_DRAW_INDIRECT
+    if (GLEW_ARB_multi_draw_indirect) {
+        stream_buffer_init(&indirect_stream, GL_DRAW_INDIRECT_BUFFER, INDIRECT_STREAM_SIZE);
+    }
+#endif
+}
+
+// Points the program's uniform blocks at their binding points.
+void uniform_buffers_bind_blocks(GLuint program)
+{
+    for (int i = 0; i < UNIFORM_BLOCK_COUNT; i++) {
+        GLuint index = glGetUniformBlockIndex(program, uniform_block_names[i]);
+        if (index != GL_INVALID_INDEX) glUniformBlockBinding(program, index, i);
+    }
+}
+
+void update_frame_uniforms(Light* lights, int num_lights)
+{
+    assert(num_lights <= MAX_LIGHTS);
+    FrameUniforms frame = {};
+    frame.num_lights = num_lights;
+    frame.far_plane = FAR_PLANE;
+    for (int i = 0; i < num_lights; i++) {
+        LightUniforms* light = &frame.lights[i];
+        glm_vec3_copy(lights[i].pos, light->pos);
+        light->paraboloid = lights[i].shadow_mode == SHADOW_DUAL_PARABOLOID;
+        // faces are looked up the way they were drawn, which may be some
+        // frames ago
+        memcpy(light->shadow_face_view_proj, lights[i].shadow_face_view_proj, sizeof(light->shadow_face_view_proj));
+        shadow_atlas_tile_rects(&lights[i], light->shadow_tile_rects);
+    }
+
+    glBindBuffer(GL_UNIFORM_BUFFER, frame_uniform_buffer);
+    glBufferSubData(GL_UNIFORM_BUFFER, 0, sizeof(frame), &frame);
+    glBindBuffer(GL_UNIFORM_BUFFER, 0);
+}
+
+// Rounds the size of a block up so the next one starts at a valid offset
+// for glBindBufferRange.
+GLsizeiptr uniform_ring_block_size(GLsizeiptr size)
+{
+    return (size + uniform_ring_alignment - 1) / uniform_ring_alignment * uniform_ring_alignment;
+}
+
+// Maps size bytes of the ring, blocks within them must be laid out with
+// uniform_ring_block_size.
+char* uniform_ring_map(GLsizeiptr size, GLintptr* offset)
+{
+    return stream_buffer_map(&uniform_ring, size, offset);
+}
+
+void uniform_ring_unmap()
+{
+    stream_buffer_unmap(&uniform_ring);
+}
+
+void uniform_ring_bind(UniformBlock block, GLintptr offset, GLsizeiptr size)
+{
+    gl_state_bind_uniform_range(block, uniform_ring.buffer, offset, size);
+}
+
+InstanceData* instance_stream_map(int num_instances, GLintptr* offset)
+{
+    return (InstanceData*) stream_buffer_map(&instance_stream, num_instances * sizeof(InstanceData), offset);
+}
+
+void instance_stream_unmap()
+{
+    stream_buffer_unmap(&instance_stream);
+}
+
+// Points the instance attributes of the bound VAO at the instances
+// starting at offset in the stream.
+void instance_stream_attrib_pointers(GLintptr offset)
+{
+    glBindBuffer(GL_ARRAY_BUFFER, instance_stream.buffer);
+    for (int i = 0; i < 3; i++) {
+        glVertexAttribPointer(INSTANCE_ATTRIB_MODEL_ROWS + i, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                              (void*) (offset + offsetof(InstanceData, model_rows) + i * sizeof(vec4)));
+    }
+    glVertexAttribPointer(INSTANCE_ATTRIB_PARAMS, 4, GL_FLOAT, GL_FALSE, sizeof(InstanceData),
+                          (void*) (offset + offsetof(InstanceData, shininess)));
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+}
+
+DrawIndirectCommand* indirect_stream_map(int num_commands, GLintptr* offset)
+{
+    return (DrawIndirectCommand*) stream_buffer_map(&indirect_stream, num_commands * sizeof(DrawIndirectCommand), offset);
+}
+
+void indirect_stream_unmap()
+{
+    stream_buffer_unmap(&indirect_stream);
+}
+
+// Binds the stream to GL_DRAW_INDIRECT_BUFFER for glMultiDrawElementsIndirect.
+void indirect_stream_bind()
+{
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, indirect_stream.buffer);
+}
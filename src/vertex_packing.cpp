@@ -0,0 +1,137 @@
+// Packed vertex format (see PackedVertex).
+//
+// Normals and tangents are stored as signed normalized 10:10:10:2 with the
+// bitangent's handedness in the 2-bit w of the tangent, texture coordinates
+// as half floats and, optionally, positions as 16-bit signed normalized
+// values within the model's bounds. vert.glsl/shadow_vert.glsl undo the
+// position quantization with the posScale/posOffset uniforms.
+
+static inline unsigned short float_to_half(float value)
+{
+    unsigned int bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    unsigned int sign = (bits >> 16) & 0x8000;
+    int exponent = (int) ((bits >> 23) & 0xFF) - 127 + 15;
+    unsigned int mantissa = bits & 0x7FFFFF;
+
+    if (((bits >> 23) & 0xFF) == 0xFF) {
+        // inf/nan
+        return (unsigned short) (sign | 0x7C00 | (mantissa ? 0x200 : 0));
+    }
+    if (exponent >= 31) {
+        return (unsigned short) (sign | 0x7C00);
+    }
+    if (exponent <= 0) {
+        // denormal or zero
+        if (exponent < -10) return (unsigned short) sign;
+        mantissa |= 0x800000;
+        int shift = 14 - exponent;
+        unsigned int half = mantissa >> shift;
+        // round to nearest even
+        unsigned int rest = mantissa & ((1u << shift) - 1);
+        unsigned int halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half & 1))) half++;
+        return (unsigned short) (sign | half);
+    }
+
+    unsigned int half = sign | (exponent << 10) | (mantissa >> 13);
+    unsigned int rest = mantissa & 0x1FFF;
+    if (rest > 0x1000 || (rest == 0x1000 && (half & 1))) half++;
+    return (unsigned short) half;
+}
+
+static inline int pack_snorm(float value, int max)
+{
+    if (value > 1.0f) value = 1.0f;
+    if (value < -1.0f) value = -1.0f;
+    return (int) roundf(value * max);
+}
+
+// xyz as snorm10, w as snorm2 (-1 or 1)
+static inline unsigned int pack_2_10_10_10(float x, float y, float z, float w)
+{
+    unsigned int packed = 0;
+    packed |= (unsigned int) (pack_snorm(x, 511) & 0x3FF);
+    packed |= (unsigned int) (pack_snorm(y, 511) & 0x3FF) << 10;
+    packed |= (unsigned int) (pack_snorm(z, 511) & 0x3FF) << 20;
+    packed |= (unsigned int) (pack_snorm(w, 1) & 0x3) << 30;
+    return packed;
+}
+
+void model_pack_vertices(Model* model)
+{
+    free(model->packed_vertices);
+    model->packed_vertices = (PackedVertex*) malloc(model->num_vertices * sizeof(PackedVertex));
+
+#ifdef PACKED_VERTEX_POSITIONS_16
+    // snorm16 spans [-1, 1] over the bounds
+    for (int i = 0; i < 3; i++) {
+        model->position_offset[i] = (model->bounds_min[i] + model->bounds_max[i]) * 0.5f;
+        model->position_scale[i] = (model->bounds_max[i] - model->bounds_min[i]) * 0.5f;
+        if (model->position_scale[i] <= 0.0f) model->position_scale[i] = 1.0f;
+    }
+#else
+    glm_vec3_zero(model->position_offset);
+    model->position_scale[0] = model->position_scale[1] = model->position_scale[2] = 1.0f;
+#endif
+
+    for (int v = 0; v < model->num_vertices; v++) {
+        PackedVertex* out = &model->packed_vertices[v];
+
+#ifdef PACKED_VERTEX_POSITIONS_16
+        for (int i = 0; i < 3; i++) {
+            float p = (model->vertices[v][i] - model->position_offset[i]) / model->position_scale[i];
+            out->position[i] = (short) pack_snorm(p, 32767);
+        }
+        out->position[3] = 0;
+#else
+        glm_vec3_copy(model->vertices[v], out->position);
+#endif
+
+        vec3 normal;
+        glm_vec3_normalize_to(model->normals[v], normal);
+        out->normal = pack_2_10_10_10(normal[0], normal[1], normal[2], 0.0f);
+
+        if (model->has_tangents) {
+            vec3 tangent, cross;
+            glm_vec3_normalize_to(model->tangents[v], tangent);
+            glm_vec3_cross(model->normals[v], model->tangents[v], cross);
+            float sign = glm_vec3_dot(cross, model->bitangents[v]) < 0.0f ? -1.0f : 1.0f;
+            out->tangent = pack_2_10_10_10(tangent[0], tangent[1], tangent[2], sign);
+        } else {
+            out->tangent = pack_2_10_10_10(0.0f, 0.0f, 0.0f, 1.0f);
+        }
+
+        out->texture_coords[0] = float_to_half(model->texture_coords[v][0]);
+        out->texture_coords[1] = float_to_half(model->texture_coords[v][1]);
+    }
+
+    size_t float_size = model->num_vertices * (2 * sizeof(vec3) + sizeof(vec2) +
+                                               (model->has_tangents ? 2 * sizeof(vec3) : 0));
+    printf("Packed %d vertices: %zu -> %zu bytes\n", model->num_vertices,
+           float_size, model->num_vertices * sizeof(PackedVertex));
+}
+
+// Sets up the attributes of the VAO currently bound for a packed vertex
+// buffer, which must be bound to GL_ARRAY_BUFFER.
+void packed_vertex_attrib_pointers()
+{
+    GLsizei stride = sizeof(PackedVertex);
+
+    glEnableVertexAttribArray(0);
+#ifdef PACKED_VERTEX_POSITIONS_16
+    glVertexAttribPointer(0, 3, GL_SHORT, GL_TRUE, stride, (void*) offsetof(PackedVertex, position));
+#else
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, stride, (void*) offsetof(PackedVertex, position));
+#endif
+
+    glEnableVertexAttribArray(1);
+    glVertexAttribPointer(1, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*) offsetof(PackedVertex, normal));
+
+    glEnableVertexAttribArray(2);
+    glVertexAttribPointer(2, 2, GL_HALF_FLOAT, GL_FALSE, stride, (void*) offsetof(PackedVertex, texture_coords));
+
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(3, 4, GL_INT_2_10_10_10_REV, GL_TRUE, stride, (void*) offsetof(PackedVertex, tangent));
+}